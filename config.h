@@ -28,6 +28,16 @@
 #define CONTEXT_TREE_MIN_COUNT_ENCODER 1
 //#define CONTEXT_TREE_MIN_COUNT_ENCODER -1
 
+// typical fixed cost (in bits) of a compressed channel group: tree description, zero chance, rac flush
+#define COMPRESSED_GROUP_OVERHEAD 48
+// channel groups whose estimated compressed size exceeds the uncompressed size by this factor are not even tried compressed
+#define INCOMPRESSIBLE_ESTIMATE_MARGIN 1.3
+// ... but only if they are at least this large (in uncompressed bits); smaller groups are cheap to just try
+#define INCOMPRESSIBLE_ESTIMATE_MIN_BITS 8192
+
+// decode-cost-aware tree pruning: cost of computing one context property, relative to one tree node visit
+#define CONTEXT_TREE_PROPERTY_COST 0.5
+
 
 
 
@@ -46,8 +56,10 @@
 
 #ifdef _MSC_VER
 #define ATTRIBUTE_HOT
+#define RESTRICT __restrict
 #else
 #define ATTRIBUTE_HOT __attribute__ ((hot))
+#define RESTRICT __restrict__
 #endif
 
 #include "maniac/rac.h"
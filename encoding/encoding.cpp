@@ -25,7 +25,37 @@ SOFTWARE.
 
 #include "encoding.h"
 #include "context_predict.h"
-
+#include <chrono>
+
+// Random number generator for picking the rows to learn MANIAC trees on.
+// Same sequence as glibc's rand(), but the state is per thread and reset for every encode,
+// so the result of an encode does not depend on other encodes done before or in parallel.
+class LearningRNG {
+    uint32_t state[31];
+    int f, r;
+public:
+    LearningRNG() { seed(1); }
+    void seed(uint32_t s) {
+        int32_t word = (s ? s : 1);
+        state[0] = word;
+        for (int i=1; i<31; i++) {
+            int32_t hi = word / 127773;
+            int32_t lo = word % 127773;
+            word = 16807 * lo - 2836 * hi;
+            if (word < 0) word += 2147483647;
+            state[i] = word;
+        }
+        f = 3; r = 0;
+        for (int i=0; i<310; i++) next();
+    }
+    int next() {
+        uint32_t val = (state[f] += state[r]);
+        if (++f >= 31) f = 0;
+        if (++r >= 31) r = 0;
+        return val >> 1;
+    }
+};
+static thread_local LearningRNG learning_rng;
 
 
 
@@ -72,7 +102,7 @@ bool check_bit_depth(pixel_type minv, pixel_type maxv, int predictor) {
 }
 
 template <typename IO, typename Rac, typename Coder, bool learn, bool compress>
-bool fuif_encode_channels(IO& io, Tree &tree, fuif_options &options, int predictor, int beginc, int endc, const Image &image, size_t &header_pos) {
+bool fuif_encode_channels(IO& io, Tree &tree, fuif_options &options, int predictor, int beginc, int endc, const Image &image, size_t &header_pos, uint64_t *estimated_bits = NULL) {
   assert(endc >= beginc);
   write_big_endian_varint(io, ((endc-beginc) << 4) + (predictor << 1) + (compress?1:0));
   if (endc>beginc) v_printf(5,"Encoding%s channels %i-%i\n", (compress?"":" uncompressed"), beginc, endc);
@@ -182,7 +212,7 @@ bool fuif_encode_channels(IO& io, Tree &tree, fuif_options &options, int predict
         Channel references(properties.size() - NB_NONREF_PROPERTIES, channel.w, 0, 0);
         for (int y=0; y<channel.h; y++) {
             if (learn) { if (++rowslearned > options.nb_repeats*channel.h) break; }
-            if (learn) y=rand()%channel.h; // try random rows, to avoid giving priority to the top of the image (because then the y property cannot be learned)
+            if (learn) y=learning_rng.next()%channel.h; // try random rows, to avoid giving priority to the top of the image (because then the y property cannot be learned)
             precompute_references(channel, y, image, beginc, options, references);
             for (int x=0; x<channel.w; x++) {
                 pixel_type guess;
@@ -198,6 +228,16 @@ bool fuif_encode_channels(IO& io, Tree &tree, fuif_options &options, int predict
             if (learn) { y=0; } // set to zero in case random row was channel.h-1
         }
     }
+    if (learn && options.tree_cost > 0) {
+        uint64_t penalty_bits = coder.prune_decode_cost(options.tree_cost, predictor == 0);
+        if (options.nb_repeats > 0) {
+            // the tree was learned on a fraction nb_repeats of the rows, so scale the penalty accordingly
+            float penalty = penalty_bits / 8.0 / options.nb_repeats;
+            v_printf(4,"Decode-cost pruning of channel %i-%i: estimated penalty %.0f bytes\n", beginc, endc, penalty);
+            options.tree_cost_penalty += penalty;
+        }
+    }
+    if (learn && estimated_bits && options.nb_repeats > 0) *estimated_bits += coder.estimate_total_size() / options.nb_repeats;
     coder.simplify();
   }
 
@@ -256,8 +296,26 @@ const char * ch_describe(const Image &image, int i) {
 }
 
 
+// time budget and cancellation of a decode (see fuif_options)
+class DecodeInterrupt {
+    std::chrono::steady_clock::time_point deadline;
+    bool has_deadline;
+    const std::atomic<bool> *cancel;
+public:
+    bool interrupted;
+
+    DecodeInterrupt(float time_budget, const std::atomic<bool> *c) : has_deadline(time_budget > 0), cancel(c), interrupted(false) {
+        if (has_deadline) deadline = std::chrono::steady_clock::now() + std::chrono::microseconds((int64_t)(time_budget * 1000));
+    }
+    bool enabled() const { return has_deadline || cancel; }
+    bool check() {
+        if (!interrupted && ((cancel && *cancel) || (has_deadline && std::chrono::steady_clock::now() >= deadline))) interrupted = true;
+        return interrupted;
+    }
+};
+
 template <typename IO, typename Coder>
-bool fuif_decode_channel(IO& io, fuif_options &options, int &beginc, Image &image, size_t bytes_to_load) {
+bool fuif_decode_channel(IO& io, fuif_options &options, int &beginc, Image &image, size_t bytes_to_load, DecodeInterrupt &stop) {
 
   long unsigned filepos = io.ftell();
   if (io.isEOF() || (bytes_to_load && io.ftell() >= bytes_to_load)) return true;
@@ -290,6 +348,11 @@ bool fuif_decode_channel(IO& io, fuif_options &options, int &beginc, Image &imag
         channel.minval += read_big_endian_varint(io);
         channel.maxval = channel.minval + read_big_endian_varint(io);
     }
+    if (channel.maxval < channel.minval) {
+        if (io.isEOF()) return true;
+        e_printf("Invalid range for channel %i.\n",i);
+        return false;
+    }
     if (channel.minval == channel.maxval) {
         channel.data = std::vector<pixel_type>(channel.w * channel.h, channel.minval);
         v_printf(3,"[File position %lu] Decoding channel %i: %ix%i %s, constant %i\n", filepos, i, channel.w, channel.h, ch_describe(image,i), channel.minval);
@@ -343,11 +406,12 @@ bool fuif_decode_channel(IO& io, fuif_options &options, int &beginc, Image &imag
              v_printf(3,"Premature end-of-file at row %i.\n",y);
              break;
           }
+          if (stop.check()) break;
           for (int x=0; x<channel.w; x++) {
              channel.value(y,x) = coder.read_int(channel.minval,channel.maxval-channel.minval);
           }
         }
-        if (io.isEOF() || (bytes_to_load && io.ftell() >= bytes_to_load)) break;
+        if (io.isEOF() || (bytes_to_load && io.ftell() >= bytes_to_load) || stop.interrupted) break;
     }
     beginc = endc;
     return true;
@@ -355,7 +419,7 @@ bool fuif_decode_channel(IO& io, fuif_options &options, int &beginc, Image &imag
 
   Tree tree;
   MetaPropertySymbolCoder<FUIFBitChanceTree, RacIn<IO>> metacoder(rac, propRanges);
-  if (!metacoder.read_tree(tree)) return corrupt_or_truncated(io, image.channel[beginc], bytes_to_load);
+  if (!metacoder.read_tree(tree, options.max_tree_nodes)) return corrupt_or_truncated(io, image.channel[beginc], bytes_to_load);
 
   Coder coder(rac, propRanges, tree, predictability, CONTEXT_TREE_SPLIT_THRESHOLD, options.maniac_cutoff, options.maniac_alpha);
   Properties properties(propRanges.size());
@@ -377,6 +441,7 @@ bool fuif_decode_channel(IO& io, fuif_options &options, int &beginc, Image &imag
          beginc = i;
          break;
         }
+        if (stop.check()) break;
        for (int x=0; x<channel.w; x++) {
         channel.value(y,x) = coder.read_int(properties, channel.minval, channel.maxval);
        }
@@ -392,6 +457,7 @@ bool fuif_decode_channel(IO& io, fuif_options &options, int &beginc, Image &imag
          beginc = i;
          break;
       }
+      if (stop.check()) break;
       precompute_references(channel, y, image, beginc, options, references);
       if (y <= 1 || predictor) {
        for (int x=0; x<channel.w; x++) {
@@ -421,7 +487,7 @@ bool fuif_decode_channel(IO& io, fuif_options &options, int &beginc, Image &imag
       }
     }
     }
-    if (io.isEOF() || (bytes_to_load && io.ftell() >= bytes_to_load)) break;
+    if (io.isEOF() || (bytes_to_load && io.ftell() >= bytes_to_load) || stop.interrupted) break;
   }
 
   beginc = endc;
@@ -451,10 +517,77 @@ int find_best_predictor(const Channel &channel) {
 
 const int responsive_sizes[5] = {0, 16, 8, 4, 2};
 
+int channel_predictor(const fuif_options &options, int i) {
+    if (options.predictor.size() > i) return options.predictor[i];
+    else if (options.predictor.size() > 0) return options.predictor.back();
+    else return 0;
+}
+
+// returns the last channel of the channel group that starts at channel i
+int channel_group_end(const Image &image, const fuif_options &options, int i) {
+    int j=i;
+    // do several channels at a time (keep going until we hit a new downscale truncation point)
+    for (int s=1; s<5; s++) if (j > image.downscales[s] && j < image.downscales[s+1]) j = image.downscales[s+1];
+
+    // needed for interleaved (which we don't use), and maybe a good idea in any case: only clump same-dimension channels
+    for (int k=i+1; k<=j; k++) if (image.channel[i].w != image.channel[k].w || image.channel[i].h != image.channel[k].h) { j=k-1; break; }
+
+    if (options.max_group > 0 && j > i + options.max_group - 1) j = i + options.max_group - 1;
+    return j;
+}
+
+// uncompressed size estimate (in bits) of channels i..j
+float channel_group_uncompressed_bits(const Image &image, int i, int j) {
+    float ubits = 0.0;
+    for (int k=i; k<=j; k++) {
+        float chpixels = image.channel[k].w*image.channel[k].h;
+        float uncompressed_bpp = maniac::util::ilog2(image.channel[k].maxval-image.channel[k].minval)+1;
+        if (image.channel[k].maxval > image.channel[k].minval)
+            ubits += chpixels*uncompressed_bpp;
+    }
+    if (ubits > 0.0) ubits += 16; // rac flush might add 2 bytes
+    return ubits;
+}
+
+// cheap estimate of the encoded size (in bytes) of the channel data, up to the given responsive truncation point (-1: everything)
+// only does the (sampled) MANIAC learning passes, no actual encoding
+size_t fuif_estimate(const Image &image, fuif_options &options, int level) {
+    if (image.error) return 0;
+    fuif_options eoptions = options;
+    if (eoptions.nb_repeats <= 0) eoptions.nb_repeats = 0.25; // need at least some learning to get an estimate
+    learning_rng.seed(1);
+    eoptions.debug = false;
+    int nb_channels = image.channel.size();
+    int last = nb_channels - 1;
+    if (level >= 0 && level < 5 && image.downscales[level] < last) last = image.downscales[level];
+    float bits = 0;
+    for (int i=0; i<=last; i++) {
+        if (! image.channel[i].w || ! image.channel[i].h ) continue;
+        int predictor = channel_predictor(options, i);
+        int j = (eoptions.compress ? channel_group_end(image, eoptions, i) : i);
+        float ubits = channel_group_uncompressed_bits(image, i, j);
+        if (eoptions.compress) {
+            Tree tree;
+            size_t header_pos;
+            DummyIO dummyio;
+            uint64_t estimated_bits = 0;
+            if (ubits > 0 && !fuif_encode_channels<DummyIO, RacDummy<DummyIO>, PropertySymbolCoder<FUIFBitChancePass1, RacDummy<DummyIO>, MAX_BIT_DEPTH>, true, true >(dummyio, tree, eoptions, predictor, i, j, image, header_pos, &estimated_bits)) return 0;
+            if (estimated_bits > 0 && estimated_bits + COMPRESSED_GROUP_OVERHEAD < ubits) ubits = estimated_bits + COMPRESSED_GROUP_OVERHEAD;
+        }
+        bits += ubits + 8; // plus a byte or so of group header
+        i=j;
+    }
+    v_printf(5,"Estimated size up to channel %i: %.0f bytes\n", last, bits/8);
+    return bits/8;
+}
+
 
 template <typename IO>
 bool fuif_encode(IO& realio, const Image &image, fuif_options &options) {
     if (image.error) return false;
+    if (options.nb_threads >= 0) set_nb_threads(options.nb_threads);
+    learning_rng.seed(1);
+    options.tree_cost_penalty = 0;
     if (image.nb_frames < 2) realio.fputs("FUIF");  // bytes 1-4 are fixed magic
     else realio.fputs("FUAF");                      // animation has different magic
     int nb_channels = image.real_nb_channels;
@@ -499,8 +632,7 @@ bool fuif_encode(IO& realio, const Image &image, fuif_options &options) {
     // encode channel data
     for (int i=0; i<nb_channels; i++) {
         if (! image.channel[i].w || ! image.channel[i].h ) continue; // skip empty channels
-        int predictor = 0;
-        if (options.predictor.size() > i) predictor = options.predictor[i]; else if (options.predictor.size() > 0) predictor = options.predictor.back(); else predictor = 0;
+        int predictor = channel_predictor(options, i);
 //        if (predictor < 0) predictor = find_best_predictor(image.channel[i]);
 
         int j=i;
@@ -512,30 +644,44 @@ bool fuif_encode(IO& realio, const Image &image, fuif_options &options) {
             continue;
         }
 
-        // do several channels at a time (keep going until we hit a new downscale truncation point)
-        for (int s=1; s<5; s++) if (j > image.downscales[s] && j < image.downscales[s+1]) j = image.downscales[s+1];
+        j = channel_group_end(image, options, i);
 
-        // needed for interleaved (which we don't use), and maybe a good idea in any case: only clump same-dimension channels
-        for (int k=i+1; k<=j; k++) if (image.channel[i].w != image.channel[k].w || image.channel[i].h != image.channel[k].h) { j=k-1; break; }
+        float pixels = 0.0;
+        for (int k=i; k<=j; k++) pixels += image.channel[k].w*image.channel[k].h;
+        float ubits = channel_group_uncompressed_bits(image, i, j);
+        size_t before=io.ftell();
+        size_t after;
 
-        if (options.max_group > 0 && j > i + options.max_group - 1) j = i + options.max_group - 1;
+        if (ubits == 0) {
+            // all channels are trivial, nothing to learn or compress
+            if (!fuif_encode_channels<BlobIO, RacOut<BlobIO>, FinalPropertySymbolCoder<FUIFBitChancePass2, RacOut<BlobIO>, MAX_BIT_DEPTH>, false, false >(io, tree, options, predictor, i, j, image, header_pos)) return false;
+            after=io.ftell();
+            for (int s=0; s<5; s++) {
+                if (image.downscales[s] >= i && image.downscales[s] <= j) responsive_offsets[s] = after;
+            }
+            i=j;
+            continue;
+        }
 
         DummyIO dummyio;
-        if (!fuif_encode_channels<DummyIO, RacDummy<DummyIO>, PropertySymbolCoder<FUIFBitChancePass1, RacDummy<DummyIO>, MAX_BIT_DEPTH>, true, true >(dummyio, tree, options, predictor, i, j, image, header_pos)) return false;
-        size_t before=io.ftell();
+        uint64_t estimated_bits = 0;
+        if (!fuif_encode_channels<DummyIO, RacDummy<DummyIO>, PropertySymbolCoder<FUIFBitChancePass1, RacDummy<DummyIO>, MAX_BIT_DEPTH>, true, true >(dummyio, tree, options, predictor, i, j, image, header_pos, &estimated_bits)) return false;
+
+        if (ubits >= INCOMPRESSIBLE_ESTIMATE_MIN_BITS && estimated_bits > 0 && estimated_bits + COMPRESSED_GROUP_OVERHEAD >= ubits * INCOMPRESSIBLE_ESTIMATE_MARGIN) {
+            // clearly incompressible according to the learning pass, so don't bother trying
+            if (!fuif_encode_channels<BlobIO, RacOut<BlobIO>, FinalPropertySymbolCoder<FUIFBitChancePass2, RacOut<BlobIO>, MAX_BIT_DEPTH>, false, false >(io, tree, options, predictor, i, j, image, header_pos)) return false;
+            after=io.ftell();
+            v_printf(4,"Encoded channel %i-%i UNCOMPRESSED (%ix%i %s, range %i..%i), %i+%i bytes (%f bpp; compressed estimate: %f bpp)\n", i, j, image.channel[i].w, image.channel[i].h, ch_describe(image,i), image.channel[i].minval, image.channel[i].maxval, after-header_pos, header_pos-before, (after-header_pos)*8.0/pixels, estimated_bits/pixels);
+            for (int s=0; s<5; s++) {
+                if (image.downscales[s] >= i && image.downscales[s] <= j) responsive_offsets[s] = after;
+            }
+            i=j;
+            continue;
+        }
+
         if (!fuif_encode_channels<BlobIO, RacOut<BlobIO>, FinalPropertySymbolCoder<FUIFBitChancePass2, RacOut<BlobIO>, MAX_BIT_DEPTH>, false, true >(io, tree, options, predictor, i, j, image, header_pos)) return false;
-        size_t after=io.ftell();
+        after=io.ftell();
         float bits = (after-header_pos)*8.0;
-        float pixels = 0.0;
-        float ubits = 0.0;
-        for (int k=i; k<=j; k++) {
-            float chpixels = image.channel[k].w*image.channel[k].h;
-            float uncompressed_bpp = maniac::util::ilog2(image.channel[k].maxval-image.channel[k].minval)+1;
-            pixels += chpixels;
-            if (image.channel[k].maxval > image.channel[k].minval)
-                ubits += chpixels*uncompressed_bpp;
-        }
-        if (ubits > 0.0) ubits += 16; // rac flush might add 2 bytes
         float bpp=bits/pixels;
         float ubpp=ubits/pixels;
 
@@ -564,6 +710,11 @@ bool fuif_encode(IO& realio, const Image &image, fuif_options &options) {
         relative_offset = responsive_offsets[s];
     }
 
+    if (options.level_bytes) {
+        for (int s=0; s<5; s++) options.level_bytes[s] = realio.ftell() + responsive_offsets[s];
+        options.level_bytes[5] = realio.ftell() + io.ftell();
+    }
+    if (options.tree_cost > 0) v_printf(2,"Decode-cost tree pruning: estimated penalty of %.0f bytes.\n", options.tree_cost_penalty);
     if (options.debug) options.heatmap.recompute_minmax();
 
     io.fseek(0,SEEK_SET);
@@ -572,6 +723,24 @@ bool fuif_encode(IO& realio, const Image &image, fuif_options &options) {
     return true;
 }
 
+template <typename IO>
+bool fuif_encode_frame_index(IO& io, const Image &animation, const std::vector<std::vector<uint8_t>> &frames) {
+    if (animation.nb_frames < 2 || frames.size() != animation.nb_frames) return false;
+    io.fputs("FUAI");
+    write_big_endian_varint(io, animation.w-1);
+    write_big_endian_varint(io, animation.h-1);
+    write_big_endian_varint(io, animation.nb_frames-2);
+    write_big_endian_varint(io, animation.den-1);
+    if (animation.num.size() == 0) write_big_endian_varint(io, 0);
+    else for (int i=0; i<animation.num.size(); i++) write_big_endian_varint(io, animation.num[i]);
+    write_big_endian_varint(io, animation.loops);
+    for (const std::vector<uint8_t> &frame : frames) write_big_endian_varint(io, frame.size());
+    v_printf(2,"Writing %i frames with a frame index.\n", animation.nb_frames);
+    for (const std::vector<uint8_t> &frame : frames)
+        for (uint8_t c : frame) io.fputc(c);
+    return true;
+}
+
 // Permutation is a special transform since it has to be done on the channel metadata as soon as possible if it has no parameters
 void inv_permute_meta(Image &input) {
     v_printf(5,"Permutation (Meta): ");
@@ -596,12 +765,87 @@ void inv_permute_meta(Image &input) {
 }
 
 
+// a StreamReader that ran out of data did not get the whole header/group, so it has to be tried again later
+template<typename IO> bool io_starved(const IO &io) { return false; }
+template<> bool io_starved(const StreamReader &io) { return io.isStarved(); }
+
+// rough estimate of the peak memory use of decoding an image (after the meta_apply of its transforms):
+// all channel data as decoded, plus the reconstructed image (undoing the transforms needs about that much at the end)
+uint64_t decode_memory_estimate(const Image &image) {
+    uint64_t samples = (uint64_t)image.w * image.h * image.real_nb_channels;
+    for (const Channel &ch : image.channel) if (ch.w > 0 && ch.h > 0) samples += (uint64_t)ch.w * ch.h;
+    return samples * sizeof(pixel_type) + image.channel.size() * sizeof(Channel);
+}
+
+bool memory_within_limit(uint64_t needed, const fuif_options &options) {
+    if (options.max_memory && needed > options.max_memory) {
+        e_printf("Decoding needs about %llu MB of memory, the limit is %llu MB.\n", (unsigned long long)(needed >> 20), (unsigned long long)(options.max_memory >> 20));
+        return false;
+    }
+    return true;
+}
+
+// decodes the header of an animation with a frame index (after the magic): 'info' gets the animation info but no channels,
+// frame_offsets gets the absolute file positions of the frames (and of the end of the last frame)
 template<typename IO>
-bool fuif_decode(IO& io, Image &image, fuif_options options) {
+bool fuif_decode_frame_index(IO& io, Image &info, std::vector<size_t> &frame_offsets, fuif_options &options) {
+    int w = read_big_endian_varint(io)+1;
+    int h = read_big_endian_varint(io)+1;
+    int nb_frames = read_big_endian_varint(io)+2;
+    int den = read_big_endian_varint(io)+1;
+    std::vector<int> num;
+    int numerator = read_big_endian_varint(io);
+    if (numerator) {
+        num.push_back(numerator);
+        for (int i=1; i<nb_frames && !io.isEOF(); i++) num.push_back(read_big_endian_varint(io));
+    }
+    int loops = read_big_endian_varint(io);
+    if (io_starved(io)) return false;
+    if (w < 1 || h < 1 || nb_frames < 2 || nb_frames > h || h % nb_frames || den < 1 || loops < 0) {
+        e_printf("Invalid header.\n");
+        return false;
+    }
+    if (options.max_pixels && (uint64_t)w * h > options.max_pixels) {
+        e_printf("Image has %llu pixels, the limit is %llu.\n", (unsigned long long)w * h, (unsigned long long)options.max_pixels);
+        return false;
+    }
+    std::vector<size_t> offsets(1, 0);
+    for (int f=0; f<nb_frames && !io.isEOF(); f++) {
+        int size = read_big_endian_varint(io);
+        if (size < 0) break;
+        offsets.push_back(offsets.back() + size);
+    }
+    if (io_starved(io)) return false;
+    if (offsets.size() != nb_frames+1) {
+        e_printf("Invalid frame index.\n");
+        return false;
+    }
+    for (size_t &offset : offsets) offset += io.ftell();
+    if (options.identify) v_printf(1,"%s: %ix%i animation (%i frames) with a frame index\n", io.getName(), w, h/nb_frames, nb_frames);
+    else v_printf(2,"Decoding %ix%i animation (%i frames) with a frame index.\n", w, h/nb_frames, nb_frames);
+    info = Image(w, h, 0, 0, 0, false);
+    info.nb_frames = nb_frames;
+    info.den = den;
+    info.num = num;
+    info.loops = loops;
+    frame_offsets = std::move(offsets);
+    return true;
+}
+
+// decodes the header and applies the transforms to the (still empty) image
+// responsive_offsets gets the absolute file positions of the truncation points
+// if frame_offsets is set, animations with a frame index are accepted too (then only the frame index is decoded, into frame_offsets)
+template<typename IO>
+bool fuif_decode_header(IO& io, Image &image, fuif_options &options, int responsive_offsets[5], std::vector<size_t> *frame_offsets = NULL) {
     char buff[5];
-    if (!io.gets(buff,5)) { e_printf("Could not read header from file: %s\n",io.getName()); return false; }
+    if (!io.gets(buff,5)) {
+        if (!io_starved(io)) e_printf("Could not read header from file: %s\n",io.getName());
+        return false;
+    }
     bool multi_frame = false;
     if (!strcmp(buff,"FUAF")) { multi_frame = true; }
+    else if (!strcmp(buff,"FUAI") && frame_offsets) return fuif_decode_frame_index(io, image, *frame_offsets, options);
+    else if (!strcmp(buff,"FUAI")) { e_printf("Unexpected frame index in %s\n",io.getName()); return false; }
     else if (strcmp(buff,"FUIF")) { e_printf("%s is not a FUIF file\n",io.getName()); return false; }
     int nb_channels = read_big_endian_varint(io) - '0';
     int bit_depth = read_big_endian_varint(io) - '&';
@@ -617,41 +861,88 @@ bool fuif_decode(IO& io, Image &image, fuif_options options) {
         int numerator = read_big_endian_varint(io);
         if (numerator) {
             num.push_back(numerator);
-            for (int i=1; i<nb_frames; i++) num.push_back(read_big_endian_varint(io));
+            for (int i=1; i<nb_frames && !io.isEOF(); i++) num.push_back(read_big_endian_varint(io));
         }
         loops = read_big_endian_varint(io);
     }
     int colormodel = read_big_endian_varint(io);
+    int max_properties = read_big_endian_varint(io);
+    long basic_info_size = io.ftell();
+
+    for (int s=0; s<5; s++) responsive_offsets[s] = 0;
+    if (nb_channels >= 1) {
+      int relative_offset = 0;
+      for (int s=0; s<5; s++) {
+        responsive_offsets[s] = read_big_endian_varint(io)*TRUNCATION_OFFSET_RESOLUTION + relative_offset;
+        relative_offset = responsive_offsets[s];
+      }
+      relative_offset = io.ftell();
+      for (int s=0; s<5; s++) responsive_offsets[s] += relative_offset;
+    }
+    long offsets_size = io.ftell();
+
+    // read the transforms first, so nothing is applied before the whole header is there
+    std::vector<Transform> transforms;
+    if (nb_channels >= 1) {
+      int nb_transforms = read_big_endian_varint(io);
+      for (int i=0; i<nb_transforms && !io.isEOF(); i++) {
+        int id_and_nb_params = read_big_endian_varint(io);
+        Transform t(id_and_nb_params & 0xf);
+        if (t.has_parameters()) {
+            int nb_params = (id_and_nb_params >> 4);
+            for (int j=0; j<nb_params && !io.isEOF(); j++) t.parameters.push_back(read_big_endian_varint(io));
+        }
+        transforms.push_back(t);
+      }
+    }
+    if (io_starved(io)) return false;
+    for (const Transform &t : transforms) if (t.ID >= transform_name.size()) {
+        e_printf("Unknown transformation (ID=%i)\n",t.ID);
+        return false;
+    }
+
     if (options.identify) {
         v_printf(1,"%s: %i-channel, %i-bit, ", io.getName(), nb_channels, bit_depth);
         if (multi_frame) v_printf(1,"%ix%i %s%s animation (%i frames)\n", w, h/nb_frames, colormodel_name(colormodel,nb_channels), colorprofile_name(colormodel), nb_frames);
         else v_printf(1,"%ix%i %s%s image\n", w, h, colormodel_name(colormodel,nb_channels), colorprofile_name(colormodel));
     }
-    options.max_properties = read_big_endian_varint(io);
+    options.max_properties = max_properties;
 
     v_printf(4,"Global option: up to %i back-referencing MANIAC properties.\n", options.max_properties);
 
-    v_printf(7,"First part of header decoded (basic info). Read %i bytes so far.\n",io.ftell());
+    v_printf(7,"First part of header decoded (basic info). Read %i bytes so far.\n",basic_info_size);
 
-    if (!options.identify) {
-        image = Image(w, h, (1<<bit_depth)-1, nb_channels, colormodel);
-        image.nb_frames = nb_frames;
-        image.den = den;
-        image.num = num;
-        image.loops = loops;
+    if (w < 1 || h < 1 || nb_channels < 0 || nb_frames < 1 || nb_frames > h || bit_depth < 0 || bit_depth > 30) {
+        e_printf("Invalid header.\n");
+        return false;
+    }
+    if (options.max_pixels && (uint64_t)w * h > options.max_pixels) {
+        e_printf("Image has %llu pixels, the limit is %llu.\n", (unsigned long long)w * h, (unsigned long long)options.max_pixels);
+        return false;
+    }
+    if (options.max_channels && nb_channels > options.max_channels) {
+        e_printf("Image has %i channels, the limit is %i.\n", nb_channels, options.max_channels);
+        return false;
+    }
+    // before the transforms, this is what decoding at least takes
+    if (!memory_within_limit(((uint64_t)w * h * nb_channels * 2) * sizeof(pixel_type) + nb_channels * sizeof(Channel), options)) return false;
+
+    // with identify, the transforms are only applied (to a scratch image) to estimate the memory use
+    bool build_image = (!options.identify || options.peak_memory);
+    Image scratch;
+    Image &target = (options.identify ? scratch : image);
+    if (build_image) {
+        target = Image(w, h, (1<<bit_depth)-1, nb_channels, colormodel, false);
+        target.nb_frames = nb_frames;
+        target.den = den;
+        target.num = num;
+        target.loops = loops;
+        target.reduced_scale = (options.preview >= 0);
     }
 
     if (nb_channels < 1) return true; // is there any use for a zero-channel image?
 
-    int responsive_offsets[5];
-    int relative_offset = 0;
     for (int s=0; s<5; s++) {
-        responsive_offsets[s] = read_big_endian_varint(io)*TRUNCATION_OFFSET_RESOLUTION + relative_offset;
-        relative_offset = responsive_offsets[s];
-    }
-    relative_offset = io.ftell();
-    for (int s=0; s<5; s++) {
-        responsive_offsets[s] += relative_offset;
         if (s) v_printf(3,"Responsive truncation point for size 1/%i at position %i\n",responsive_sizes[s],responsive_offsets[s]);
         else v_printf(3,"Responsive truncation point for LQIP at position %i\n",responsive_offsets[s]);
     }
@@ -667,25 +958,20 @@ bool fuif_decode(IO& io, Image &image, fuif_options options) {
     }
 
 
-    v_printf(7,"Second part of header decoded (responsive offsets and global parameters; before transforms). Read %i bytes so far.\n",io.ftell());
+    v_printf(7,"Second part of header decoded (responsive offsets and global parameters; before transforms). Read %i bytes so far.\n",offsets_size);
 
-    // decode transforms
-    int nb_transforms = read_big_endian_varint(io);
-    v_printf(2,"Image data underwent %i transformations: ",nb_transforms);
-    for (int i=0; i<nb_transforms; i++) {
-        int id_and_nb_params = read_big_endian_varint(io);
-        Transform t(id_and_nb_params & 0xf);
-        if (t.has_parameters()) {
-            int nb_params = (id_and_nb_params >> 4);
-            for (int j=0; j<nb_params; j++) t.parameters.push_back(read_big_endian_varint(io));
-        }
-        if (!options.identify) {
-            t.meta_apply(image);
-            image.transform.push_back(t);
+    // apply transforms
+    v_printf(2,"Image data underwent %i transformations: ",(int)transforms.size());
+    for (int i=0; i<transforms.size(); i++) {
+        Transform &t = transforms[i];
+        if (build_image && !target.error) {
+            t.meta_apply(target);
+            target.transform.push_back(t);
+            if (!memory_within_limit(decode_memory_estimate(target), options)) return false;
         }
         if (i) v_printf(2,", ");
         v_printf(2,"%s",t.name());
-        if (t.ID == TRANSFORM_PALETTE) {
+        if (t.ID == TRANSFORM_PALETTE && t.parameters.size() == 3) {
             if (t.parameters[0] == t.parameters[1]) v_printf(3,"[Compact channel %i to ",t.parameters[0]);
             else v_printf(3,"[channels %i-%i with ",t.parameters[0],t.parameters[1]);
             v_printf(3,"%i colors]",t.parameters[2]);
@@ -693,36 +979,372 @@ bool fuif_decode(IO& io, Image &image, fuif_options options) {
     }
     v_printf(2,"\n");
     v_printf(6,"Header decoded. Read %i bytes so far.\n",io.ftell());
+    if (build_image && !target.error) {
+        uint64_t estimate = decode_memory_estimate(target);
+        if (options.peak_memory) *options.peak_memory = estimate;
+        v_printf(options.identify ? 2 : 4,"Estimated peak memory use of decoding: %.1f MB\n", estimate / 1048576.0);
+    }
     if (options.identify) return true;
     if (image.error) {
         e_printf("Corrupt file. Aborting.\n");
         return false;
     }
+    return true;
+}
 
-    nb_channels = image.channel.size();
+// decodes the channel group starting at channel i (and sets i to its last channel)
+template<typename IO>
+bool fuif_decode_group(IO& io, fuif_options &options, int &i, Image &image, size_t bytes_to_load, DecodeInterrupt &stop) {
+    int beginc = i;
+    if (!fuif_decode_channel<IO, FinalPropertySymbolCoder<FUIFBitChancePass2, RacIn<IO>, MAX_BIT_DEPTH> >(io, options, i, image, bytes_to_load, stop)) return false;
+    if (image.transform.size() > 0 && image.transform.back().ID == TRANSFORM_PERMUTE && image.transform.back().parameters.size() == 0 && i==0) inv_permute_meta(image);
+    if (options.group_callback && !io_starved(io) && !stop.interrupted) options.group_callback(beginc, i, image);
+    return true;
+}
+
+// decodes an image (or an animation without a frame index); if frame_offsets is set, an animation with a frame index
+// only gets its header decoded (see fuif_decode_frame_index)
+template<typename IO>
+bool fuif_decode_image(IO& io, Image &image, fuif_options &options, std::vector<size_t> *frame_offsets = NULL) {
+    int responsive_offsets[5];
+    if (!fuif_decode_header(io, image, options, responsive_offsets, frame_offsets)) return false;
+    if (frame_offsets && frame_offsets->size()) return true;
+    if (options.identify || image.channel.size() == 0) return true;
+
+    int nb_channels = image.channel.size();
 
     size_t bytes_to_load = 0;
     if (options.preview >= 0) bytes_to_load = responsive_offsets[options.preview];
 
+    // levels to report to the level callback
+    int last_level = (options.preview < 0 ? 4 : options.preview);
+    if (!options.level_callback) last_level = -1;
+    int completed_level = -1;
+
+    // when interrupted, everything after the last completed level is reverted to its undecoded state
+    DecodeInterrupt stop(options.time_budget, options.cancel);
+    std::vector<Channel> undecoded;
+    int revert_channel = -1;
+
     // decode channel data
+    bool all_decoded = true;
     for (int i=0; i<nb_channels; i++) {
-        if ((options.preview < 0 || io.ftell() < bytes_to_load) && !io.isEOF()) {
+        if ((options.preview < 0 || io.ftell() < bytes_to_load) && !io.isEOF() && !stop.check()) {
             if (! image.channel[i].w || ! image.channel[i].h ) continue; // skip empty channels
-            if (!fuif_decode_channel<IO, FinalPropertySymbolCoder<FUIFBitChancePass2, RacIn<IO>, MAX_BIT_DEPTH> >(io, options, i, image, bytes_to_load)) return false;
-            if (image.transform.size() > 0 && image.transform.back().ID == TRANSFORM_PERMUTE && image.transform.back().parameters.size() == 0 && i==0) inv_permute_meta(image);
+            if (!fuif_decode_group(io, options, i, image, bytes_to_load, stop)) return false;
+            if (stop.interrupted) break;
+            while (completed_level < 4 && io.ftell() >= responsive_offsets[completed_level+1]) {
+                completed_level++;
+                if (stop.enabled()) {
+                    undecoded.assign(image.channel.begin() + i + 1, image.channel.end());
+                    revert_channel = i + 1;
+                }
+                if (completed_level <= last_level) options.level_callback(completed_level, image);
+            }
         } else {
             v_printf(3,"Skipping decode of channels %i-%i.\n",i,nb_channels-1);
+            all_decoded = false;
             break;
         }
     }
+    if (stop.interrupted) {
+        if (revert_channel >= 0) std::copy(undecoded.begin(), undecoded.end(), image.channel.begin() + revert_channel);
+        if (options.decoded_level) *options.decoded_level = completed_level;
+        if (completed_level > 0) v_printf(2,"Decoding interrupted, returning the image at scale 1:%i.\n",responsive_sizes[completed_level]);
+        else if (completed_level == 0) v_printf(2,"Decoding interrupted, returning the low-quality image placeholder.\n");
+        else v_printf(2,"Decoding interrupted before the low-quality image placeholder was complete.\n");
+        return true;
+    }
+    if (options.decoded_level) *options.decoded_level = (all_decoded && options.preview < 0 ? 5 : completed_level);
+    // truncated file: the remaining levels get whatever we have
+    for (int level = completed_level+1; level <= last_level; level++) options.level_callback(level, image);
     v_printf(3,"Done decoding. Read %i bytes.\n",io.ftell());
     return true;
 }
 
+// decodes a frame of an animation with a frame index (the io is at the start of the frame) and undoes its transforms
+template<typename IO>
+bool fuif_decode_frame(IO& io, Image &frame, fuif_options options) {
+    options.level_callback = nullptr;
+    options.group_callback = nullptr;
+    options.decoded_level = NULL;
+    options.peak_memory = NULL;
+    if (!fuif_decode_image(io, frame, options)) return false;
+    frame.undo_transforms();
+    if (frame.error) return false;
+    // after an inverse DCT, the channels are padded to whole blocks: crop them to the frame
+    for (Channel &ch : frame.channel) {
+        if (ch.w <= frame.w && ch.h <= frame.h) continue;
+        int w = std::min(ch.w, frame.w), h = std::min(ch.h, frame.h);
+        if (ch.data.size() >= (size_t)ch.w * ch.h) {
+            for (int y=0; y<h; y++) std::copy_n(ch.data.begin() + (size_t)y*ch.w, w, ch.data.begin() + (size_t)y*w);
+            ch.data.resize((size_t)w*h);
+        } else ch.data.clear();
+        ch.w = w;
+        ch.h = h;
+    }
+    return true;
+}
+
+// the frame has the dimensions of the animation, and all of its channels have the same size: the frame size, or a
+// smaller one for a preview at a reduced scale
+bool check_frame(const Image &animation, const Image &frame, int f) {
+    int fh = animation.h / animation.nb_frames;
+    bool ok = (frame.w == animation.w && frame.h == fh && frame.channel.size());
+    for (const Channel &ch : frame.channel) if (ch.w != frame.channel[0].w || ch.h != frame.channel[0].h || ch.w > animation.w || ch.h > fh) ok = false;
+    if (!ok) e_printf("Frame %i does not have the dimensions of the animation (%ix%i).\n", f, animation.w, fh);
+    return ok;
+}
+
+// gives the decoded frame f to the frame callback, or copies it into the frames of the animation (the first frame determines the
+// channels, and the size of the frames in them: for a preview at a reduced scale, the filmstrip is at that scale too)
+bool add_frame(Image &animation, const Image &frame, int f, const fuif_options &options) {
+    if (!check_frame(animation, frame, f)) return false;
+    if (options.frame_callback) {
+        options.frame_callback(f, frame);
+        return true;
+    }
+    if (animation.channel.empty()) {
+        if (!memory_within_limit((uint64_t)animation.w * animation.h * frame.channel.size() * sizeof(pixel_type), options)) return false;
+        for (const Channel &ch : frame.channel) {
+            animation.channel.push_back(Channel(ch.w, ch.h * animation.nb_frames, ch.minval, ch.maxval));
+            animation.channel.back().component = ch.component;
+        }
+        animation.minval = frame.minval;
+        animation.maxval = frame.maxval;
+        animation.nb_channels = frame.nb_channels;
+        animation.real_nb_channels = frame.real_nb_channels;
+        animation.colormodel = frame.colormodel;
+        animation.icc_profile = frame.icc_profile;
+    } else if (frame.channel.size() != animation.channel.size() || frame.channel[0].w != animation.channel[0].w
+               || frame.channel[0].h * animation.nb_frames != animation.channel[0].h) {
+        e_printf("Frame %i does not have the channels of the first frame.\n", f);
+        return false;
+    }
+    size_t frame_size = (size_t)frame.channel[0].w * frame.channel[0].h;
+    for (size_t i=0; i<frame.channel.size(); i++) {
+        Channel &ch = animation.channel[i];
+        if (frame.channel[i].data.size() < frame_size) continue; // no data: all zeroes
+        std::copy(frame.channel[i].data.begin(), frame.channel[i].data.begin() + frame_size, ch.data.begin() + frame_size*f);
+        ch.minval = std::min(ch.minval, frame.channel[i].minval);
+        ch.maxval = std::max(ch.maxval, frame.channel[i].maxval);
+    }
+    return true;
+}
+
+// decodes all frames of an animation with a frame index (after its header)
+// a truncated animation keeps the frames that are complete and what could be decoded of the first incomplete one
+// (the others are left empty), like in fuif_stream_decoder
+template<typename IO>
+bool fuif_decode_frames(IO& io, Image &image, fuif_options &options, const std::vector<size_t> &frame_offsets) {
+    if (options.identify) return true;
+    int f = 0;
+    bool partial = false;
+    for (; f<image.nb_frames; f++) {
+        Image frame;
+        io.fseek(frame_offsets[f], SEEK_SET);
+        bool decoded = fuif_decode_frame(io, frame, options);
+        // a frame that needed data beyond the end of the file is incomplete: like a truncated single image, it is
+        // returned as far as it could be decoded (if its header is there), and it is the last one
+        bool truncated = io.isEOF();
+        if (!decoded) {
+            if (truncated) break;
+            e_printf("Could not decode frame %i.\n", f);
+            return false;
+        }
+        if (!add_frame(image, frame, f, options)) return false;
+        if (truncated) {
+            partial = true;
+            f++;
+            break;
+        }
+    }
+    if (f == 0) {
+        e_printf("Could not decode any frame.\n");
+        return false;
+    }
+    if (partial) v_printf(1,"Warning: the animation is truncated, only %i of %i frames are complete (frame %i is partially decoded).\n", f-1, image.nb_frames, f-1);
+    else if (f < image.nb_frames) v_printf(1,"Warning: the animation is truncated, only %i of %i frames could be decoded.\n", f, image.nb_frames);
+    // every responsive level is (a downscale of) the whole animation
+    int last_level = (options.preview < 0 ? 4 : options.preview);
+    if (options.level_callback) for (int level=0; level<=last_level; level++) options.level_callback(level, image);
+    if (options.decoded_level) *options.decoded_level = (options.preview < 0 ? 5 : options.preview);
+    return true;
+}
+
+template<typename IO>
+bool fuif_decode(IO& io, Image &image, fuif_options options) {
+    if (options.nb_threads >= 0) set_nb_threads(options.nb_threads);
+    std::vector<size_t> frame_offsets;
+    if (!fuif_decode_image(io, image, options, &frame_offsets)) return false;
+    if (frame_offsets.size()) return fuif_decode_frames(io, image, options, frame_offsets);
+    return true;
+}
+
+fuif_frame_decoder::fuif_frame_decoder(const char * filename, fuif_options opt) : options(opt) {
+    if (options.nb_threads >= 0) set_nb_threads(options.nb_threads);
+    FILE *file = fopen(filename, "rb");
+    if (!file) return;
+    io.reset(new FileIO(file, filename));
+    char buff[5];
+    if (!io->gets(buff,5) || strcmp(buff,"FUAI")) return;
+    if (!fuif_decode_frame_index(*io, info, frame_offsets, options)) frame_offsets.clear();
+}
+
+bool fuif_frame_decoder::decode_frame(int f, Image &frame) {
+    if (!indexed() || f < 0 || f >= info.nb_frames) return false;
+    io->fseek(frame_offsets[f], SEEK_SET);
+    frame = Image();
+    if (!fuif_decode_frame(*io, frame, options)) {
+        e_printf("Could not decode frame %i.\n", f);
+        return false;
+    }
+    return check_frame(info, frame, f);
+}
+
+fuif_stream_decoder::fuif_stream_decoder(Image &img, fuif_options opt)
+    : image(img), options(opt), start(0), base(0), retry_at(0), header_done(false), done(false), failed(false), next_channel(0), next_frame(0), next_level(0) {
+    for (int s=0; s<5; s++) responsive_offsets[s] = 0;
+    if (options.nb_threads >= 0) set_nb_threads(options.nb_threads);
+}
+
+bool fuif_stream_decoder::push(const uint8_t *data, size_t len) {
+    if (done || failed) return !failed;
+    buffer.insert(buffer.end(), data, data+len);
+    return decode(false);
+}
+
+bool fuif_stream_decoder::finish() {
+    if (done || failed) return !failed;
+    return decode(true);
+}
+
+bool fuif_stream_decoder::decode(bool final) {
+    if (!header_done) {
+        StreamReader io(buffer.data() + start, buffer.size() - start, base);
+        if (!fuif_decode_header(io, image, options, responsive_offsets, &frame_offsets)) {
+            if (io_starved(io) && !final) return true;
+            if (io_starved(io)) e_printf("Could not read header from %s\n", io.getName());
+            failed = true;
+            return false;
+        }
+        header_done = true;
+        consume(io.ftell());
+        if (options.identify || (image.channel.size() == 0 && frame_offsets.empty())) { done = true; return true; }
+    }
+    if (frame_offsets.size()) return decode_frames(final);
+
+    int nb_channels = image.channel.size();
+    size_t bytes_to_load = 0;
+    if (options.preview >= 0) bytes_to_load = responsive_offsets[options.preview];
+    int last_level = (options.preview < 0 ? 4 : options.preview);
+    if (!options.level_callback) last_level = -1;
+
+    for (; next_channel < nb_channels; next_channel++) {
+        if (! image.channel[next_channel].w || ! image.channel[next_channel].h ) continue; // skip empty channels
+        if (options.preview >= 0 && base >= bytes_to_load) break;
+        StreamReader io(buffer.data() + start, buffer.size() - start, base);
+        if (start == buffer.size()) {
+            if (final) break;
+            return true;
+        }
+        // the previous attempt at this group ran out of data; don't try again for every few bytes that arrive,
+        // unless a responsive truncation point was reached (then the group must be complete)
+        size_t available = base + buffer.size() - start;
+        bool complete = final;
+        for (int s=0; s<5; s++) if (base < responsive_offsets[s] && responsive_offsets[s] <= available) complete = true;
+        if (!complete && available < retry_at) return true;
+        // channels that are not decoded yet have no data, so this is cheap
+        std::vector<Channel> saved(image.channel.begin() + next_channel, image.channel.end());
+        int i = next_channel;
+        DecodeInterrupt stop(0, NULL);
+        if (!fuif_decode_group(io, options, i, image, bytes_to_load, stop)) { failed = true; return false; }
+        if (io_starved(io) && !final) {
+            // incomplete group: undo and wait for more data
+            std::copy(saved.begin(), saved.end(), image.channel.begin() + next_channel);
+            retry_at = available + (available - base) / 4 + 1;
+            return true;
+        }
+        next_channel = i;
+        consume(io.ftell());
+        while (next_level <= last_level && base >= responsive_offsets[next_level]) options.level_callback(next_level++, image);
+    }
+    // everything there is has been decoded
+    while (next_level <= last_level) options.level_callback(next_level++, image);
+    v_printf(3,"Done decoding. Read %i bytes.\n",(int)base);
+    done = true;
+    buffer.clear();
+    start = 0;
+    return true;
+}
+
+// animation with a frame index: every frame is decoded as soon as all of its bytes are there
+bool fuif_stream_decoder::decode_frames(bool final) {
+    bool partial = false;
+    for (; next_frame < image.nb_frames; next_frame++) {
+        size_t begin = frame_offsets[next_frame], end = frame_offsets[next_frame+1];
+        bool complete = (base + buffer.size() - start >= end);
+        if (!complete && !final) return true;
+        // the reader is not limited to the size in the index: like when decoding from a file, the decoder may look at the
+        // bytes that follow (and when they are not there yet, the frame is decoded again once they are)
+        StreamReader io(buffer.data() + start + (begin - base), buffer.size() - start - (begin - base), begin);
+        Image frame;
+        bool decoded = fuif_decode_frame(io, frame, options);
+        if (io_starved(io) || !complete) {
+            if (!final) return true;
+            // no more data will come: the frame is kept as far as it could be decoded, like a truncated single image
+            if (decoded) {
+                if (!add_frame(image, frame, next_frame, options)) {
+                    e_printf("Could not decode frame %i.\n", next_frame);
+                    failed = true;
+                    return false;
+                }
+                partial = true;
+                next_frame++;
+            }
+            break;
+        }
+        if (!decoded || !add_frame(image, frame, next_frame, options)) {
+            e_printf("Could not decode frame %i.\n", next_frame);
+            failed = true;
+            return false;
+        }
+        consume(end);
+    }
+    if (next_frame == 0) {
+        e_printf("Could not decode any frame.\n");
+        failed = true;
+        return false;
+    }
+    // a truncated animation keeps the frames that are complete and what could be decoded of the next one (the others are left empty)
+    if (partial) v_printf(1,"Warning: the animation is truncated, only %i of %i frames are complete (frame %i is partially decoded).\n", next_frame-1, image.nb_frames, next_frame-1);
+    else if (next_frame < image.nb_frames) v_printf(1,"Warning: the animation is truncated, only %i of %i frames could be decoded.\n", next_frame, image.nb_frames);
+    int last_level = (options.preview < 0 ? 4 : options.preview);
+    if (options.level_callback) for (int level=0; level<=last_level; level++) options.level_callback(level, image);
+    v_printf(3,"Done decoding. Decoded %i frames.\n", next_frame);
+    done = true;
+    buffer.clear();
+    start = 0;
+    return true;
+}
+
+void fuif_stream_decoder::consume(size_t pos) {
+    start += pos - base;
+    base = pos;
+    // only move memory around once the consumed part is at least half of the buffer
+    if (start >= buffer.size() / 2) {
+        buffer.erase(buffer.begin(), buffer.begin() + start);
+        start = 0;
+    }
+}
+
 template bool fuif_encode(FileIO& io, const Image &image, fuif_options &options);
 template bool fuif_encode(BlobIO& io, const Image &image, fuif_options &options);
+template bool fuif_encode_frame_index(FileIO& io, const Image &animation, const std::vector<std::vector<uint8_t>> &frames);
+template bool fuif_encode_frame_index(BlobIO& io, const Image &animation, const std::vector<std::vector<uint8_t>> &frames);
 template bool fuif_decode(FileIO& io, Image &image, fuif_options options);
 template bool fuif_decode(BlobReader& io, Image &image, fuif_options options);
+template bool fuif_decode(StreamReader& io, Image &image, fuif_options options);
 
 bool fuif_encode_file(const char * filename, const Image &image, fuif_options &options) {
     FILE *file = NULL;
@@ -734,7 +1356,18 @@ bool fuif_encode_file(const char * filename, const Image &image, fuif_options &o
     return result;
 }
 
+bool fuif_encode_frame_index_file(const char * filename, const Image &animation, const std::vector<std::vector<uint8_t>> &frames) {
+    FILE *file = NULL;
+    if (!strcmp(filename,"-")) file = stdout;
+    else file = fopen(filename,"wb");
+    if (!file) return false;
+    FileIO fio(file, (file == stdout? "to standard output" : filename));
+    return fuif_encode_frame_index(fio, animation, frames);
+}
+
 void fuif_prepare_encode(Image &image, fuif_options &options) {
+    // decoded images can have channels without data
+    for (int i=0; i<image.channel.size(); i++) image.channel[i].allocate();
     // ensure that the ranges are correct and tight
     image.recompute_minmax();
     // inspect the cumulative channel hshift/vshift to find the right spots to put the truncation offsets
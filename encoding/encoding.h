@@ -28,11 +28,29 @@ SOFTWARE.
 #include "../image/image.h"
 #include "../maniac/compound.h"
 #include "../fileio.h"
+#include <functional>
+#include <atomic>
+#include <memory>
 
 struct fuif_options {
 // decoding options
     int preview;                // -1 : all, 0 : LQIP, 1: 1/16, 2: 1/8, 3: 1/4, 4: 1/2
     bool identify;              // don't decode image data, just decode header
+    std::function<void(int level, const Image &image)> level_callback; // if set, called with the (partially) decoded image whenever a responsive truncation point is reached
+    std::function<void(int beginc, int endc, const Image &image)> group_callback; // if set, called whenever channels beginc..endc have been decoded
+    std::function<void(int f, const Image &frame)> frame_callback; // if set, called with every frame of an animation with a frame index as soon as it is
+                                // decoded (with its transforms undone); the frames are then not assembled into the decoded image
+    float time_budget;          // if > 0: stop decoding after this many milliseconds, keeping only the last completed responsive level
+    std::atomic<bool> *cancel;  // if set: stop decoding (like when the time budget is used up) as soon as *cancel becomes true
+    int *decoded_level;         // output (if set): last completely decoded responsive level (-1: not even the LQIP, 5: the whole image)
+// resource limits for decoding untrusted files (0: no limit), checked before anything is allocated
+    uint64_t max_pixels;        // image width times height (all frames)
+    int max_channels;           // number of channels in the header
+    uint64_t max_memory;        // estimated peak memory use in bytes (see peak_memory)
+    size_t max_tree_nodes;      // size of a MANIAC tree
+    uint64_t *peak_memory;      // output (if set): estimate of the peak memory use of the decode, computed from the header (also with identify)
+// threads (for both encoding and decoding)
+    int nb_threads;             // -1: keep the process-wide setting (see set_nb_threads), 0: one per hardware thread, K: at most K threads
 // encoding options (some of which are needed during decoding too)
     float nb_repeats;            // number of iterations to do to learn a MANIAC tree (does not have to be an integer)
     int max_dist;                // maximum distance to look for matches
@@ -41,13 +59,25 @@ struct fuif_options {
     int maniac_alpha;   // TODO: put this in the bitstream
     bool compress;
     int max_group;
+    float tree_cost;             // decode cost (in bits per symbol) of a MANIAC tree node; nodes that don't pay for it are pruned (0: no pruning)
     bool debug;
     std::vector<int> predictor;
     Image heatmap;
+    float tree_cost_penalty;     // output: estimated number of bytes lost because of decode-cost pruning
+    size_t *level_bytes;         // output (if set): 6 sizes in bytes, of the encoded file truncated at each responsive level (LQIP, 1:16, ..., 1:2) and of the whole file
 };
 const struct fuif_options default_fuif_options {
     .preview = -1,
     .identify = false,
+    .time_budget = 0,
+    .cancel = NULL,
+    .decoded_level = NULL,
+    .max_pixels = 0,
+    .max_channels = 0,
+    .max_memory = 0,
+    .max_tree_nodes = 0,
+    .peak_memory = NULL,
+    .nb_threads = -1,
     .nb_repeats = 0.5,
     .max_dist = 0,
     .max_properties = 12,
@@ -55,6 +85,7 @@ const struct fuif_options default_fuif_options {
     .maniac_alpha = 0x0d000000,
     .compress = true,
     .max_group = -1,
+    .tree_cost = 0,
     .debug = false,
 };
 
@@ -65,7 +96,60 @@ bool fuif_encode(IO& io, const Image &image, fuif_options &options);
 
 bool fuif_encode_file(const char * filename, const Image &image, fuif_options &options);
 
+// animations with a frame index ("FUAI"): the animation info, then the size of every frame, then every frame encoded as a separate
+// (single-frame) image, so players can decode the frames one at a time, in any order (see fuif_frame_decoder)
+template <typename IO>
+bool fuif_encode_frame_index(IO& io, const Image &animation, const std::vector<std::vector<uint8_t>> &frames);
+
+bool fuif_encode_frame_index_file(const char * filename, const Image &animation, const std::vector<std::vector<uint8_t>> &frames);
+
+// cheap estimate of the encoded size in bytes (of the channel data up to responsive level 'level', or everything if level=-1)
+size_t fuif_estimate(const Image &image, fuif_options &options, int level=-1);
+
 template <typename IO>
 bool fuif_decode(IO& io, Image &image, fuif_options options=default_fuif_options);
 
 bool fuif_decode_file(const char * filename, Image &image, fuif_options options=default_fuif_options);
+
+// push-based decoder: feed it the bytes of a FUIF file as they arrive (e.g. from the network)
+// every channel group is decoded once, as soon as it is complete; the callbacks in the options report progress
+// (time_budget and cancel are not used: the caller decides when to stop pushing data)
+class fuif_stream_decoder {
+    Image &image;
+    fuif_options options;
+    std::vector<uint8_t> buffer;   // bytes that are not yet decoded (after the first 'start' bytes)
+    size_t start;                  // number of already decoded bytes still in the buffer
+    size_t base;                   // file position of buffer[start]
+    size_t retry_at;               // file position up to which data is needed before retrying an incomplete group
+    bool header_done, done, failed;
+    int responsive_offsets[5];
+    int next_channel;              // first channel that is not yet decoded
+    std::vector<size_t> frame_offsets; // animation with a frame index: file positions of the frames (and of the end)
+    int next_frame;                // first frame that is not yet decoded
+    int next_level;                // next responsive level to report
+
+    bool decode(bool final);
+    bool decode_frames(bool final);
+    void consume(size_t pos);
+public:
+    fuif_stream_decoder(Image &image, fuif_options options=default_fuif_options);
+    // returns false if the data is corrupt
+    bool push(const uint8_t *data, size_t len);
+    // no more data will come: decode what is left (a truncated file gives a partial image)
+    bool finish();
+    bool is_done() const { return done; }
+};
+
+// random access to the frames of an animation with a frame index, e.g. for players that only keep the frames they show
+class fuif_frame_decoder {
+    std::unique_ptr<FileIO> io;
+    fuif_options options;
+    std::vector<size_t> frame_offsets; // file positions of the frames (and of the end of the last one)
+public:
+    Image info;                        // dimensions (of all frames together), number of frames, frame durations and loops; no channels
+    fuif_frame_decoder(const char * filename, fuif_options options=default_fuif_options);
+    // false if the file could not be read or is not an animation with a frame index (fuif_decode_file can decode those)
+    bool indexed() const { return frame_offsets.size() > 1; }
+    // decodes frame f, with its transforms undone
+    bool decode_frame(int f, Image &frame);
+};
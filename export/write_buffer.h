@@ -0,0 +1,167 @@
+/*//////////////////////////////////////////////////////////////////////////////////////////////////////
+
+Copyright 2019, Jon Sneyers, Cloudinary (jon@cloudinary.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////*/
+
+
+#pragma once
+#include "../image/image.h"
+
+// writes the (decoded) image into a caller-owned buffer with interleaved samples (see buffer_format), instead of reading Channel::value() pixel by pixel
+// (the samples are rescaled if the range of the image is not the range of the buffer samples)
+
+// one row: nc output samples per pixel, taken from the source rows src[0..nc-1] (alpha is the last one if nc is 2 or 4)
+// the loop has no per-pixel branches, so the compiler can vectorize it
+template <typename T, int nc, bool scale, bool premultiply>
+static void interleave_row(const pixel_type * const *src, T *out, int w, int maxval) {
+    const uint32_t outmax = (sizeof(T) == 1 ? 0xFF : 0xFFFF);
+    const bool has_alpha = (nc == 2 || nc == 4);
+    for (int x = 0; x < w; x++) {
+        uint32_t alpha = outmax;
+        if (has_alpha) {
+            alpha = CLAMP((int)src[nc-1][x], 0, maxval);
+            if (scale) alpha = (alpha * outmax + maxval/2) / maxval;
+        }
+        for (int k = 0; k < nc; k++) {
+            uint32_t v = CLAMP((int)src[k][x], 0, maxval);
+            if (scale) v = (v * outmax + maxval/2) / maxval;
+            if (premultiply && has_alpha && k < nc-1) v = (v * alpha + outmax/2) / outmax;
+            out[x*nc+k] = v;
+        }
+    }
+}
+
+template <typename T, int nc>
+static void interleave_row(const pixel_type * const *src, T *out, int w, int maxval, bool premultiply) {
+    const int outmax = (sizeof(T) == 1 ? 0xFF : 0xFFFF);
+    if (maxval == outmax) {
+        if (premultiply) interleave_row<T,nc,false,true>(src, out, w, maxval);
+        else interleave_row<T,nc,false,false>(src, out, w, maxval);
+    } else {
+        if (premultiply) interleave_row<T,nc,true,true>(src, out, w, maxval);
+        else interleave_row<T,nc,true,false>(src, out, w, maxval);
+    }
+}
+
+template <typename T>
+static void interleave_row(const pixel_type * const *src, int nc, T *out, int w, int maxval, bool premultiply) {
+    switch (nc) {
+        case 1: interleave_row<T,1>(src, out, w, maxval, premultiply); break;
+        case 2: interleave_row<T,2>(src, out, w, maxval, premultiply); break;
+        case 3: interleave_row<T,3>(src, out, w, maxval, premultiply); break;
+        default: interleave_row<T,4>(src, out, w, maxval, premultiply); break;
+    }
+}
+
+// writes the image rows that are 'first_row' .. 'first_row'+rows-1 in the channels
+class buffer_writer {
+    const Image &image;
+    buffer_format format;
+    uint8_t *buffer;
+    int nc;
+    int source[4];                      // channel for each output sample (-1: opaque alpha)
+    std::vector<pixel_type> opaque;     // a row of maxval, for images without alpha
+public:
+    buffer_writer(const Image &im, uint8_t *buf, const buffer_format &f) : image(im), format(f), buffer(buf), nc(buffer_layout_channels(f.layout)) {
+        if (!format.stride) format.stride = (size_t)image.w * nc * format.bytes_per_sample;
+    }
+
+    bool check() {
+        if (format.bytes_per_sample != 1 && format.bytes_per_sample != 2) {
+            e_printf("Cannot write %i bytes per sample.\n",format.bytes_per_sample);
+            return false;
+        }
+        if ((image.colormodel & 48) == 16) {
+            e_printf("Cannot write a CMYK image into an RGB(A) buffer.\n");
+            return false;
+        }
+        if (format.stride < (size_t)image.w * nc * format.bytes_per_sample) {
+            e_printf("Buffer stride is too small.\n");
+            return false;
+        }
+        int color_channels = (image.nb_channels < 3 ? 1 : 3);
+        bool alpha = (image.nb_channels == 2 || image.nb_channels > 3);
+        if (color_channels == 3 && nc < 3) {
+            e_printf("Cannot write a color image into a grayscale buffer.\n");
+            return false;
+        }
+        for (int k = 0; k < 4; k++) source[k] = -1;
+        int ncolor = (nc == 2 || nc == 4 ? nc - 1 : nc);
+        for (int k = 0; k < ncolor; k++) source[k] = (color_channels == 3 ? k : 0);
+        if (format.layout == PIXELS_BGR || format.layout == PIXELS_BGRA) std::swap(source[0], source[2]);
+        if (ncolor < nc && alpha) source[nc-1] = color_channels;
+        for (int k = 0; k < nc; k++) {
+            if (source[k] < 0) continue;
+            if (source[k] >= (int)image.channel.size() || image.channel[source[k]].w < image.w || image.channel[source[k]].h < image.h
+                || image.channel[source[k]].data.size() < (size_t)image.channel[source[k]].w * image.channel[source[k]].h) {
+                e_printf("Channel %i does not have the image dimensions.\n",source[k]);
+                return false;
+            }
+        }
+        opaque.assign(image.w, image.maxval);
+        return true;
+    }
+
+    // writes channel row y into buffer row y - first_row
+    void write_row(int y, int first_row) {
+        const pixel_type *src[4];
+        for (int k = 0; k < nc; k++) {
+            if (source[k] < 0) src[k] = opaque.data();
+            else src[k] = &image.channel[source[k]].data[(size_t)y * image.channel[source[k]].w];
+        }
+        uint8_t *out = buffer + (size_t)(y - first_row) * format.stride;
+        if (format.bytes_per_sample == 1) interleave_row(src, nc, out, image.w, image.maxval, format.premultiplied);
+        else interleave_row(src, nc, (uint16_t *)out, image.w, image.maxval, format.premultiplied);
+    }
+};
+
+// writes one frame of an image whose transforms have been undone
+// the buffer has image.h / image.nb_frames rows
+bool write_buffer(const Image &image, int frame, uint8_t *buffer, const buffer_format &format) {
+    if (image.error || !image.channel.size()) return false;
+    if (frame < 0 || frame >= image.nb_frames) {
+        e_printf("Frame %i does not exist.\n",frame);
+        return false;
+    }
+    if (image.transform.size()) {
+        e_printf("Cannot write an image that still has transforms to undo.\n");
+        return false;
+    }
+    buffer_writer writer(image, buffer, format);
+    if (!writer.check()) return false;
+    int fh = image.h / image.nb_frames;
+    for (int y = frame * fh; y < (frame + 1) * fh; y++) writer.write_row(y, frame * fh);
+    return true;
+}
+
+// undoes the transforms of a decoded image while writing all of it (all frames, image.h rows) into the buffer,
+// so the last steps of the squeeze (or the inverse DCT), the last color transform, the clamping and the interleaving
+// are a single pass over the image (see Image::prepare_rows)
+bool undo_and_write_buffer(Image &image, uint8_t *buffer, const buffer_format &format) {
+    if (image.error || !image.channel.size()) return false;
+    if (!image.prepare_rows()) return false;
+    // the channels have their final dimensions now, their rows are produced by undo_rows
+    for (Channel &ch : image.channel) ch.allocate();
+    buffer_writer writer(image, buffer, format);
+    if (!writer.check()) return false;
+    return image.undo_rows([&](int y) { if (y < image.h) writer.write_row(y, 0); });
+}
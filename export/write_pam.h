@@ -26,7 +26,8 @@ SOFTWARE.
 #include "../image/image.h"
 
 
-bool write_PAM_file(const char *output_image, const Image &image) {
+// if to_undo is set, it is the image, after Image::prepare_rows(): the rest of the transforms is undone while writing
+static bool write_PAM(const char *output_image, const Image &image, Image *to_undo) {
 
   int nb_channels = image.channel.size();
   bool debugstuff = false;
@@ -80,6 +81,12 @@ bool write_PAM_file(const char *output_image, const Image &image) {
   if (image.maxval > 255) {bit_depth = 16; bytes_per_value=2;}
   if (image.maxval > 65535) { e_printf("Warning: cannot save as PAM since bit depth is higher than 16-bit. Doing it anyway.\n");}
 
+  // only the normal case is written while undoing the transforms row by row
+  if (to_undo && (image.nb_channels == 0 || cmyk)) {
+    to_undo->undo_rows([](int y){});
+    to_undo = NULL;
+  }
+
   if (image.nb_channels == 0) {
     // visualize signed stuff
     int range = image.channel[0].maxval - image.channel[0].minval;
@@ -133,36 +140,46 @@ bool write_PAM_file(const char *output_image, const Image &image) {
      }
     }
   } else {
+   auto write_row = [&](int y) {
+    if (y >= h) return;
     if (bytes_per_value > 1) {
-    for (int y = 0; y < h; y++) {
      for (int x = 0; x < w; x++) {
       for (int c=0; c<components; c++) {
         fputc(CLAMP(image.channel[c].value_nocheck(y,x),image.minval,image.maxval) >> 8,fp);
         fputc(CLAMP(image.channel[c].value_nocheck(y,x),image.minval,image.maxval) & 0xFF,fp);
       }
      }
-    }
     } else {
       if (components == 3) {
-        for (int y = 0; y < h; y++) {
          for (int x = 0; x < w; x++) {
             fputc(CLAMP(image.channel[0].value_nocheck(y,x),image.minval,image.maxval) & 0xFF,fp);
             fputc(CLAMP(image.channel[1].value_nocheck(y,x),image.minval,image.maxval) & 0xFF,fp);
             fputc(CLAMP(image.channel[2].value_nocheck(y,x),image.minval,image.maxval) & 0xFF,fp);
          }
-        }
       } else {
-        for (int y = 0; y < h; y++) {
          for (int x = 0; x < w; x++) {
           for (int c=0; c<components; c++) {
             fputc(CLAMP(image.channel[c].value_nocheck(y,x),image.minval,image.maxval) & 0xFF,fp);
           }
          }
-        }
       }
     }
+   };
+   if (to_undo) to_undo->undo_rows(write_row);
+   else for (int y = 0; y < h; y++) write_row(y);
   }
 
   fclose(fp);
   return 0;
 }
+
+bool write_PAM_file(const char *output_image, const Image &image) {
+  return write_PAM(output_image, image, NULL);
+}
+
+// undoes the transforms of the image while writing it, so the last steps of the squeeze (or the inverse DCT),
+// the last color transform, the clamping and the interleaving are a single pass over the image (see Image::prepare_rows)
+bool undo_and_write_PAM_file(const char *output_image, Image &image) {
+  if (!image.prepare_rows()) return write_PAM(output_image, image, NULL);
+  return write_PAM(output_image, image, &image);
+}
@@ -27,7 +27,8 @@ SOFTWARE.
 #include "png.h"
 
 
-bool write_PNG_file(const char *output_image, const Image &image) {
+// if to_undo is set, it is the image, after Image::prepare_rows(): the rest of the transforms is undone while writing
+static bool write_PNG(const char *output_image, const Image &image, Image *to_undo) {
 
   int nb_channels = image.channel.size();
   bool debugstuff = false;
@@ -111,6 +112,12 @@ bool write_PNG_file(const char *output_image, const Image &image) {
 
   png_bytep row = (png_bytep) png_malloc(png_ptr,nb_channels * bytes_per_value * w);
 
+  // only the normal case is written while undoing the transforms row by row
+  if (to_undo && (cmyk || (image.channel[0].maxval > 255 && debugstuff))) {
+    to_undo->undo_rows([](int y){});
+    to_undo = NULL;
+  }
+
   v_printf(10,"Writing PNG file (range %i..%i)\n",image.minval,image.maxval);
   if (image.channel[0].maxval > 255 && debugstuff) {
     v_printf(10,"Writing PNG file with false colors for debug purposes\n");
@@ -145,7 +152,9 @@ bool write_PNG_file(const char *output_image, const Image &image) {
      }
     png_write_row(png_ptr,row);
     }
-  } else for (size_t r = 0; r < (size_t) h; r++) {
+  } else {
+   auto write_row = [&](int r) {
+    if (r >= h) return;
     if (bytes_per_value == 1) {
      for (size_t c = 0; c < (size_t) w; c++) {
       for (int p=0; p<nb_channels; p++) {
@@ -170,6 +179,9 @@ bool write_PNG_file(const char *output_image, const Image &image) {
      }
     }
     png_write_row(png_ptr,row);
+   };
+   if (to_undo) to_undo->undo_rows(write_row);
+   else for (int r = 0; r < h; r++) write_row(r);
   }
 
   png_free(png_ptr,row);
@@ -178,3 +190,14 @@ bool write_PNG_file(const char *output_image, const Image &image) {
   fclose(fp);
   return 0;
 }
+
+bool write_PNG_file(const char *output_image, const Image &image) {
+  return write_PNG(output_image, image, NULL);
+}
+
+// undoes the transforms of the image while writing it, so the last steps of the squeeze (or the inverse DCT),
+// the last color transform, the clamping and the interleaving are a single pass over the image (see Image::prepare_rows)
+bool undo_and_write_PNG_file(const char *output_image, Image &image) {
+  if (!image.prepare_rows()) return write_PNG(output_image, image, NULL);
+  return write_PNG(output_image, image, &image);
+}
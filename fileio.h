@@ -142,6 +142,83 @@ public:
     }
 };
 
+/*!
+ * Read-only IO interface for the part of a stream that has arrived so far
+ * Reading beyond the available bytes marks the reader as starved: from then on isEOF() is true,
+ * so the decoder stops early and the caller can retry once more data is available.
+ * (Like FileIO, and unlike BlobReader, reaching the end without reading beyond it is not end-of-file.)
+ * Positions are absolute stream positions (the first available byte is at position 'offset').
+ */
+class StreamReader
+{
+private:
+    const uint8_t* data;
+    size_t data_array_size;
+    size_t offset;
+    size_t seek_pos;
+    bool starved;
+public:
+    const int EOS = -1;
+
+    StreamReader(const uint8_t* _data, size_t _data_array_size, size_t _offset)
+    : data(_data)
+    , data_array_size(_data_array_size)
+    , offset(_offset)
+    , seek_pos(0)
+    , starved(false)
+    {
+    }
+
+    bool isStarved() const {
+        return starved;
+    }
+    bool isEOF() const {
+        return starved;
+    }
+    long ftell() const {
+        return offset + seek_pos;
+    }
+    int get_c() {
+        if(seek_pos >= data_array_size) {
+            starved = true;
+            return EOS;
+        }
+        return data[seek_pos++];
+    }
+    char * gets(char *buf, int n) {
+        int i = 0;
+        const int max_write = n-1;
+        while(seek_pos < data_array_size && i < max_write)
+            buf[i++] = data[seek_pos++];
+        buf[n-1] = '\0';
+
+        if(i < max_write) {
+            starved = true;
+            return 0;
+        } else
+            return buf;
+    }
+    int fputc(int c) {
+      return EOS;
+    }
+    void fseek(long pos, int where) {
+        switch(where) {
+        case SEEK_SET:
+            seek_pos = pos - offset;
+            break;
+        case SEEK_CUR:
+            seek_pos += pos;
+            break;
+        case SEEK_END:
+            seek_pos = long(data_array_size) + pos;
+            break;
+        }
+    }
+    static const char* getName() {
+        return "stream";
+    }
+};
+
 /*!
  * IO interface for a growable memory block
  */
@@ -167,13 +244,11 @@ private:
 
         if(new_size < data_array_size * 3 / 2)
             new_size = data_array_size * 3 / 2;
-        uint8_t* new_data = new uint8_t[new_size];
+        // zero-initialized: if seek_pos has been moved beyond the written bytes,
+        // the empty space is zeroes (and so is the padding byte at the end)
+        uint8_t* new_data = new uint8_t[new_size]();
 
-        memcpy(new_data, data, bytes_used);
-        // if seek_pos has been moved beyond the written bytes,
-        // fill the empty space with zeroes
-        for(size_t i = bytes_used; i < seek_pos; ++i)
-            new_data[i] = 0;
+        if (bytes_used) memcpy(new_data, data, bytes_used);
         delete [] data;
         data = new_data;
         std::swap(data_array_size, new_size);
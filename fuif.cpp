@@ -37,6 +37,9 @@ SOFTWARE.
 #include "export/write_yuv.h"
 
 #include <getopt.h>
+#include <thread>
+#include <set>
+#include <deque>
 
 #define FUIFVERSIONSTRING "0.0.1"
 
@@ -75,6 +78,33 @@ static const float squeeze_luma_qtable[16] =   {163.84,81.92,40.96,20.48,10.24,5
 // for 8-bit input, the range of YCoCg chroma is -255..255 so basically this does 4:2:0 subsampling (two most fine grained layers get quantized away)
 static const float squeeze_chroma_qtable[16] = {1024,512,256,128,64,32,16,8,4,2,1,0.5,0.5,0.5,0.5,0.5};
 
+// undo the transforms and write the decoded image to a file (the extension determines the format)
+bool write_decoded_image(const char *filename, Image &decoded) {
+    if (!strcasecmp(filename,"null:")) {
+        decoded.undo_transforms();
+        return true;
+    }
+    if (!strcasecmp(filename,"null_yuv:")) {
+        decoded.undo_transforms(2);
+        return true;
+    }
+    if (!strcasecmp(filename,"null_none:")) {
+        return true;
+    }
+
+    const char *ext = strrchr(filename,'.');
+
+    if (ext && !strcasecmp(ext,".yuv")) {
+        decoded.undo_transforms(2);
+        return write_YUV_file(filename,decoded);
+    } else {
+        if (ext && !strcasecmp(ext,".png"))
+            return undo_and_write_PNG_file(filename,decoded);
+        else
+            return undo_and_write_PAM_file(filename,decoded);
+    }
+}
+
 bool file_exists(const char * filename){
         FILE * file = fopen(filename, "rb");
         if (!file) return false;
@@ -82,6 +112,288 @@ bool file_exists(const char * filename){
         return true;
 }
 
+// file name patterns with a number in them are used as a printf format: they must have exactly one integer conversion
+// like %i or %03d, and no other conversions (%% is fine)
+bool valid_number_pattern(const char *pattern) {
+    int conversions = 0;
+    for (const char *p = pattern; *p; p++) {
+        if (*p != '%') continue;
+        p++;
+        if (*p == '%') continue;
+        while (*p && strchr("-+ #0", *p)) p++;
+        while (*p >= '0' && *p <= '9') p++;
+        if (*p != 'd' && *p != 'i') return false;
+        conversions++;
+    }
+    return conversions == 1;
+}
+
+// reads an input image; image_type becomes 0 = JPEG, 1 = PNG/PPM, 2 = YUV, 3 = FUIF
+bool read_input_image(const char *filename, Image &image, int &image_type, bool yuv, int w, int h, int bitdepth, const fuif_options &options) {
+      if (yuv) {
+          image = read_YUV_file(filename,w,h,bitdepth);
+          if (!image.w) {
+            e_printf("Error: could not read input file %s (expecting YUV input)\n",filename);
+            return false;
+          }
+          image_type = 2;
+      } else {
+        image = read_JPEG_file(filename);
+        if (image.w) {
+            image_type = 0;
+        } else {
+          // Couldn't load the input as JPEG, try loading as PNG
+          image_type = 1;
+          image = read_PNG_file(filename);
+          if (!image.w) {
+            // Couldn't load it as PNG, trying as PPM/PAM
+            image = read_PAM_file(filename);
+            if (!image.w) {
+              if (fuif_decode_file(filename,image,options)) {
+                v_printf(2,"Re-encoding existing FUIF file.\n");
+                image_type = 3;
+              } else {
+                e_printf("Error: could not read input file %s (expecting PNM/PAM, PNG, JPEG, GIF or FUIF input)\n",filename);
+                return false;
+              }
+            }
+          }
+        }
+      }
+      return true;
+}
+
+// reads a sequence of frames (the pattern has e.g. %02d for the frame number) as a filmstrip: first the list of files and the first
+// frame, so the filmstrip can be allocated at once, then the other frames, straight into their rows
+bool read_input_frames(const char *pattern, Image &animation, int &image_type, bool yuv, int w, int h, int bitdepth, const fuif_options &options) {
+    if (!valid_number_pattern(pattern)) {
+        e_printf("Error: the input filename pattern %s should contain the frame number as a printf-style pattern, e.g. frame-%%02d.png\n",pattern);
+        return false;
+    }
+    std::vector<std::string> filenames;
+    char filename[1024];
+    // the numbering can start anywhere up to 100, and ends at the first missing file
+    int frame = 0;
+    for (; frame <= 101; frame++) {
+        snprintf(filename,1024,pattern,frame);
+        if (file_exists(filename)) break;
+    }
+    for (; frame <= 101 || filenames.size(); frame++) {
+        snprintf(filename,1024,pattern,frame);
+        if (!file_exists(filename)) break;
+        filenames.push_back(filename);
+    }
+    if (filenames.empty()) {
+        e_printf("Error: no such files: %s\n",pattern);
+        return false;
+    }
+    Image first;
+    if (!read_input_image(filenames[0].c_str(), first, image_type, yuv, w, h, bitdepth, options)) return false;
+    int nb_frames = filenames.size();
+    animation = std::move(first);
+    std::vector<size_t> frame_size(animation.channel.size());
+    for (size_t i=0; i<animation.channel.size(); i++) {
+        Channel &ch = animation.channel[i];
+        frame_size[i] = (size_t)ch.w * ch.h;
+        ch.resize(ch.w, ch.h * nb_frames);
+    }
+    int fh = animation.h;
+    animation.h *= nb_frames;
+    animation.nb_frames = nb_frames;
+
+    // the importers are not reentrant (libjpeg reports errors through a global buffer, and so on), so the files are decoded one
+    // after the other; only copying their rows into the filmstrip is split over the threads
+    for (int f = 1; f < nb_frames; f++) {
+        const char *name = filenames[f].c_str();
+        Image frame;
+        int frame_type;
+        if (!read_input_image(name, frame, frame_type, yuv, w, h, bitdepth, options)) return false;
+        if (frame_type != image_type || frame.w != animation.w || frame.h != fh) {
+            e_printf("Error: input frame %s has wrong dimensions or type (%ix%i, expected %ix%i)\n",name,frame.w,frame.h,animation.w,fh);
+            return false;
+        }
+        if (frame.nb_channels != animation.nb_channels || frame.channel.size() != animation.channel.size()) {
+            e_printf("Error: input frame %s has wrong number of channels\n",name);
+            return false;
+        }
+        for (size_t i=0; i<frame.channel.size(); i++) {
+            const Channel &ich = frame.channel[i];
+            if ((size_t)ich.w * ich.h != frame_size[i] || ich.w != animation.channel[i].w) {
+                e_printf("Error: input frame %s has a channel with wrong dimensions\n",name);
+                return false;
+            }
+        }
+        for (size_t i=0; i<frame.channel.size(); i++) {
+            const Channel &ich = frame.channel[i];
+            Channel &ach = animation.channel[i];
+            parallel_for(0, ich.h, band_rows(ich.w), [&](int y0, int y1) {
+                std::copy(ich.data.begin() + (size_t)y0*ich.w, ich.data.begin() + (size_t)y1*ich.w, ach.data.begin() + frame_size[i]*f + (size_t)y0*ich.w);
+            });
+        }
+    }
+    return true;
+}
+
+
+// the encode settings that the transforms depend on (besides the fuif_options)
+struct encode_settings {
+    int colorspace;
+    float channel_colors, channel_colors_pre_transform;
+    int palette_colors;
+    bool enable_dct;
+    int responsive;
+    bool max_dist_set;
+    bool lossless;
+};
+
+// does the transforms that do not depend on the quality setting (with a frame index, every frame gets them separately);
+// has_dct becomes true if the image is DCT-coded
+bool do_transforms(Image &image, fuif_options &options, int image_type, const encode_settings &s, bool &has_dct) {
+    if (image_type == 0) {
+        // Default options for JPEG input
+        has_dct = true;
+        if (image.real_nb_channels > 1) {
+          bool ycbcr = (image.transform[0].ID == TRANSFORM_YCbCr);
+          if ( (s.colorspace == 0 && ycbcr) || (s.colorspace == 1 && !ycbcr) || s.colorspace > 1) {
+              e_printf("Error: cannot change the color space of JPEG input\n");
+              return false;
+          }
+
+/*
+          // do something like this if you want to use another scan script
+            Transform reorder(TRANSFORM_PERMUTE);
+            for (int i=0; i<image.channel.size(); i++) { reorder.parameters.push_back(image.channel.size()-1-i); }
+            image.do_transform(reorder);
+          // can also use TRANSFORM_APPROXIMATE
+*/
+        }
+    } else if (image_type == 1 || image_type == 4) {
+
+        // Default options for PNG/PPM/GIF input
+
+        if (s.channel_colors_pre_transform > 0 && s.colorspace != 0 && image_type != 4) {
+          // single channel palette (like FLIF's ChannelCompact)
+          image.recompute_minmax();
+          for (int i=0; i<image.nb_channels; i++) {
+            int colors = (image.channel[image.nb_meta_channels+i].maxval - image.channel[image.nb_meta_channels+i].minval + 1);
+            if (colors < 256) continue; // only do this for 16-bit PNGs
+            v_printf(10,"Channel %i: range=%i..%i\n",i,image.channel[image.nb_meta_channels+i].minval,image.channel[image.nb_meta_channels+i].maxval);
+            Transform maybe_palette_1(TRANSFORM_PALETTE);
+            maybe_palette_1.parameters.push_back(i);
+            maybe_palette_1.parameters.push_back(i);
+            // simple heuristic: if less than X percent of the values in the range actually occur, it is probably worth it to do a compaction
+            maybe_palette_1.parameters.push_back((int) (s.channel_colors_pre_transform * colors));
+            image.do_transform(maybe_palette_1);
+          }
+        }
+
+        image.recompute_minmax();
+
+        if (s.colorspace < 0 || s.colorspace == 2) {
+            image.do_transform(Transform(TRANSFORM_YCoCg));
+        } else if (s.colorspace == 1) {
+            image.do_transform(Transform(TRANSFORM_YCbCr));
+        } else if (s.colorspace == 3) {
+            image.do_transform(Transform(TRANSFORM_XYB));
+        }
+
+        if (s.palette_colors > 0) {
+          // all-channel palette (e.g. RGBA)
+          if (image.nb_channels > 1) {
+            Transform maybe_palette(TRANSFORM_PALETTE);
+            maybe_palette.parameters.push_back(0);
+            maybe_palette.parameters.push_back(image.nb_channels - 1);
+            maybe_palette.parameters.push_back(s.palette_colors);
+            image.do_transform(maybe_palette);
+          }
+          // all-minus-one-channel palette (RGB with separate alpha, or CMY with separate K)
+          if (image.nb_channels > 3) {
+            Transform maybe_palette_3(TRANSFORM_PALETTE);
+            maybe_palette_3.parameters.push_back(0);
+            maybe_palette_3.parameters.push_back(image.nb_channels - 2);
+            maybe_palette_3.parameters.push_back(s.palette_colors);
+            image.do_transform(maybe_palette_3);
+          }
+        }
+        if (s.channel_colors > 0) {
+          // single channel palette (like FLIF's ChannelCompact)
+          image.recompute_minmax();
+          for (int i=0; i<image.nb_channels; i++) {
+            v_printf(10,"Channel %i: range=%i..%i\n",i,image.channel[image.nb_meta_channels+i].minval,image.channel[image.nb_meta_channels+i].maxval);
+            Transform maybe_palette_1(TRANSFORM_PALETTE);
+            maybe_palette_1.parameters.push_back(i);
+            maybe_palette_1.parameters.push_back(i);
+            // simple heuristic: if less than X percent of the values in the range actually occur, it is probably worth it to do a compaction
+            maybe_palette_1.parameters.push_back((int) (s.channel_colors * (image.channel[image.nb_meta_channels+i].maxval - image.channel[image.nb_meta_channels+i].minval + 1)));
+            image.do_transform(maybe_palette_1);
+          }
+        }
+    } else if (image_type == 2) {
+          // make chroma more important, since .yuv is YCbCr which has a smaller chroma range than YCoCg and also it is already subsampled
+          squeeze_luma_factor *= 3.0;
+          squeeze_quality_factor /= 3.0;
+    }
+
+
+    if (image_type == 1 || image_type == 2 || image_type == 4) {
+
+        bool try_match = false;
+        if (image.nb_frames > 1 && !s.max_dist_set) options.max_dist = -1; // match with the previous frame (see fwd_match)
+        else if (s.lossless && !s.max_dist_set) { options.max_dist = LARGEST_VAL; try_match = true; }
+        bool try_motion = (image.nb_frames > 1 && options.max_dist < 0 && s.lossless); // (estimates of lossy encodes are not reliable)
+        if (options.max_dist != 0) {
+            Transform match(TRANSFORM_2DMATCH);
+            match.parameters.push_back(0);
+            match.parameters.push_back(image.nb_channels-1);
+            match.parameters.push_back(0); // no softmatch until we actually use that feature
+            match.parameters.push_back(options.max_dist);
+            auto estimate = [&](Image img, bool finish) {
+                fuif_options eoptions = options;
+                if (finish && s.responsive && img.channel[0].w * img.channel[0].h > 20) {
+                    // with the squeeze that follows (see below), which can change which one is better
+                    img.do_transform(Transform(TRANSFORM_SQUEEZE));
+                    if (eoptions.max_group < 0) eoptions.max_group = 1;
+                }
+                eoptions.predictor.assign(img.nb_meta_channels, 3);
+                if (finish) eoptions.predictor.insert(eoptions.predictor.end(), img.nb_channels, 2); // the default predictors (see main)
+                eoptions.predictor.push_back(finish ? 0 : 2);
+                fuif_prepare_encode(img, eoptions);
+                return fuif_estimate(img, eoptions);
+            };
+            if (try_motion) {
+                // the motion search does not always beat the simple heuristic (e.g. with small frames or mostly static content)
+                Transform simple_match = match;
+                simple_match.parameters.push_back(0); // no motion search
+                Image with_simple = image;
+                image.do_transform(match);
+                if (with_simple.do_transform(simple_match)) {
+                    size_t size_motion = estimate(image, true), size_simple = estimate(with_simple, true);
+                    v_printf(3,"Matching: estimated size %lu bytes with motion search (without: %lu bytes)\n",(unsigned long) size_motion,(unsigned long) size_simple);
+                    if (size_simple < size_motion) image = std::move(with_simple);
+                }
+            } else if (!try_match) image.do_transform(match);
+            else {
+                // by default, only keep the matches if they pay off (they do for screenshots and text, not so much for patterns that are easy to predict)
+                Image with_match = image;
+                if (with_match.do_transform(match)) {
+                    size_t size_without = estimate(image, false), size_with = estimate(with_match, false);
+                    v_printf(3,"Matching: estimated size %lu bytes (without: %lu bytes)\n",(unsigned long) size_with,(unsigned long) size_without);
+                    if (size_with < size_without) image = std::move(with_match);
+                }
+                options.max_dist = (image.transform.size() && image.transform.back().ID == TRANSFORM_2DMATCH ? LARGEST_VAL : 0);
+            }
+        }
+
+        if (s.enable_dct) {
+            image.do_transform(Transform(TRANSFORM_DCT));
+            has_dct = true;
+        } else if (s.responsive && image.channel[0].w * image.channel[0].h > 20) { // no point squeezing tiny images
+            image.do_transform(Transform(TRANSFORM_SQUEEZE)); // use default squeezing
+            if (options.max_group < 0) options.max_group = 1;
+        }
+    }
+    return true;
+}
 
 int main(int argc, char** argv) {
 
@@ -108,12 +420,19 @@ int main(int argc, char** argv) {
         {"heatmap", 0, NULL, 'H'},
         {"framerate", 1, NULL, 'F'},
         {"approximate", 1, NULL, 'A'},
+        {"tree-cost", 1, NULL, 'T'},
+        {"target-size", 1, NULL, 'B'},
+        {"qualities", 1, NULL, 'q'},
+        {"time-budget", 1, NULL, 'W'},
+        {"memory-limit", 1, NULL, 'L'},
+        {"frame-index", 0, NULL, 'S'},
+        {"threads", 1, NULL, 'N'},
         {0,0,0,0}
     };
 
     bool decode=false;
     bool showhelp = false, showversion = false;
-    bool disable_ycocg = false, enable_dct = false, yuv = false, max_dist_set = false;
+    bool disable_ycocg = false, enable_dct = false, yuv = false, max_dist_set = false, frame_index = false;
     int responsive = -1;
     int c,i;
     float quality=100, cquality=101;
@@ -123,9 +442,13 @@ int main(int argc, char** argv) {
     int w,h, bitdepth=8;
     int framerate=-1;
     int approx_k=0, approx_q=3;
+    float target_size=0;
+    std::vector<float> qualities;
+    bool target_bpp=false;
+    int target_level=-1;
     fuif_options options = default_fuif_options;
 
-    while ((c = getopt_long (argc, argv, "hvVdiM:C:I:P:E:Q:JR:K:X:Y:y:UG:HF:A:", optlist, &i)) != -1) {
+    while ((c = getopt_long (argc, argv, "hvVdiM:C:I:P:E:Q:JR:K:X:Y:y:UG:HF:A:T:B:q:W:L:SN:", optlist, &i)) != -1) {
         switch (c) {
             case 'v': increase_verbosity(); break;
             case 'd': decode = true; break;
@@ -138,6 +461,8 @@ int main(int argc, char** argv) {
             case 'Q': sscanf(optarg,"%f,%f",&quality,&cquality); break;
             case 'J': enable_dct = true; break;
             case 'R': responsive = atoi(optarg); break;
+            case 'W': options.time_budget = atof(optarg); break;
+            case 'L': options.max_memory = (uint64_t)(atof(optarg) * 1048576); break;
             case 'i': options.identify = true; decode=true; break;
             case 'K': palette_colors = atoi(optarg); break;
             case 'X': channel_colors = 0.01*atof(optarg); break;
@@ -148,7 +473,17 @@ int main(int argc, char** argv) {
             case 'H': options.debug = true; break;
             case 'h': showhelp=true; break;
             case 'F': framerate=atoi(optarg); break;
+            case 'S': frame_index = true; break;
+            case 'N': options.nb_threads = atoi(optarg); set_nb_threads(options.nb_threads); break;
             case 'A': sscanf(optarg,"%i,%i",&approx_k,&approx_q); break;
+            case 'q': for (char *q = strtok(optarg,","); q; q = strtok(NULL,",")) qualities.push_back(atof(q)); break;
+            case 'T': options.tree_cost = atof(optarg); break;
+            case 'B': {
+                        char *end;
+                        target_size = strtod(optarg,&end);
+                        if (!strncmp(end,"bpp",3)) { target_bpp = true; end += 3; }
+                        if (*end == ',') target_level = atoi(end+1);
+                      } break;
             default: e_printf("Error: unknown option '%s'. Try --help.", argv[optind]); return 3;
         }
     }
@@ -172,19 +507,27 @@ int main(int argc, char** argv) {
         v_printf(1,"   -v, --verbose               increase verbosity (multiple -v for more output)\n");
         v_printf(1,"   -V, --version               print version number\n");
         v_printf(1,"   -i, --identify              decode only the header and print info about a FUIF file\n");
+        v_printf(2,"   -N, --threads=K             use at most K threads (default: 0, one per hardware thread)\n");
         v_printf(1,"Decode options:\n");
         v_printf(1,"   -R, --responsive=K          partial decode: -1=full image (default), 0=LQIP, 1=(1:16), 2=(1:8), 3=(1:4), 4=(1:2)\n");
+        v_printf(1,"   -W, --time-budget=MS        stop decoding after MS milliseconds and return the last completed responsive level\n");
+        v_printf(1,"   -L, --memory-limit=MB       refuse to decode images that need more than about MB megabytes of memory\n");
+        v_printf(1,"To write all responsive levels in one decode, use printf-style syntax for the scale, e.g. %s -d input.fuif output-1_%%i.png\n",argv[0]);
         v_printf(1,"Encode options:\n");
         v_printf(1,"   -Q, --quality=K             reduce quality by quantizing stuff\n");
         v_printf(1,"   -R, --responsive=K          0=false, 1=true (default: true)\n");
+        v_printf(1,"   -q, --qualities=Q1,Q2,...   encode several qualities at once, output filename should contain %%i (e.g. out-q%%i.fuif)\n");
+        v_printf(1,"   -B, --target-size=N[,L]     pick the quality so the file (or responsive level L, 0..4) takes about N bytes (or N bits per pixel, e.g. 0.5bpp)\n");
         v_printf(1,"   -y, --yuv420p=WxH[:b]       interpret input file as YUV420p with dimensions W x H and bit depth b\n");
         v_printf(2,"   -U, --uncompressed          don't use compression at all\n");
         v_printf(2,"   -E, --extra-properties=K    number of extra MANIAC tree properties to use\n",default_fuif_options.max_properties);
         v_printf(2,"   -I, --iterations=K          number of mock encodes to learn MANIAC trees (default=%.2f, try 0 for fast decode)\n",default_fuif_options.nb_repeats);
-        v_printf(2,"   -M, --match-dist=K          set maximum match distance (negative numbers to look abs(K) frames back, only at corresponding positions)\n");
-        v_printf(2,"                               (default=%i for still images, -1 for animations)\n",default_fuif_options.max_dist);
+        v_printf(2,"   -T, --tree-cost=K           trade compression for decode speed: prune MANIAC tree nodes that save less than K bits per decoded pixel\n");
+        v_printf(2,"                               (default=%.2f, try 0.05 for faster decode)\n",default_fuif_options.tree_cost);
+        v_printf(2,"   -M, --match-dist=K          set maximum match distance (negative numbers to look abs(K) frames back, with a block motion search if the frames are less than ~120 pixels tall, otherwise only at corresponding positions)\n");
+        v_printf(2,"                               (default: up to %i for lossless still images if it pays off, -1 for animations)\n",LARGEST_VAL);
         v_printf(3,"   -J, --dct                   use JPEG-style DCT instead of Squeeze (lossy)\n");
-        v_printf(3,"   -C, --colorspace=K          0=RGB, 1=YCbCr, 2=YCoCg (default: keep for JPEG/YUV input, YCoCg for other input)\n");
+        v_printf(3,"   -C, --colorspace=K          0=RGB, 1=YCbCr, 2=YCoCg, 3=XYB (default: keep for JPEG/YUV input, YCoCg for other input)\n");
         v_printf(3,"   -K, --palette=K             use a palette if image has at most K colors (default: %i)\n",palette_colors);
         v_printf(3,"   -X, --pre-compact=K         compact channels (before color transform) if ratio used/range is below this (default: %.1f%%)\n", 100.0 * channel_colors_pre_transform);
         v_printf(3,"   -Y, --post-compact=K        compact channels (after color transform) if ratio used/range is below this (default: %.1f%%)\n", 100.0 * channel_colors);
@@ -194,6 +537,8 @@ int main(int argc, char** argv) {
         v_printf(5,"   -H, --heatmap               write bit cost heatmap to files heatmap*\n");
         v_printf(1,"To encode animations, you can use printf-style syntax, e.g. %s frame-%%02d.png animation.fuif.\n",argv[0]);
         v_printf(2,"   -F, --framerate=K           frames per second (default: 10)\n");
+        v_printf(2,"   -S, --frame-index           encode every frame separately, with an index, so players can decode one frame at a time\n");
+        v_printf(2,"                               (frames are not matched with previous frames then)\n");
         return 2;
     }
 
@@ -210,32 +555,53 @@ int main(int argc, char** argv) {
         }
         options.preview = responsive;
         Image decoded;
-        if (fuif_decode_file(argv[0],decoded,options)) {
-            if (options.identify) return 0;
-            if (!strcasecmp(argv[1],"null:")) {
-                decoded.undo_transforms();
-                return 0;
-            }
-            if (!strcasecmp(argv[1],"null_yuv:")) {
-                decoded.undo_transforms(2);
-                return 0;
-            }
-            if (!strcasecmp(argv[1],"null_none:")) {
-                return 0;
-            }
-
-            const char *ext = strrchr(argv[1],'.');
-
-            if (ext && !strcasecmp(ext,".yuv")) {
-                decoded.undo_transforms(2);
-                write_YUV_file(argv[1],decoded);
-            } else {
-                decoded.undo_transforms();
-                if (ext && !strcasecmp(ext,".png"))
-                    write_PNG_file(argv[1],decoded);
-                else
-                    write_PAM_file(argv[1],decoded);
+        std::deque<std::thread> workers;
+        bool all_levels = (!options.identify && strchr(argv[1],'%'));
+        if (all_levels && !valid_number_pattern(argv[1])) {
+            e_printf("Error: to write all responsive levels, the output filename should contain the scale as a printf-style pattern, e.g. output-%%i.png\n");
+            return 1;
+        }
+        if (all_levels) {
+            // write every responsive level while decoding, %i in the filename is replaced by the downscale factor;
+            // with more than one thread, levels are written in the background (at most get_nb_threads()-1 at a time, each with a snapshot)
+            options.level_callback = [&](int level, const Image &image) {
+                char name[1024];
+                snprintf(name, sizeof(name), argv[1], RESPONSIVE_SIZE(level));
+                int max_writers = get_nb_threads() - 1;
+                if (max_writers < 1) {
+                    Image snapshot = image;
+                    write_decoded_image(name, snapshot);
+                    return;
+                }
+                while (workers.size() >= max_writers) { workers.front().join(); workers.pop_front(); }
+                workers.emplace_back([filename=std::string(name), snapshot=image]() mutable {
+                    write_decoded_image(filename.c_str(), snapshot);
+                });
+            };
+        }
+        uint64_t peak_memory = 0;
+        if (options.identify) options.peak_memory = &peak_memory; // only to show it
+        bool decoded_ok;
+        if (!strcmp(argv[0],"-")) {
+            // standard input can be a slow pipe: decode channel groups as their data arrives
+            fuif_stream_decoder decoder(decoded, options);
+            std::vector<uint8_t> chunk(4096);
+            size_t len;
+            decoded_ok = true;
+            while (decoded_ok && !decoder.is_done() && (len = fread(chunk.data(), 1, chunk.size(), stdin)) > 0)
+                decoded_ok = decoder.push(chunk.data(), len);
+            if (decoded_ok) decoded_ok = decoder.finish();
+        } else decoded_ok = fuif_decode_file(argv[0],decoded,options);
+        if (decoded_ok && !options.identify) {
+            if (!all_levels) write_decoded_image(argv[1], decoded);
+            else if (responsive < 0) {
+                char name[1024];
+                snprintf(name, sizeof(name), argv[1], 1);
+                write_decoded_image(name, decoded);
             }
+        }
+        for (std::thread &w : workers) w.join();
+        if (decoded_ok) {
             return 0;
         } else {
             e_printf("Could not decode %s\n",argv[0]);
@@ -249,88 +615,21 @@ int main(int argc, char** argv) {
     Image input_img;
     int image_type = -1; // 0 = JPEG, 1 = PNG/PPM, 2 = YUV, 3 = FUIF, 4 = GIF
 
-    int frame=0;
-    char filename[1024];
     bool multiframe=false;
     if (strstr(argv[0],"%")) multiframe=true;
     else {
         input_img = read_GIF_file(argv[0]);
         image_type = 4;
     }
-    Image multi_input_img;
-    if (!input_img.w)
-    while (true) {
-      snprintf(filename,1024,argv[0],frame);
-      if(!file_exists(filename)) {
-        if (!multiframe) {
-            e_printf("Error: no such file: %s\n",filename);
-            return 1;
-        } else {
-            if (multi_input_img.w > 0) break;
-            if (frame > 100) {
-                e_printf("Error: no such files: %s\n",argv[0]);
-                return 1;
-            }
-            frame++; continue;
-        }
-      }
-      if (yuv) {
-          input_img = read_YUV_file(filename,w,h,bitdepth);
-          if (!input_img.w) {
-            e_printf("Error: could not read input file %s (expecting YUV input)\n",filename);
-            return 1;
-          }
-          image_type = 2;
-      } else {
-        input_img = read_JPEG_file(filename);
-        if (input_img.w) {
-            image_type = 0;
-        } else {
-          // Couldn't load the input as JPEG, try loading as PNG
-          image_type = 1;
-          input_img = read_PNG_file(filename);
-          if (!input_img.w) {
-            // Couldn't load it as PNG, trying as PPM/PAM
-            input_img = read_PAM_file(filename);
-            if (!input_img.w) {
-              if (fuif_decode_file(filename,input_img,options)) {
-                v_printf(2,"Re-encoding existing FUIF file.\n");
-                image_type = 3;
-              } else {
-                e_printf("Error: could not read input file %s (expecting PNM/PAM, PNG, JPEG, GIF or FUIF input)\n",filename);
-                return 1;
-              }
-            }
-          }
-        }
-      }
-      if (!multiframe) break;
-      frame++;
-      if (multi_input_img.h == 0) multi_input_img = std::move(input_img);
-      else {
-        if (input_img.w != multi_input_img.w || input_img.h != multi_input_img.h / multi_input_img.nb_frames) {
-                e_printf("Error: input frame %s has wrong dimensions (%ix%i, expected %ix%i)\n",filename,input_img.w,input_img.h,multi_input_img.w,multi_input_img.h / multi_input_img.nb_frames);
-                return 1;
-        }
-        if (input_img.nb_channels != multi_input_img.nb_channels) {
-                e_printf("Error: input frame %s has wrong number of channels\n",filename);
-                return 1;
-        }
-        multi_input_img.h += input_img.h;
-        for (int i=0; i<multi_input_img.channel.size(); i++) {
-            Channel &ch = multi_input_img.channel[i];
-            Channel &ich = input_img.channel[i];
-            // todo: check that all channel fields are the same
-            int offset = ch.w*ch.h;
-            ch.resize(ch.w,ch.h + ich.h);
-            for (int j=0; j<ich.data.size(); j++) ch.data[offset+j] = ich.data[j];
-        }
-        multi_input_img.nb_frames++;
-      }
-    }
     if (multiframe) {
-        input_img = std::move(multi_input_img);
+        if (!read_input_frames(argv[0], input_img, image_type, yuv, w, h, bitdepth, options)) return 1;
         v_printf(2,"Loaded %i frames from files %s\n",input_img.nb_frames,argv[0]);
+    } else if (!input_img.w) {
+        if (!file_exists(argv[0])) {
+            e_printf("Error: no such file: %s\n",argv[0]);
+            return 1;
+        }
+        if (!read_input_image(argv[0], input_img, image_type, yuv, w, h, bitdepth, options)) return 1;
     }
     if (framerate>0) input_img.den = framerate;
 
@@ -342,175 +641,22 @@ int main(int argc, char** argv) {
         input_img.channel.erase(input_img.channel.begin()+input_img.nb_meta_channels+3,input_img.channel.begin()+input_img.nb_meta_channels+4);
     }
 
-    if (quality < 100 && palette_colors > 0) {
+    if ((quality < 100 || target_size > 0 || qualities.size()) && palette_colors > 0) {
         v_printf(3,"Lossy encode, not doing palette transforms\n");
         channel_colors = 0;
         channel_colors_pre_transform = 0;
         palette_colors = 0;
     }
 
-    if (image_type == 0) {
-        // Default options for JPEG input
-        has_dct = true;
-        if (input_img.real_nb_channels > 1) {
-          bool ycbcr = (input_img.transform[0].ID == TRANSFORM_YCbCr);
-          if ( (colorspace == 0 && ycbcr) || (colorspace == 1 && !ycbcr) || colorspace > 1) {
-              e_printf("Error: cannot change the color space of JPEG input\n");
-              return 1;
-          }
-
-/*
-          // do something like this if you want to use another scan script
-            Transform reorder(TRANSFORM_PERMUTE);
-            for (int i=0; i<input_img.channel.size(); i++) { reorder.parameters.push_back(input_img.channel.size()-1-i); }
-            input_img.do_transform(reorder);
-          // can also use TRANSFORM_APPROXIMATE
-*/
-        }
-    } else if (image_type == 1 || image_type == 4) {
-
-        // Default options for PNG/PPM/GIF input
-
-        if (channel_colors_pre_transform > 0 && colorspace != 0 && image_type != 4) {
-          // single channel palette (like FLIF's ChannelCompact)
-          input_img.recompute_minmax();
-          for (int i=0; i<input_img.nb_channels; i++) {
-            int colors = (input_img.channel[input_img.nb_meta_channels+i].maxval - input_img.channel[input_img.nb_meta_channels+i].minval + 1);
-            if (colors < 256) continue; // only do this for 16-bit PNGs
-            v_printf(10,"Channel %i: range=%i..%i\n",i,input_img.channel[input_img.nb_meta_channels+i].minval,input_img.channel[input_img.nb_meta_channels+i].maxval);
-            Transform maybe_palette_1(TRANSFORM_PALETTE);
-            maybe_palette_1.parameters.push_back(i);
-            maybe_palette_1.parameters.push_back(i);
-            // simple heuristic: if less than X percent of the values in the range actually occur, it is probably worth it to do a compaction
-            maybe_palette_1.parameters.push_back((int) (channel_colors_pre_transform * colors));
-            input_img.do_transform(maybe_palette_1);
-          }
-        }
-
-        input_img.recompute_minmax();
-
-        if (colorspace < 0 || colorspace == 2) {
-            input_img.do_transform(Transform(TRANSFORM_YCoCg));
-        } else if (colorspace == 1) {
-            input_img.do_transform(Transform(TRANSFORM_YCbCr));
-        } else if (colorspace == 3) {
-            input_img.do_transform(Transform(TRANSFORM_XYB));
-        }
-
-        if (palette_colors > 0) {
-          // all-channel palette (e.g. RGBA)
-          if (input_img.nb_channels > 1) {
-            Transform maybe_palette(TRANSFORM_PALETTE);
-            maybe_palette.parameters.push_back(0);
-            maybe_palette.parameters.push_back(input_img.nb_channels - 1);
-            maybe_palette.parameters.push_back(palette_colors);
-            input_img.do_transform(maybe_palette);
-          }
-          // all-minus-one-channel palette (RGB with separate alpha, or CMY with separate K)
-          if (input_img.nb_channels > 3) {
-            Transform maybe_palette_3(TRANSFORM_PALETTE);
-            maybe_palette_3.parameters.push_back(0);
-            maybe_palette_3.parameters.push_back(input_img.nb_channels - 2);
-            maybe_palette_3.parameters.push_back(palette_colors);
-            input_img.do_transform(maybe_palette_3);
-          }
-        }
-        if (channel_colors > 0) {
-          // single channel palette (like FLIF's ChannelCompact)
-          input_img.recompute_minmax();
-          for (int i=0; i<input_img.nb_channels; i++) {
-            v_printf(10,"Channel %i: range=%i..%i\n",i,input_img.channel[input_img.nb_meta_channels+i].minval,input_img.channel[input_img.nb_meta_channels+i].maxval);
-            Transform maybe_palette_1(TRANSFORM_PALETTE);
-            maybe_palette_1.parameters.push_back(i);
-            maybe_palette_1.parameters.push_back(i);
-            // simple heuristic: if less than X percent of the values in the range actually occur, it is probably worth it to do a compaction
-            maybe_palette_1.parameters.push_back((int) (channel_colors * (input_img.channel[input_img.nb_meta_channels+i].maxval - input_img.channel[input_img.nb_meta_channels+i].minval + 1)));
-            input_img.do_transform(maybe_palette_1);
-          }
-        }
-    } else if (image_type == 2) {
-          // make chroma more important, since .yuv is YCbCr which has a smaller chroma range than YCoCg and also it is already subsampled
-          squeeze_luma_factor *= 3.0;
-          squeeze_quality_factor /= 3.0;
-    }
-
-
-    if (image_type == 1 || image_type == 2 || image_type == 4) {
-
-        if (input_img.nb_frames > 1 && !max_dist_set) options.max_dist = -1; // use the simple heuristic of matching with corresponding pixels from the previous frame
-        if (options.max_dist != 0) {
-            Transform match(TRANSFORM_2DMATCH);
-            match.parameters.push_back(0);
-            match.parameters.push_back(input_img.nb_channels-1);
-            match.parameters.push_back(0); // no softmatch until we actually use that feature
-            match.parameters.push_back(options.max_dist);
-            input_img.do_transform(match);
-        }
-
-        if (enable_dct) {
-            input_img.do_transform(Transform(TRANSFORM_DCT));
-            has_dct = true;
-        } else if (responsive && input_img.channel[0].w * input_img.channel[0].h > 20) { // no point squeezing tiny images
-            input_img.do_transform(Transform(TRANSFORM_SQUEEZE)); // use default squeezing
-            if (options.max_group < 0) options.max_group = 1;
-        }
-    }
-
-    if ( (quality<100 || cquality<100) && image_type != 3) {
-        v_printf(2,"Adding quantization constants corresponding to luma quality %.2f and chroma quality %.2f\n",quality,cquality);
-        if (!enable_dct && !responsive) {
-            v_printf(1,"Warning: lossy compression without either DCT or Squeeze transform is just color quantization.\n");
-            quality = (400 + quality)/5;
-            cquality = (400 + cquality)/5;
-        }
-        Transform quantize(TRANSFORM_QUANTIZE);
-        float loss = 100-quality;
-        for (int i=0; i<input_img.nb_meta_channels; i++)
-            quantize.parameters.push_back(1); // don't quantize metachannels
-
-        // convert 'quality' to quantization scaling factor
-        if (quality > 50) quality = 200.0 - quality*2.0;
-        else quality = 900.0 - quality*16.0;
-        if (cquality > 50) cquality = 200.0 - cquality*2.0;
-        else cquality = 900.0 - cquality*16.0;
-        quality *= 0.01f;
-        cquality *= 0.01f;
-
-        if (has_dct) {
-          for (int nbi=0; nbi < 64; nbi++) {
-            int bi=0;
-            for (; bi<64 ; bi++) if (nbi==jpeg_zigzag[bi]) break;
-            for (int ci=0; ci < input_img.nb_channels; ci++) {
-                int q;
-                if (colorspace != 0 && ci > 0 && ci < 3) q = cquality * dct_chroma_qtable[bi];
-                else q = quality * dct_luma_qtable[bi];
-                if (q<1) q = 1;
-                quantize.parameters.push_back(q);
-            }
-          }
-        } else {
-          for (int i=input_img.nb_meta_channels; i<input_img.channel.size(); i++) {
-            Channel &ch = input_img.channel[i];
-            int shift = ch.hcshift + ch.vcshift; // number of pixel halvings
-            if (shift > 15) shift = 15;
-            int q;
-            if (colorspace != 0 && ch.component > 0 && ch.component < 3) q = cquality * squeeze_quality_factor * squeeze_chroma_qtable[shift];
-            else q = quality * squeeze_quality_factor * squeeze_luma_factor * squeeze_luma_qtable[shift];
-            if (q<1) q = 1;
-            quantize.parameters.push_back(q);
-          }
-        }
-        input_img.do_transform(quantize);
-    }
-    if (approx_k > 0) {
-        Transform approximate(TRANSFORM_APPROXIMATE);
-        approximate.parameters.push_back(input_img.channel.size()-approx_k);
-        approximate.parameters.push_back(input_img.channel.size()-1);
-        approximate.parameters.push_back(approx_q);
-        input_img.do_transform(approximate);
+    encode_settings settings = {colorspace, channel_colors, channel_colors_pre_transform, palette_colors, enable_dct, responsive, max_dist_set,
+                                (quality == 100 && cquality == 100 && target_size <= 0 && !qualities.size() && !enable_dct)};
+    if (frame_index && (input_img.nb_frames < 2 || input_img.transform.size())) {
+        v_printf(1,"Warning: a frame index is only used for animations from PNG/PNM/GIF input.\n");
+        frame_index = false;
     }
+    if (!frame_index && !do_transforms(input_img, options, image_type, settings, has_dct)) return 1;
 
-
+    Image input_alpha;
     if (argc>2) {
         if (image_type != 0) {
             v_printf(1,"Warning: adding an alpha channel is intended to be used with a JPEG input - this is probably broken for other input formats.\n");
@@ -520,7 +666,7 @@ int main(int argc, char** argv) {
             return 1;
         }
         argv++; argc--;
-        Image input_alpha = read_PNG_file(argv[0]);
+        input_alpha = read_PNG_file(argv[0]);
         if (!input_alpha.w) {
           input_alpha = read_PAM_file(argv[0]);
           if (!input_alpha.w) {
@@ -532,62 +678,259 @@ int main(int argc, char** argv) {
             v_printf(2,"Warning: alpha image %s is not grayscale (using just the first channel).\n",argv[0]);
         }
         if (input_alpha.channel[0].w != input_img.w || input_alpha.channel[0].h != input_img.h) {
-            e_printf("Error: alpha image has dimensions %ix%i while main image has dimensions %ix%i.\n");
+            e_printf("Error: alpha image has dimensions %ix%i while main image has dimensions %ix%i.\n",input_alpha.channel[0].w,input_alpha.channel[0].h,input_img.w,input_img.h);
             return 1;
         }
-        int position = input_img.nb_meta_channels+input_img.nb_channels;
-        input_img.channel.insert(input_img.channel.begin()+position, input_alpha.channel[0]);
-        input_img.nb_channels++;
-        input_img.real_nb_channels++;
-        input_img.channel[position].component = 3;
-        for (int i=0; i<input_img.transform.size(); i++) {
-            // have to adjust the DCT transform so that it only applies to channels 0-2, not to the alpha channel
-            if (input_img.transform[i].ID == TRANSFORM_DCT && input_img.transform[i].parameters.size() == 0) {
-                input_img.transform[i].parameters.push_back(0);
-                input_img.transform[i].parameters.push_back(input_img.nb_channels-2);
+    }
+
+    // everything from here on depends on the quality setting; for rate control this is done several times
+    auto finish_transforms = [&](Image &img, fuif_options &options, float quality, float cquality) {
+        if ( (quality<100 || cquality<100) && image_type != 3) {
+            v_printf(2,"Adding quantization constants corresponding to luma quality %.2f and chroma quality %.2f\n",quality,cquality);
+            if (!enable_dct && !responsive) {
+                v_printf(1,"Warning: lossy compression without either DCT or Squeeze transform is just color quantization.\n");
+                quality = (400 + quality)/5;
+                cquality = (400 + cquality)/5;
+            }
+            Transform quantize(TRANSFORM_QUANTIZE);
+            float loss = 100-quality;
+            for (int i=0; i<img.nb_meta_channels; i++)
+                quantize.parameters.push_back(1); // don't quantize metachannels
+
+            // convert 'quality' to quantization scaling factor
+            if (quality > 50) quality = 200.0 - quality*2.0;
+            else quality = 900.0 - quality*16.0;
+            if (cquality > 50) cquality = 200.0 - cquality*2.0;
+            else cquality = 900.0 - cquality*16.0;
+            quality *= 0.01f;
+            cquality *= 0.01f;
+
+            if (has_dct) {
+              for (int nbi=0; nbi < 64; nbi++) {
+                int bi=0;
+                for (; bi<64 ; bi++) if (nbi==jpeg_zigzag[bi]) break;
+                for (int ci=0; ci < img.nb_channels; ci++) {
+                    int q;
+                    if (colorspace != 0 && ci > 0 && ci < 3) q = cquality * dct_chroma_qtable[bi];
+                    else q = quality * dct_luma_qtable[bi];
+                    if (q<1) q = 1;
+                    quantize.parameters.push_back(q);
+                }
+              }
+            } else {
+              for (int i=img.nb_meta_channels; i<img.channel.size(); i++) {
+                Channel &ch = img.channel[i];
+                int shift = ch.hcshift + ch.vcshift; // number of pixel halvings
+                if (shift > 15) shift = 15;
+                int q;
+                if (colorspace != 0 && ch.component > 0 && ch.component < 3) q = cquality * squeeze_quality_factor * squeeze_chroma_qtable[shift];
+                else q = quality * squeeze_quality_factor * squeeze_luma_factor * squeeze_luma_qtable[shift];
+                if (q<1) q = 1;
+                quantize.parameters.push_back(q);
+              }
             }
+            img.do_transform(quantize);
         }
-        if (channel_colors > 0) {
-          // single channel palette (like FLIF's ChannelCompact)
-          input_img.recompute_minmax();
-          int i = position;
-            v_printf(10,"Channel %i: range=%i..%i\n",i,input_img.channel[input_img.nb_meta_channels+i].minval,input_img.channel[input_img.nb_meta_channels+i].maxval);
-            Transform maybe_palette_1(TRANSFORM_PALETTE);
-            maybe_palette_1.parameters.push_back(i);
-            maybe_palette_1.parameters.push_back(i);
-            // simple heuristic: if less than X percent of the values in the range actually occur, it is probably worth it to do a compaction
-            maybe_palette_1.parameters.push_back((int) (channel_colors * (input_img.channel[input_img.nb_meta_channels+i].maxval - input_img.channel[input_img.nb_meta_channels+i].minval + 1)));
-            if (input_img.do_transform(maybe_palette_1)) position++;
+        if (approx_k > 0) {
+            Transform approximate(TRANSFORM_APPROXIMATE);
+            approximate.parameters.push_back(img.channel.size()-approx_k);
+            approximate.parameters.push_back(img.channel.size()-1);
+            approximate.parameters.push_back(approx_q);
+            img.do_transform(approximate);
+        }
+
+
+        if (input_alpha.w) {
+            int position = img.nb_meta_channels+img.nb_channels;
+            img.channel.insert(img.channel.begin()+position, input_alpha.channel[0]);
+            img.nb_channels++;
+            img.real_nb_channels++;
+            img.channel[position].component = 3;
+            for (int i=0; i<img.transform.size(); i++) {
+                // have to adjust the DCT transform so that it only applies to channels 0-2, not to the alpha channel
+                if (img.transform[i].ID == TRANSFORM_DCT && img.transform[i].parameters.size() == 0) {
+                    img.transform[i].parameters.push_back(0);
+                    img.transform[i].parameters.push_back(img.nb_channels-2);
+                }
+            }
+            if (channel_colors > 0) {
+              // single channel palette (like FLIF's ChannelCompact)
+              img.recompute_minmax();
+              int i = position;
+                v_printf(10,"Channel %i: range=%i..%i\n",i,img.channel[img.nb_meta_channels+i].minval,img.channel[img.nb_meta_channels+i].maxval);
+                Transform maybe_palette_1(TRANSFORM_PALETTE);
+                maybe_palette_1.parameters.push_back(i);
+                maybe_palette_1.parameters.push_back(i);
+                // simple heuristic: if less than X percent of the values in the range actually occur, it is probably worth it to do a compaction
+                maybe_palette_1.parameters.push_back((int) (channel_colors * (img.channel[img.nb_meta_channels+i].maxval - img.channel[img.nb_meta_channels+i].minval + 1)));
+                if (img.do_transform(maybe_palette_1)) position++;
+            }
+
+
+            // squeeze alpha to 1:8 so it matches the dimensions of the DC
+            Transform squeeze_alpha(TRANSFORM_SQUEEZE);
+            for (int k=0; k<3; k++) {
+            squeeze_alpha.parameters.push_back(1);
+            squeeze_alpha.parameters.push_back(position);
+            squeeze_alpha.parameters.push_back(position);
+            squeeze_alpha.parameters.push_back(0);
+            squeeze_alpha.parameters.push_back(position);
+            squeeze_alpha.parameters.push_back(position);
+            }
+            img.do_transform(squeeze_alpha);
+        }
+        if (responsive && has_dct && image_type != 3) {
+            img.do_transform(Transform(TRANSFORM_SQUEEZE)); // use default squeezing
         }
 
+        if (options.predictor.size() == 0) {
+            // no explicit predictor(s) given, set a good default
+            for (int i=0; i<img.nb_meta_channels; i++)
+                options.predictor.push_back(3);     // left predictor for the meta channels
 
-        // squeeze alpha to 1:8 so it matches the dimensions of the DC
-        Transform squeeze_alpha(TRANSFORM_SQUEEZE);
-        for (int k=0; k<3; k++) {
-        squeeze_alpha.parameters.push_back(1);
-        squeeze_alpha.parameters.push_back(position);
-        squeeze_alpha.parameters.push_back(position);
-        squeeze_alpha.parameters.push_back(0);
-        squeeze_alpha.parameters.push_back(position);
-        squeeze_alpha.parameters.push_back(position);
+            for (int i=0; i<img.nb_channels; i++)
+                options.predictor.push_back(2);     // median predictor for the DC / squeezed channels
+            options.predictor.push_back(0);         // zero predictor for the AC / squeeze residues
         }
-        input_img.do_transform(squeeze_alpha);
+
+        fuif_prepare_encode(img,options);
+    };
+
+    if (target_size > 0 && qualities.size()) {
+        e_printf("Error: a target size cannot be combined with multiple qualities\n");
+        return 1;
     }
-    if (responsive && has_dct && image_type != 3) {
-        input_img.do_transform(Transform(TRANSFORM_SQUEEZE)); // use default squeezing
+    if (frame_index) {
+        if (target_size > 0 || qualities.size() || input_alpha.w) {
+            e_printf("Error: a frame index cannot be combined with a target size, multiple qualities or an alpha image\n");
+            return 1;
+        }
+        // every frame is encoded as a separate image
+        int fh = input_img.h / input_img.nb_frames;
+        std::vector<std::vector<uint8_t>> frames;
+        for (int f=0; f<input_img.nb_frames; f++) {
+            Image frame_img(input_img.w, fh, input_img.maxval, input_img.nb_channels, input_img.colormodel);
+            frame_img.icc_profile = input_img.icc_profile;
+            for (int i=0; i<frame_img.channel.size(); i++) {
+                const pixel_type *p = &input_img.channel[i].data[(size_t)f*fh*input_img.w];
+                std::copy(p, p + (size_t)fh*input_img.w, frame_img.channel[i].data.begin());
+            }
+            fuif_options frame_options = options;
+            v_printf(2,"Frame %i:\n", f);
+            if (!do_transforms(frame_img, frame_options, image_type, settings, has_dct)) return 1;
+            finish_transforms(frame_img, frame_options, quality, cquality);
+            BlobIO blob;
+            if (!fuif_encode(blob, frame_img, frame_options)) {
+                e_printf("Error: could not encode frame %i\n", f);
+                return 1;
+            }
+            size_t size;
+            uint8_t *data = blob.release(&size);
+            frames.emplace_back(data, data+size);
+            delete [] data;
+        }
+        v_printf(2,"Encoding %s\n", argv[1]);
+        return (fuif_encode_frame_index_file(argv[1], input_img, frames) ? 0 : 1);
+    }
+    if (target_size > 0 && image_type == 3) {
+        v_printf(1,"Warning: target size is ignored when re-encoding a FUIF file.\n");
+    } else if (target_size > 0) {
+        if (target_level < -1 || target_level > 4) {
+            e_printf("Invalid responsive level for -B option (range: 0..4)\n");
+            return 1;
+        }
+        if (target_bpp) {
+            float pixels = input_img.w * input_img.h;
+            if (target_level >= 0) pixels /= RESPONSIVE_SIZE(target_level) * RESPONSIVE_SIZE(target_level);
+            target_size *= pixels / 8;
+        }
+        // chroma quality follows luma quality (at the same distance, if it was specified)
+        float cquality_offset = cquality - quality;
+        auto chroma_quality = [&](float q) { return q + cquality_offset; };
+        auto estimate = [&](float q) {
+            Image candidate = input_img;
+            finish_transforms(candidate, options, q, chroma_quality(q));
+            size_t estimated = fuif_estimate(candidate, options, target_level);
+            v_printf(3,"Rate control: quality %.2f gives an estimated size of %lu bytes (target: %.0f bytes)\n", q, (unsigned long) estimated, target_size);
+            return estimated;
+        };
+        auto encoded_size = [&](float q) {
+            Image candidate = input_img;
+            fuif_options coptions = options;
+            finish_transforms(candidate, coptions, q, chroma_quality(q));
+            size_t level_bytes[6];
+            coptions.level_bytes = level_bytes;
+            BlobIO blob;
+            if (!fuif_encode(blob, candidate, coptions)) return (size_t) 0;
+            size_t size = level_bytes[target_level < 0 ? 5 : target_level];
+            v_printf(3,"Rate control: quality %.2f gives %lu bytes (target: %.0f bytes)\n", q, (unsigned long) size, target_size);
+            return size;
+        };
+        // bisection on the quality scale, below lossless (a target size is about choosing how much to lose)
+        auto bisect = [&](float target) {
+            float lo = 0, hi = std::min(quality, 99.f);
+            if (estimate(hi) <= target) return hi;
+            for (int it=0; it<7; it++) {
+                float mid = (lo+hi)*0.5f;
+                if (estimate(mid) > target) hi = mid;
+                else lo = mid;
+            }
+            return lo;
+        };
+        // the estimates tend to be somewhat low, so the choice is checked with a real encode: if it is too large, the bisection is
+        // redone for a target that is smaller by the misestimate, and as a last resort the quality is lowered step by step
+        float q = bisect(target_size);
+        size_t size = encoded_size(q);
+        for (int round=0; round<2 && size > target_size && q > 0; round++) {
+            q = std::max(std::min(bisect(target_size * estimate(q) / size), q - 1), 0.f);
+            size = encoded_size(q);
+        }
+        while (size > target_size && q > 0) {
+            q = std::max(q - 5, 0.f);
+            size = encoded_size(q);
+        }
+        if (size > target_size) v_printf(1,"Warning: target size of %.0f bytes is not reachable (%lu bytes at quality 0).\n", target_size, (unsigned long) size);
+        cquality = chroma_quality(q);
+        quality = q;
+        v_printf(2,"Rate control: using quality %.2f\n", quality);
     }
 
-    if (options.predictor.size() == 0) {
-        // no explicit predictor(s) given, set a good default
-        for (int i=0; i<input_img.nb_meta_channels; i++)
-            options.predictor.push_back(3);     // left predictor for the meta channels
-
-        for (int i=0; i<input_img.nb_channels; i++)
-            options.predictor.push_back(2);     // median predictor for the DC / squeezed channels
-        options.predictor.push_back(0);         // zero predictor for the AC / squeeze residues
+    if (qualities.size()) {
+        // multiple qualities: do the quality-dependent part and the encoding of each of them in parallel (on at most get_nb_threads() threads)
+        if (!valid_number_pattern(argv[1])) {
+            e_printf("Error: when encoding multiple qualities, the output filename should contain the quality as a printf-style pattern, e.g. output-%%i.fuif\n");
+            return 1;
+        }
+        std::vector<std::string> names;
+        std::set<std::string> unique_names;
+        for (float q : qualities) {
+            char name[1024];
+            snprintf(name, sizeof(name), argv[1], (int) q);
+            if (!unique_names.insert(name).second) {
+                e_printf("Error: several qualities give the same output filename %s (qualities are rounded down to an integer)\n", name);
+                return 1;
+            }
+            names.push_back(name);
+        }
+        float cquality_offset = cquality - quality;
+        std::vector<char> ok(qualities.size(), false);
+        parallel_for(0, qualities.size(), 1, [&](int k0, int k1) {
+            for (int k=k0; k<k1; k++) {
+                Image img = input_img;
+                fuif_options qoptions = options;
+                finish_transforms(img, qoptions, qualities[k], qualities[k] + cquality_offset);
+                v_printf(2,"Encoding %s\n", names[k].c_str());
+                ok[k] = fuif_encode_file(names[k].c_str(), img, qoptions);
+            }
+        });
+        int result = 0;
+        for (size_t k=0; k<qualities.size(); k++) {
+            if (!ok[k]) { e_printf("Error: could not encode quality %.2f\n", qualities[k]); result = 1; }
+        }
+        return result;
     }
 
-    fuif_prepare_encode(input_img,options);
+    finish_transforms(input_img, options, quality, cquality);
 
 
     // this is nice to debug/visualize matching (e.g. using -D1000 -R0)
@@ -32,6 +32,7 @@ SOFTWARE.
 #include "config.h"
 #include "image/image.h"
 #include "encoding/encoding.h"
+#include "export/write_buffer.h"
 #include <getopt.h>
 
 int main(int argc, char *argv[]) {
@@ -73,32 +74,37 @@ int main(int argc, char *argv[]) {
 
     SDL_Window *window;
     SDL_Renderer *renderer;
-    SDL_Surface *surface;
-    SDL_Texture *texture;
+    SDL_Texture *texture, *background = NULL;
     SDL_Event event;
 
     char title[32] = {0};
 
-    char * sp;
-    Uint32 pixel;
+    void *pixels;
+    int pitch;
     int ret, paused, quit;
     Uint32 t0, t1, delay, delta;
 
 
+    // an animation with a frame index is decoded one frame at a time, while playing; anything else is decoded completely first
+    fuif_frame_decoder frame_decoder(argv[0], options);
     Image decoded;
-    if (fuif_decode_file(argv[0],decoded,options)) {
-        decoded.undo_transforms();
-    } else {
+    int decoded_frame = 0;  // frame that is in 'decoded' (with a frame index)
+    bool decoded_ok;
+    if (frame_decoder.indexed()) decoded_ok = frame_decoder.decode_frame(0, decoded);
+    else if ((decoded_ok = fuif_decode_file(argv[0],decoded,options))) decoded.undo_transforms();
+    if (!decoded_ok) {
         e_printf("Could not decode %s\n",argv[0]);
         return -1;
     }
 
-    int w = decoded.w;
-    int h = decoded.h / decoded.nb_frames;
-    int frames = decoded.nb_frames;
+    const Image &info = (frame_decoder.indexed() ? frame_decoder.info : decoded);
+    int w = info.w;
+    int h = info.h / info.nb_frames;
+    int frames = info.nb_frames;
+    int den = info.den;
     int cf = 0;
 
-    printf("Decoded %ix%i FUIF with %i frames, %i fps\n",w,h,frames,decoded.den);
+    printf("Decoded %ix%i FUIF with %i frames, %i fps\n",w,h,frames,den);
 
     if (SDL_Init(SDL_INIT_VIDEO|SDL_INIT_TIMER) != 0) {
         SDL_Log("Unable to initialize SDL: %s", SDL_GetError());
@@ -116,15 +122,34 @@ int main(int argc, char *argv[]) {
     SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0x00);
     SDL_RenderClear(renderer);
     SDL_RenderPresent(renderer);
-    surface = SDL_CreateRGBSurface(0, w, h, 32, 0x000000FF,0x0000FF00,0x00FF0000,0xFF000000);
-    if (!surface) {
-        SDL_Log("SDL_CreateRGBSurface() failed: %s", SDL_GetError());
+    SDL_RenderSetLogicalSize(renderer, w, h);
+    // the frames are written straight into the texture memory
+    texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STREAMING, w, h);
+    if (!texture) {
+        SDL_Log("SDL_CreateTexture() failed: %s", SDL_GetError());
         return 1;
     }
     paused = 0;
     quit = 0;
-    bool alpha=(decoded.nb_channels > 3);
-    if (decoded.den == 0 || frames < 2) decoded.den = 2; // update twice per second if it's not an animation
+    bool alpha=(decoded.nb_channels > 3 || decoded.nb_channels == 2);
+    buffer_format format {.layout = PIXELS_RGBA, .bytes_per_sample = 1, .premultiplied = false, .stride = 0};
+    if (alpha) {
+        // blend the frames on top of a checkerboard pattern
+        SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_BLEND);
+        background = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STATIC, w, h);
+        if (!background) {
+            SDL_Log("SDL_CreateTexture() failed: %s", SDL_GetError());
+            return 1;
+        }
+        std::vector<Uint8> checkerboard((size_t)w*h*4, 255);
+        for (i = 0; i < h; i++)
+            for (int j = 0; j < w; j++) {
+                Uint8 *p = &checkerboard[((size_t)i*w+j)*4];
+                p[0] = p[1] = p[2] = ( (i/10 + j/10)&1 ? 0x60 : 0xA0 );
+            }
+        SDL_UpdateTexture(background, NULL, checkerboard.data(), w*4);
+    }
+    if (den == 0 || frames < 2) den = 2; // update twice per second if it's not an animation
     while (1) {
         while (SDL_PollEvent(&event) && !quit) {
             if (event.type == SDL_QUIT)
@@ -142,44 +167,29 @@ int main(int argc, char *argv[]) {
             continue;
         }
         t0 = SDL_GetTicks();
-        SDL_LockSurface(surface);
-        sp = (char*) surface->pixels;
-        if (alpha)
-        for (i = 0; i < h; i++) {
-            for (int j = 0; j < w; j++) {
-                int a = decoded.channel[3].value(i+h*cf,j);
-                int b = ( (i/10 + j/10)&1 ? 0x60 : 0xA0 ); // checkerboard pattern
-                sp[4*j+0] = (decoded.channel[0].value(i+h*cf,j) * a + b * (255-a))>>8;
-                sp[4*j+1] = (decoded.channel[1].value(i+h*cf,j) * a + b * (255-a))>>8;
-                sp[4*j+2] = (decoded.channel[2].value(i+h*cf,j) * a + b * (255-a))>>8;
-                sp[4*j+3] = 255;
-            }
-            sp += surface->pitch;
+        if (frame_decoder.indexed() && cf != decoded_frame) {
+            if (!frame_decoder.decode_frame(cf, decoded)) break;
+            decoded_frame = cf;
         }
-        else
-        for (i = 0; i < h; i++) {
-            for (int j = 0; j < w; j++) {
-                sp[4*j+0] = decoded.channel[0].value(i+h*cf,j);
-                sp[4*j+1] = decoded.channel[1].value(i+h*cf,j);
-                sp[4*j+2] = decoded.channel[2].value(i+h*cf,j);
-                sp[4*j+3] = 255;
-            }
-            sp += surface->pitch;
+        if (SDL_LockTexture(texture, NULL, &pixels, &pitch) == 0) {
+            format.stride = pitch;
+            if (!write_buffer(decoded, frame_decoder.indexed() ? 0 : cf, (uint8_t*) pixels, format)) quit = 1;
+            SDL_UnlockTexture(texture);
         }
-        SDL_UnlockSurface(surface);
-        texture = SDL_CreateTextureFromSurface(renderer, surface);
+        SDL_RenderClear(renderer);
+        if (background) SDL_RenderCopy(renderer, background, NULL, NULL);
         SDL_RenderCopy(renderer, texture, NULL, NULL);
-        SDL_DestroyTexture(texture);
         SDL_RenderPresent(renderer);
         t1 = SDL_GetTicks();
         delta = t1 - t0;
-        delay = (decoded.num.size() ? decoded.num[cf] : 1) * 1000 / decoded.den;
+        delay = (info.num.size() ? info.num[cf] : 1) * 1000 / den;
         delay = delay > delta ? delay - delta : 1;
         SDL_Delay(delay);
         cf++;
         if (cf >= frames) cf = 0;
     }
-    SDL_FreeSurface(surface);
+    SDL_DestroyTexture(texture);
+    if (background) SDL_DestroyTexture(background);
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
     SDL_Quit();
@@ -91,29 +91,124 @@ void Channel::actual_minmax(pixel_type *min, pixel_type *max) const {
     *max = realmax;
 }
 
-void Image::undo_transforms(int keep) {
+// undoes the transforms (except the first 'keep'), without the final clamping
+// (then the channels are allocated, unless the next transform deals with missing channel data itself)
+static bool undo_transform_steps(Image &image, int keep, bool allocate=true) {
+    std::vector<Transform> &transform = image.transform;
     while ( transform.size() > keep ) {
             Transform t = transform.back();
             v_printf(4,"Undoing transform %s\n",t.name());
-            bool result = t.apply(*this, true);
+            bool result = t.apply(image, true);
             if (result == false) {
                 e_printf("Error while undoing transform %s.\n",t.name());
-                error = true;
-                return;
+                image.error = true;
+                return false;
             }
             v_printf(8,"Undoing transform %s: done\n",t.name());
             transform.pop_back();
     }
+    if (allocate) for (int i=0; i<image.channel.size(); i++) image.channel[i].allocate();
+    return true;
+}
+
+void Image::undo_transforms(int keep) {
+    if (!undo_transform_steps(*this, keep)) return;
     if (!keep) { // clamp the values to the valid range (lossy compression can produce values outside the range)
         for (int i=0; i<channel.size(); i++) {
-            for (int j=0; j<channel[i].data.size(); j++) {
-                channel[i].data[j] = CLAMP(channel[i].data[j], minval, maxval);
-            }
+            pixel_type *data = channel[i].data.data();
+            parallel_for(0, channel[i].data.size(), 1<<16, [&](int j0, int j1) {
+                for (int j=j0; j<j1; j++) data[j] = CLAMP(data[j], minval, maxval);
+            });
         }
     }
 //    recompute_minmax();
 }
 
+// lets the squeeze or DCT that was set up by prepare_rows() produce the rows its channels need for the first 'rows' rows of the image
+// (the channels are independent, so they are done in parallel)
+static void fill_rows(Image &image, int rows) {
+    if (!image.row_sources.size()) return;
+    parallel_for(0, image.row_sources.size(), 1, [&](int c0, int c1) {
+        for (int c=c0; c<c1; c++) {
+            if (!image.row_sources[c]) continue;
+            if (c < image.subsampled.size() && image.subsampled[c].w) {
+                // upsampling row y needs rows up to y/2+1 (see upsample_row)
+                Channel &in = image.subsampled[c];
+                int srv = image.channel[c].h / std::max(in.h, 1);
+                image.row_sources[c](in, std::min(in.h, (rows-1)/std::max(srv, 1) + 2));
+            } else image.row_sources[c](image.channel[c], std::min(image.channel[c].h, rows));
+        }
+    });
+}
+
+bool Image::prepare_rows() {
+    int keep = 0;
+    if (transform.size() > keep && transform[keep].has_row_inverse() && transform[keep].ID != TRANSFORM_ChromaSubsample) keep++;
+    if (transform.size() > keep && transform[keep].ID == TRANSFORM_ChromaSubsample) keep++;
+    // (but not a DCT with chroma upsampling after it: then the coefficients would still be there while the upsampled channels
+    // are allocated, which costs more memory than the separate pass)
+    bool source = (transform.size() > keep && transform[keep].has_row_source_inverse()
+                   && !(transform[keep].ID == TRANSFORM_DCT && keep && transform[keep-1].ID == TRANSFORM_ChromaSubsample));
+    if (!undo_transform_steps(*this, keep + source, !source)) return false;
+    if (source) {
+        v_printf(4,"Undoing transform %s (row by row)\n",transform.back().name());
+        // if that is not possible, it is undone as usual
+        if (transform.back().begin_row_inverse(*this)) {
+            transform.pop_back();
+            for (int i=0; i<channel.size(); i++) if (i >= row_sources.size() || !row_sources[i]) channel[i].allocate();
+        } else if (!undo_transform_steps(*this, keep)) return false;
+    }
+    // the upsampling is set up already, so the channels have their final dimensions
+    if (keep && transform.back().ID == TRANSFORM_ChromaSubsample && !transform.back().begin_row_inverse(*this)) {
+        fill_rows(*this, h);
+        row_sources.clear();
+        return undo_transform_steps(*this, 0);
+    }
+    return true;
+}
+
+bool Image::undo_rows(const std::function<void(int y)> &row) {
+    if (transform.size() > 2) return false;
+    const Transform *color = NULL, *upsample = NULL;
+    for (const Transform &t : transform) {
+        if (!t.has_row_inverse()) return false;
+        if (t.ID == TRANSFORM_ChromaSubsample) upsample = &t;
+        else color = &t;
+    }
+    for (const Transform *t : {upsample, color}) {
+        if (!t) continue;
+        if (t == upsample && subsampled.size()) continue; // already done by prepare_rows()
+        v_printf(4,"Undoing transform %s (row by row)\n",t->name());
+        if (!t->begin_row_inverse(*this)) {
+            e_printf("Error while undoing transform %s.\n",t->name());
+            error = true;
+            return false;
+        }
+    }
+    int rows = 0;
+    for (int i=0; i<channel.size(); i++) if (channel[i].h > rows) rows = channel[i].h;
+    int w = (channel.size() ? channel[0].w : 0);
+    for (int y0=0; y0<rows; y0 += band_rows(w)) {
+        int y1 = std::min(rows, y0 + band_rows(w));
+        fill_rows(*this, y1);
+        for (int y=y0; y<y1; y++) {
+            if (upsample) upsample->inverse_row(*this, y);
+            if (color) color->inverse_row(*this, y);
+            // clamp the values to the valid range (lossy compression can produce values outside the range)
+            for (int i=0; i<channel.size(); i++) {
+                if (y >= channel[i].h) continue;
+                pixel_type *p = &channel[i].data[(size_t)y*channel[i].w];
+                for (int x=0; x<channel[i].w; x++) p[x] = CLAMP(p[x], minval, maxval);
+            }
+            row(y);
+        }
+    }
+    transform.clear();
+    subsampled.clear();
+    row_sources.clear();
+    return true;
+}
+
 bool Image::do_transform(const Transform &tr) {
     Transform t = tr;
     bool did_it = t.apply(*this, false);
@@ -27,9 +27,11 @@ SOFTWARE.
 #include <stddef.h>
 #include <stdint.h>
 #include <vector>
+#include <functional>
 #include <assert.h>
 
 #include "../util.h"
+#include "parallel.h"
 #include <stdio.h>
 
 typedef int16_t pixel_type; // enough for up to 14-bit with YCoCg/Squeeze (I think); enough for up to 10-bit if DCT is added (I think)
@@ -77,6 +79,10 @@ public:
         w=nw; h=nh;
         resize();
     }
+    // channel data is allocated lazily when decoding; a channel without data is all zeroes
+    void allocate() {
+        if (data.size() < (size_t)w*h) resize();
+    }
 
     pixel_type value_nocheck(int r, int c) const { return data[r*w+c]; }
     pixel_type value(int r, int c) const { if (r*w+c >= data.size()) return zero;
@@ -113,19 +119,57 @@ public:
     std::vector<unsigned char> icc_profile; // icc profile blob
     int downscales[6]; //   LQIP, 1:16, 1:8, 1:4, 1:2, 1:1
     bool error; // true if a fatal error occurred, false otherwise
-
-    Image(int iw, int ih, int maxval, int nb_chans, int cm=0) :
-        channel(nb_chans,Channel(iw,ih,0,maxval)),
-        w(iw), h(ih), nb_frames(1), den(10), loops(0), minval(0), maxval(maxval), nb_channels(nb_chans), real_nb_channels(nb_chans), nb_meta_channels(0), colormodel(cm), error(false) {
-        for (int i=0; i<nb_chans; i++) channel[i].component=i;
+    bool reduced_scale; // a preview was requested: undoing the transforms may produce the channels at a reduced scale (see inv_DCT)
+    std::vector<Channel> subsampled; // between prepare_rows() and undo_rows(): chroma channels at their original size (empty if not upsampled)
+    // between prepare_rows() and undo_rows(): for the channels that a squeeze or DCT produces on demand, a function that fills
+    // the first n rows of the channel (or of its subsampled version, if it still has to be upsampled)
+    std::vector<std::function<void(Channel &out, int n)>> row_sources;
+
+    // if allocate is false, the channels get their dimensions but no data (see Channel::allocate)
+    Image(int iw, int ih, int maxval, int nb_chans, int cm=0, bool allocate=true) :
+        channel(nb_chans,Channel(allocate ? iw : 0, allocate ? ih : 0, 0, maxval)),
+        w(iw), h(ih), nb_frames(1), den(10), loops(0), minval(0), maxval(maxval), nb_channels(nb_chans), real_nb_channels(nb_chans), nb_meta_channels(0), colormodel(cm), error(false), reduced_scale(false) {
+        for (int i=0; i<nb_chans; i++) { channel[i].component=i; channel[i].w=iw; channel[i].h=ih; }
         for (int i=0; i<6; i++) downscales[i] = nb_chans-1;
     }
 
-    Image() : w(0), h(0), nb_frames(1), den(10), loops(0), minval(0), maxval(255), nb_channels(0), real_nb_channels(0), nb_meta_channels(0), colormodel(0), error(true) { }
+    Image() : w(0), h(0), nb_frames(1), den(10), loops(0), minval(0), maxval(255), nb_channels(0), real_nb_channels(0), nb_meta_channels(0), colormodel(0), error(true), reduced_scale(false) { }
     bool do_transform(const Transform &t);
     void undo_transforms(int keep=0); // undo all except the first 'keep' transforms
+    // the same as undo_transforms(), in two steps: prepare_rows() undoes everything except a final color transform, the chroma
+    // upsampling before it and the squeeze or DCT before those (only the last two steps of every channel, for a squeeze), then
+    // undo_rows() does those and the clamping in bands of rows, calling 'row' as soon as a row is final
+    // (in between, the channels have their final dimensions; writers use this to output each row while it is still in cache)
+    bool prepare_rows();
+    bool undo_rows(const std::function<void(int y)> &row);
     void recompute_minmax() { for (int i=0; i<channel.size(); i++) channel[i].actual_minmax(&channel[i].minval, &channel[i].maxval); }
     void recompute_downscales();
 };
 
+// caller-owned buffers with interleaved samples (see import/read_buffer.h and export/write_buffer.h)
+enum buffer_layout {
+    PIXELS_G,       // gray
+    PIXELS_GA,      // gray, alpha
+    PIXELS_RGB,
+    PIXELS_RGBA,
+    PIXELS_BGR,
+    PIXELS_BGRA
+};
+
+struct buffer_format {
+    buffer_layout layout;
+    int bytes_per_sample;       // 1: 8-bit, 2: 16-bit (in native byte order)
+    bool premultiplied;         // the color samples are multiplied by alpha
+    size_t stride;              // bytes from one row to the next (0: rows are packed)
+};
+
+inline int buffer_layout_channels(buffer_layout layout) {
+    switch (layout) {
+        case PIXELS_G: return 1;
+        case PIXELS_GA: return 2;
+        case PIXELS_RGB: case PIXELS_BGR: return 3;
+        default: return 4;
+    }
+}
+
 #include "../transform/transform.h"
\ No newline at end of file
@@ -0,0 +1,135 @@
+/*//////////////////////////////////////////////////////////////////////////////////////////////////////
+
+Copyright 2019, Jon Sneyers, Cloudinary (jon@cloudinary.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////*/
+
+
+#include "parallel.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace {
+
+class thread_pool {
+public:
+    ~thread_pool() { stop(); }
+
+    void run(int begin, int end, int grain, const std::function<void(int,int)> &f, int nb_threads) {
+        if (workers.size() != nb_threads-1) {
+            stop();
+            for (int i=1; i<nb_threads; i++) workers.emplace_back([this]() { work(); });
+        }
+        {
+            std::lock_guard<std::mutex> lock(m);
+            job = &f;
+            job_end = end;
+            job_grain = grain;
+            next = begin;
+            generation++;
+        }
+        wake.notify_all();
+        claim(f, end, grain);
+        std::unique_lock<std::mutex> lock(m);
+        // all ranges have been claimed now; wait until the workers are done with theirs
+        done.wait(lock, [this]() { return !active; });
+        job = NULL;
+    }
+
+private:
+    std::vector<std::thread> workers;
+    std::mutex m;
+    std::condition_variable wake, done;
+    const std::function<void(int,int)> *job = NULL;
+    int job_end = 0, job_grain = 1;
+    std::atomic<int> next {0};
+    unsigned generation = 0;
+    int active = 0;
+    bool quit = false;
+
+    void claim(const std::function<void(int,int)> &f, int end, int grain) {
+        int b;
+        while ((b = next.fetch_add(grain)) < end) f(b, std::min(b+grain, end));
+    }
+
+    void work() {
+        unsigned seen = 0;
+        std::unique_lock<std::mutex> lock(m);
+        while (true) {
+            wake.wait(lock, [&]() { return quit || generation != seen; });
+            if (quit) return;
+            seen = generation;
+            if (!job) continue; // woke up too late, the job is finished already
+            const std::function<void(int,int)> &f = *job;
+            int end = job_end, grain = job_grain;
+            active++;
+            lock.unlock();
+            claim(f, end, grain);
+            lock.lock();
+            if (!--active) done.notify_all();
+        }
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(m);
+            quit = true;
+        }
+        wake.notify_all();
+        for (std::thread &t : workers) t.join();
+        workers.clear();
+        quit = false;
+    }
+};
+
+std::atomic<int> nb_threads_setting {0};
+std::atomic<bool> pool_busy {false};
+thread_local bool in_parallel_for = false;
+
+}
+
+void set_nb_threads(int n) { nb_threads_setting = std::max(n, 0); }
+
+int get_nb_threads() {
+    int n = nb_threads_setting;
+    if (!n) n = std::thread::hardware_concurrency();
+    return std::max(n, 1);
+}
+
+void parallel_for(int begin, int end, int grain, const std::function<void(int,int)> &f) {
+    if (begin >= end) return;
+    grain = std::max(grain, 1);
+    int nb_threads = get_nb_threads();
+    // threads are only started when they can help: once a process has more than one thread, stdio locks on every call
+    if (nb_threads < 2 || end - begin <= grain || in_parallel_for || pool_busy.exchange(true)) {
+        f(begin, end);
+        return;
+    }
+    static thread_pool pool;
+    in_parallel_for = true;
+    pool.run(begin, end, grain, f, nb_threads);
+    in_parallel_for = false;
+    pool_busy = false;
+}
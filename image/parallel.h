@@ -0,0 +1,43 @@
+/*//////////////////////////////////////////////////////////////////////////////////////////////////////
+
+Copyright 2019, Jon Sneyers, Cloudinary (jon@cloudinary.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////*/
+
+
+#pragma once
+
+#include <algorithm>
+#include <functional>
+
+// A small pool of worker threads, shared by everything that splits its work in bands of rows (or blocks).
+// The number of threads is a process-wide setting: 0 means one per hardware thread (the default), 1 means everything runs
+// in the calling thread (and no threads are started at all).
+void set_nb_threads(int n);
+int get_nb_threads();
+
+// calls f(b,e) for consecutive ranges [b,e) of at most 'grain' elements that together cover [begin,end);
+// the ranges are handed out one at a time to whichever thread is free (the calling thread helps too), so uneven bands balance out.
+// Nested calls (and calls while another thread uses the pool) just run f(begin,end) in the calling thread.
+void parallel_for(int begin, int end, int grain, const std::function<void(int,int)> &f);
+
+// a band size for per-row work on rows of w samples (about 64K samples per band)
+inline int band_rows(int w) { return std::max(1, (1<<16) / std::max(w,1)); }
@@ -0,0 +1,149 @@
+/*//////////////////////////////////////////////////////////////////////////////////////////////////////
+
+Copyright 2019, Jon Sneyers, Cloudinary (jon@cloudinary.com)
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////*/
+
+
+#pragma once
+#include "../image/image.h"
+#include "../config.h"
+
+// reads an image from a caller-owned buffer with interleaved samples (see buffer_format), e.g. pixels that are already decoded in memory
+// the samples are deinterleaved into the channels in a single pass, which also computes the actual range of each channel
+// (so the ranges are tight without a call to Image::recompute_minmax) and notices when an alpha channel is trivial
+
+// one row: nc input samples per pixel, to the destination rows dst[0..nc-1]
+// the loop has no per-pixel branches, so the compiler can vectorize it
+template <typename T, int nc>
+static void deinterleave_row(const T *in, pixel_type * const *dst, int w, int *mins, int *maxs) {
+    for (int k = 0; k < nc; k++) {
+        int lo = mins[k], hi = maxs[k];
+        pixel_type *out = dst[k];
+        for (int x = 0; x < w; x++) {
+            int v = in[x*nc+k];
+            out[x] = v;
+            lo = (v < lo ? v : lo);
+            hi = (v > hi ? v : hi);
+        }
+        mins[k] = lo; maxs[k] = hi;
+    }
+}
+
+template <typename T>
+static void deinterleave_row(const T *in, int nc, pixel_type * const *dst, int w, int *mins, int *maxs) {
+    switch (nc) {
+        case 1: deinterleave_row<T,1>(in, dst, w, mins, maxs); break;
+        case 2: deinterleave_row<T,2>(in, dst, w, mins, maxs); break;
+        case 3: deinterleave_row<T,3>(in, dst, w, mins, maxs); break;
+        default: deinterleave_row<T,4>(in, dst, w, mins, maxs); break;
+    }
+}
+
+// 16-bit samples in the other byte order are swapped in place (a simple loop that the compiler turns into vector shuffles)
+static void swap_bytes_16(uint16_t *p, size_t n) {
+    for (size_t i = 0; i < n; i++) p[i] = (uint16_t)((p[i] >> 8) | (p[i] << 8));
+}
+
+static inline void big_endian_to_native_16(uint16_t *p, size_t n) {
+#if !defined(__BYTE_ORDER__) || __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    swap_bytes_16(p, n);
+#endif
+}
+
+static inline void little_endian_to_native_16(uint16_t *p, size_t n) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    swap_bytes_16(p, n);
+#endif
+}
+
+// for the file importers: reads 'rows' rows of row_bytes bytes each from fp, in chunks of about 1 MB, and calls row(y, data) for
+// every complete row; returns the number of rows that were read (less than 'rows' if the file is truncated)
+template <typename F>
+static int read_file_rows(FILE *fp, size_t row_bytes, int rows, F row) {
+    if (!row_bytes) return rows;
+    int band = std::max<size_t>(1, ((size_t)1 << 20) / row_bytes);
+    std::vector<uint8_t> buffer((size_t)std::min(band, rows) * row_bytes);
+    for (int y0 = 0; y0 < rows; y0 += band) {
+        int n = std::min(band, rows - y0);
+        int complete = fread(buffer.data(), 1, (size_t)n * row_bytes, fp) / row_bytes;
+        for (int i = 0; i < complete; i++) row(y0 + i, buffer.data() + (size_t)i * row_bytes);
+        if (complete < n) return y0 + complete;
+    }
+    return rows;
+}
+
+// premultiplied color samples are converted back to straight alpha (in place, in the channels)
+static void unpremultiply_row(pixel_type * const *dst, int ncolor, const pixel_type *alpha, int w, int maxval) {
+    for (int k = 0; k < ncolor; k++) {
+        for (int x = 0; x < w; x++) {
+            int a = alpha[x];
+            int v = (a ? ((int64_t)dst[k][x] * maxval + a/2) / a : 0);
+            dst[k][x] = (v > maxval ? maxval : v);
+        }
+    }
+}
+
+// if drop_trivial_alpha is true, an alpha channel that is completely opaque is not kept
+Image read_buffer(const uint8_t *buffer, int w, int h, const buffer_format &format, bool drop_trivial_alpha = true) {
+    if (w < 1 || h < 1 || (format.bytes_per_sample != 1 && format.bytes_per_sample != 2)) {
+        e_printf("Invalid buffer dimensions or sample size.\n");
+        return Image();
+    }
+    int nc = buffer_layout_channels(format.layout);
+    size_t stride = format.stride;
+    if (!stride) stride = (size_t)w * nc * format.bytes_per_sample;
+    if (stride < (size_t)w * nc * format.bytes_per_sample) {
+        e_printf("Buffer stride is too small.\n");
+        return Image();
+    }
+    int maxval = (format.bytes_per_sample == 2 ? 65535 : 255);
+    Image image(w, h, maxval, nc);
+
+    pixel_type *dst[4];
+    int mins[4], maxs[4];
+    for (int k = 0; k < nc; k++) { mins[k] = maxval; maxs[k] = 0; }
+    bool has_alpha = (nc == 2 || nc == 4);
+    bool bgr = (format.layout == PIXELS_BGR || format.layout == PIXELS_BGRA);
+    for (int y = 0; y < h; y++) {
+        for (int k = 0; k < nc; k++) dst[k] = &image.channel[k].data[(size_t)y * w];
+        if (bgr) std::swap(dst[0], dst[2]);
+        const uint8_t *in = buffer + (size_t)y * stride;
+        if (format.bytes_per_sample == 1) deinterleave_row(in, nc, dst, w, mins, maxs);
+        else deinterleave_row((const uint16_t *)in, nc, dst, w, mins, maxs);
+        if (format.premultiplied && has_alpha) unpremultiply_row(dst, nc-1, dst[nc-1], w, maxval);
+    }
+    if (bgr) { std::swap(mins[0], mins[2]); std::swap(maxs[0], maxs[2]); }
+    // unpremultiplying can change the color ranges
+    if (format.premultiplied && has_alpha) for (int k = 0; k < nc-1; k++) image.channel[k].actual_minmax(&image.channel[k].minval, &image.channel[k].maxval);
+    else for (int k = 0; k < nc-1; k++) { image.channel[k].minval = mins[k]; image.channel[k].maxval = maxs[k]; }
+    image.channel[nc-1].minval = mins[nc-1];
+    image.channel[nc-1].maxval = maxs[nc-1];
+
+    if (drop_trivial_alpha && has_alpha && mins[nc-1] == maxval) {
+        v_printf(3,"Dropping trivial alpha channel\n");
+        image.channel.pop_back();
+        image.nb_channels--;
+        image.real_nb_channels--;
+    }
+    for (int k = 0; k < image.channel.size(); k++) image.channel[k].setzero();
+    return image;
+}
@@ -24,6 +24,7 @@ SOFTWARE.
 
 #pragma once
 #include "../image/image.h"
+#include "read_buffer.h"
 
 // gif decoder from https://github.com/lecram/gifdec
 
@@ -43,8 +44,16 @@ typedef struct gd_GCE {
     int transparency;
 } gd_GCE;
 
+// the whole file, mapped into memory (or read into a buffer if it cannot be mapped)
+typedef struct gd_File {
+    const uint8_t *data;
+    size_t size;
+    off_t pos;
+    bool mapped;
+} gd_File;
+
 typedef struct gd_GIF {
-    int fd;
+    gd_File file;
     off_t anim_start;
     uint16_t width, height;
     uint16_t depth;
@@ -102,12 +111,10 @@ Image read_GIF_file(const char *filename) {
 //        printf("Frame %i: ret=%i, delay=%i\n",f,ret,gif->gce.delay);
 
         for (int y=0; y<h; y++) {
-            for (int x=0; x<w; x++) {
-                image.channel[0].value(y+h*f,x) = frame[y*4*w+x*4];
-                image.channel[1].value(y+h*f,x) = frame[y*4*w+x*4+1];
-                image.channel[2].value(y+h*f,x) = frame[y*4*w+x*4+2];
-                image.channel[3].value(y+h*f,x) = frame[y*4*w+x*4+3];
-            }
+            pixel_type *dst[4];
+            int mins[4] = {255,255,255,255}, maxs[4] = {0,0,0,0};
+            for (int c=0; c<4; c++) dst[c] = &image.channel[c].data[(size_t)(y+h*f)*w];
+            deinterleave_row<uint8_t,4>(&frame[(size_t)y*4*w], dst, w, mins, maxs);
         }
         f++;
     }
@@ -128,6 +135,7 @@ Image read_GIF_file(const char *filename) {
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/mman.h>
 
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wunused-result"
@@ -144,44 +152,108 @@ typedef struct Table {
     Entry *entries;
 } Table;
 
+static bool
+gd_map_file(const char *fname, gd_File *file)
+{
+    struct stat st;
+    int fd = open(fname, O_RDONLY);
+    if (fd == -1) return false;
+    file->pos = 0;
+    file->mapped = false;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            file->data = (const uint8_t *) map;
+            file->size = st.st_size;
+            file->mapped = true;
+            close(fd);
+            return true;
+        }
+    }
+    /* Not a regular file (or mmap failed): read all of it. */
+    size_t size = 0, capacity = 1 << 16;
+    uint8_t *data = (uint8_t *) malloc(capacity);
+    ssize_t n;
+    while (data && (n = read(fd, data + size, capacity - size)) > 0) {
+        size += n;
+        if (size == capacity) {
+            uint8_t *bigger = (uint8_t *) realloc(data, capacity *= 2);
+            if (!bigger) free(data);
+            data = bigger;
+        }
+    }
+    close(fd);
+    if (!data) return false;
+    file->data = data;
+    file->size = size;
+    return true;
+}
+
+static void
+gd_unmap_file(gd_File *file)
+{
+    if (file->mapped) munmap((void *) file->data, file->size);
+    else free((void *) file->data);
+}
+
+/* Like read() and lseek() on the mapped file; reading past the end gives zeroes. */
+static inline void
+gd_read(gd_File *file, void *buf, size_t n)
+{
+    size_t avail = (file->pos < (off_t) file->size ? file->size - file->pos : 0);
+    if (n <= avail) memcpy(buf, file->data + file->pos, n);
+    else {
+        memcpy(buf, file->data + file->pos, avail);
+        memset((uint8_t *) buf + avail, 0, n - avail);
+    }
+    file->pos += n;
+}
+
+static inline off_t
+gd_seek(gd_File *file, off_t offset, int whence)
+{
+    if (whence == SEEK_SET) file->pos = offset;
+    else file->pos += offset;
+    return file->pos;
+}
+
 static uint16_t
-read_num(int fd)
+read_num(gd_File *file)
 {
     uint8_t bytes[2];
 
-    read(fd, bytes, 2);
+    gd_read(file, bytes, 2);
     return bytes[0] + (((uint16_t) bytes[1]) << 8);
 }
 
 gd_GIF *
 gd_open_gif(const char *fname)
 {
-    int fd;
+    gd_File file;
     uint8_t sigver[3];
     uint16_t width, height, depth;
     uint8_t fdsz, bgidx, aspect;
     int gct_sz;
-    gd_GIF *gif;
+    gd_GIF *gif = NULL;
 
-    fd = open(fname, O_RDONLY);
-    if (fd == -1) return NULL;
+    if (!gd_map_file(fname, &file)) return NULL;
     /* Header */
-    read(fd, sigver, 3);
+    gd_read(&file, sigver, 3);
     if (memcmp(sigver, "GIF", 3) != 0) {
 //        fprintf(stderr, "invalid signature\n");
         goto fail;
     }
     /* Version */
-    read(fd, sigver, 3);
+    gd_read(&file, sigver, 3);
     if (memcmp(sigver, "89a", 3) != 0) {
         fprintf(stderr, "invalid GIF version\n");
         goto fail;
     }
     /* Width x Height */
-    width  = read_num(fd);
-    height = read_num(fd);
+    width  = read_num(&file);
+    height = read_num(&file);
     /* FDSZ */
-    read(fd, &fdsz, 1);
+    gd_read(&file, &fdsz, 1);
     /* Presence of GCT */
     if (!(fdsz & 0x80)) {
         fprintf(stderr, "no global color table\n");
@@ -193,29 +265,29 @@ gd_open_gif(const char *fname)
     /* GCT Size */
     gct_sz = 1 << ((fdsz & 0x07) + 1);
     /* Background Color Index */
-    read(fd, &bgidx, 1);
+    gd_read(&file, &bgidx, 1);
     /* Aspect Ratio */
-    read(fd, &aspect, 1);
+    gd_read(&file, &aspect, 1);
     /* Create gd_GIF Structure. */
     gif = (gd_GIF*) calloc(1, sizeof(*gif) + 5 * width * height);
     if (!gif) goto fail;
-    gif->fd = fd;
+    gif->file = file;
     gif->width  = width;
     gif->height = height;
     gif->depth  = depth;
     /* Read GCT */
     gif->gct.size = gct_sz;
-    read(fd, gif->gct.colors, 3 * gif->gct.size);
+    gd_read(&gif->file, gif->gct.colors, 3 * gif->gct.size);
     gif->palette = &gif->gct;
     gif->bgindex = bgidx;
     gif->canvas = (uint8_t *) &gif[1];
     gif->frame = &gif->canvas[4 * width * height];
     if (gif->bgindex)
         memset(gif->frame, gif->bgindex, gif->width * gif->height);
-    gif->anim_start = lseek(fd, 0, SEEK_CUR);
+    gif->anim_start = gif->file.pos;
     goto ok;
 fail:
-    close(fd);
+    gd_unmap_file(&file);
 ok:
     return gif;
 }
@@ -226,8 +298,8 @@ discard_sub_blocks(gd_GIF *gif)
     uint8_t size;
 
     do {
-        read(gif->fd, &size, 1);
-        lseek(gif->fd, size, SEEK_CUR);
+        gd_read(&gif->file, &size, 1);
+        gd_seek(&gif->file, size, SEEK_CUR);
     } while (size);
 }
 
@@ -238,21 +310,21 @@ read_plain_text_ext(gd_GIF *gif)
         uint16_t tx, ty, tw, th;
         uint8_t cw, ch, fg, bg;
         off_t sub_block;
-        lseek(gif->fd, 1, SEEK_CUR); /* block size = 12 */
-        tx = read_num(gif->fd);
-        ty = read_num(gif->fd);
-        tw = read_num(gif->fd);
-        th = read_num(gif->fd);
-        read(gif->fd, &cw, 1);
-        read(gif->fd, &ch, 1);
-        read(gif->fd, &fg, 1);
-        read(gif->fd, &bg, 1);
-        sub_block = lseek(gif->fd, 0, SEEK_CUR);
+        gd_seek(&gif->file, 1, SEEK_CUR); /* block size = 12 */
+        tx = read_num(&gif->file);
+        ty = read_num(&gif->file);
+        tw = read_num(&gif->file);
+        th = read_num(&gif->file);
+        gd_read(&gif->file, &cw, 1);
+        gd_read(&gif->file, &ch, 1);
+        gd_read(&gif->file, &fg, 1);
+        gd_read(&gif->file, &bg, 1);
+        sub_block = gd_seek(&gif->file, 0, SEEK_CUR);
         gif->plain_text(gif, tx, ty, tw, th, cw, ch, fg, bg);
-        lseek(gif->fd, sub_block, SEEK_SET);
+        gd_seek(&gif->file, sub_block, SEEK_SET);
     } else {
         /* Discard plain text metadata. */
-        lseek(gif->fd, 13, SEEK_CUR);
+        gd_seek(&gif->file, 13, SEEK_CUR);
     }
     /* Discard plain text sub-blocks. */
     discard_sub_blocks(gif);
@@ -264,24 +336,24 @@ read_graphic_control_ext(gd_GIF *gif)
     uint8_t rdit;
 
     /* Discard block size (always 0x04). */
-    lseek(gif->fd, 1, SEEK_CUR);
-    read(gif->fd, &rdit, 1);
+    gd_seek(&gif->file, 1, SEEK_CUR);
+    gd_read(&gif->file, &rdit, 1);
     gif->gce.disposal = (rdit >> 2) & 3;
     gif->gce.input = rdit & 2;
     gif->gce.transparency = rdit & 1;
-    gif->gce.delay = read_num(gif->fd);
-    read(gif->fd, &gif->gce.tindex, 1);
+    gif->gce.delay = read_num(&gif->file);
+    gd_read(&gif->file, &gif->gce.tindex, 1);
     /* Skip block terminator. */
-    lseek(gif->fd, 1, SEEK_CUR);
+    gd_seek(&gif->file, 1, SEEK_CUR);
 }
 
 static void
 read_comment_ext(gd_GIF *gif)
 {
     if (gif->comment) {
-        off_t sub_block = lseek(gif->fd, 0, SEEK_CUR);
+        off_t sub_block = gd_seek(&gif->file, 0, SEEK_CUR);
         gif->comment(gif);
-        lseek(gif->fd, sub_block, SEEK_SET);
+        gd_seek(&gif->file, sub_block, SEEK_SET);
     }
     /* Discard comment sub-blocks. */
     discard_sub_blocks(gif);
@@ -294,21 +366,21 @@ read_application_ext(gd_GIF *gif)
     char app_auth_code[3];
 
     /* Discard block size (always 0x0B). */
-    lseek(gif->fd, 1, SEEK_CUR);
+    gd_seek(&gif->file, 1, SEEK_CUR);
     /* Application Identifier. */
-    read(gif->fd, app_id, 8);
+    gd_read(&gif->file, app_id, 8);
     /* Application Authentication Code. */
-    read(gif->fd, app_auth_code, 3);
+    gd_read(&gif->file, app_auth_code, 3);
     if (!strncmp(app_id, "NETSCAPE", sizeof(app_id))) {
         /* Discard block size (0x03) and constant byte (0x01). */
-        lseek(gif->fd, 2, SEEK_CUR);
-        gif->loop_count = read_num(gif->fd);
+        gd_seek(&gif->file, 2, SEEK_CUR);
+        gif->loop_count = read_num(&gif->file);
         /* Skip block terminator. */
-        lseek(gif->fd, 1, SEEK_CUR);
+        gd_seek(&gif->file, 1, SEEK_CUR);
     } else if (gif->application) {
-        off_t sub_block = lseek(gif->fd, 0, SEEK_CUR);
+        off_t sub_block = gd_seek(&gif->file, 0, SEEK_CUR);
         gif->application(gif, app_id, app_auth_code);
-        lseek(gif->fd, sub_block, SEEK_SET);
+        gd_seek(&gif->file, sub_block, SEEK_SET);
         discard_sub_blocks(gif);
     } else {
         discard_sub_blocks(gif);
@@ -320,7 +392,7 @@ read_ext(gd_GIF *gif)
 {
     uint8_t label;
 
-    read(gif->fd, &label, 1);
+    gd_read(&gif->file, &label, 1);
     switch (label) {
     case 0x01:
         read_plain_text_ext(gif);
@@ -391,8 +463,8 @@ get_key(gd_GIF *gif, int key_size, uint8_t *sub_len, uint8_t *shift, uint8_t *by
         if (rpad == 0) {
             /* Update byte. */
             if (*sub_len == 0)
-                read(gif->fd, sub_len, 1); /* Must be nonzero! */
-            read(gif->fd, byte, 1);
+                gd_read(&gif->file, sub_len, 1); /* Must be nonzero! */
+            gd_read(&gif->file, byte, 1);
             (*sub_len)--;
         }
         frag_size = MIN(key_size - bits_read, 8 - rpad);
@@ -418,12 +490,12 @@ read_image_data(gd_GIF *gif)
     Entry entry;
     off_t start, end;
 
-    read(gif->fd, &byte, 1);
+    gd_read(&gif->file, &byte, 1);
     key_size = (int) byte;
-    start = lseek(gif->fd, 0, SEEK_CUR);
+    start = gd_seek(&gif->file, 0, SEEK_CUR);
     discard_sub_blocks(gif);
-    end = lseek(gif->fd, 0, SEEK_CUR);
-    lseek(gif->fd, start, SEEK_SET);
+    end = gd_seek(&gif->file, 0, SEEK_CUR);
+    gd_seek(&gif->file, start, SEEK_SET);
     clear = 1 << key_size;
     stop = clear + 1;
     table = new_table(key_size);
@@ -468,8 +540,8 @@ read_image_data(gd_GIF *gif)
             table->entries[table->nentries - 1].suffix = entry.suffix;
     }
     free(table);
-    read(gif->fd, &sub_len, 1); /* Must be zero! */
-    lseek(gif->fd, end, SEEK_SET);
+    gd_read(&gif->file, &sub_len, 1); /* Must be zero! */
+    gd_seek(&gif->file, end, SEEK_SET);
     return 0;
 }
 
@@ -482,18 +554,18 @@ read_image(gd_GIF *gif)
     int interlace;
 
     /* Image Descriptor. */
-    gif->fx = read_num(gif->fd);
-    gif->fy = read_num(gif->fd);
-    gif->fw = read_num(gif->fd);
-    gif->fh = read_num(gif->fd);
-    read(gif->fd, &fisrz, 1);
+    gif->fx = read_num(&gif->file);
+    gif->fy = read_num(&gif->file);
+    gif->fw = read_num(&gif->file);
+    gif->fh = read_num(&gif->file);
+    gd_read(&gif->file, &fisrz, 1);
     interlace = fisrz & 0x40;
     /* Ignore Sort Flag. */
     /* Local Color Table? */
     if (fisrz & 0x80) {
         /* Read LCT */
         gif->lct.size = 1 << ((fisrz & 0x07) + 1);
-        read(gif->fd, gif->lct.colors, 3 * gif->lct.size);
+        gd_read(&gif->file, gif->lct.colors, 3 * gif->lct.size);
         gif->palette = &gif->lct;
     } else
         gif->palette = &gif->gct;
@@ -571,14 +643,14 @@ gd_get_frame(gd_GIF *gif)
     char sep;
 
     dispose(gif);
-    read(gif->fd, &sep, 1);
+    gd_read(&gif->file, &sep, 1);
     while (sep != ',') {
         if (sep == ';')
             return 0;
         if (sep == '!')
             read_ext(gif);
         else return -1;
-        read(gif->fd, &sep, 1);
+        gd_read(&gif->file, &sep, 1);
     }
     if (read_image(gif) == -1)
         return -1;
@@ -595,13 +667,13 @@ gd_render_frame(gd_GIF *gif, uint8_t *buffer)
 void
 gd_rewind(gd_GIF *gif)
 {
-    lseek(gif->fd, gif->anim_start, SEEK_SET);
+    gd_seek(&gif->file, gif->anim_start, SEEK_SET);
 }
 
 void
 gd_close_gif(gd_GIF *gif)
 {
-    close(gif->fd);
+    gd_unmap_file(&gif->file);
     free(gif);
 }
 
@@ -24,6 +24,7 @@ SOFTWARE.
 
 #pragma once
 #include "../image/image.h"
+#include "read_buffer.h"
 
 #define PPMREADBUFLEN 256
 
@@ -117,40 +118,33 @@ Image read_PAM_file(const char *filename) {
 
     v_printf(7,"Loading %ix%i PNM/PAM file with %i channels and maxval=%i\n",width,height,nbchans,maxval);
     Image image(width,height, maxval, nbchans);
+    // the samples are read in large chunks of rows, and deinterleaved (and byte-swapped) one row at a time
+    int rows_read;
     if (type==4) {
-      char byte=0;
-      for (unsigned int y=0; y<height; y++) {
-        for (unsigned int x=0; x<width; x++) {
-                if (x%8 == 0) byte = fgetc(fp);
-                image.channel[0].value(y,x) = (byte & (128>>(x%8)) ? 0 : 1);
-        }
-      }
+      pixel_type *out = image.channel[0].data.data();
+      rows_read = read_file_rows(fp, (width+7)/8, height, [&](int y, const uint8_t *in) {
+        for (unsigned int x=0; x<width; x++) out[(size_t)y*width+x] = (in[x>>3] & (128>>(x&7)) ? 0 : 1);
+      });
     } else {
-      if (maxval > 0xff) {
-        for (unsigned int y=0; y<height; y++) {
-          for (unsigned int x=0; x<width; x++) {
-            for (unsigned int c=0; c<nbchans; c++) {
-                pixel_type pixel= (fgetc(fp) << 8);
-                pixel += fgetc(fp);
-                if (pixel > (int)maxval) {
-                    fclose(fp);
-                    e_printf("Invalid PNM/PAM file: value %i is larger than declared maxval %u\n", pixel, maxval);
-                    return Image();
-                }
-                image.channel[c].value(y,x) = pixel;
-            }
-          }
-        }
-      } else {
-        for (unsigned int y=0; y<height; y++) {
-          for (unsigned int x=0; x<width; x++) {
-            for (unsigned int c=0; c<nbchans; c++) {
-                image.channel[c].value(y,x) = fgetc(fp);
-            }
-          }
-        }
+      bool deep = (maxval > 0xff);
+      int largest = 0;
+      rows_read = read_file_rows(fp, (size_t)width*nbchans*(deep?2:1), height, [&](int y, uint8_t *in) {
+        pixel_type *dst[4];
+        int mins[4], maxs[4];
+        for (unsigned int c=0; c<nbchans; c++) { dst[c] = &image.channel[c].data[(size_t)y*width]; mins[c] = 0xffff; maxs[c] = 0; }
+        if (deep) {
+          big_endian_to_native_16((uint16_t *)in, (size_t)width*nbchans);
+          deinterleave_row((const uint16_t *)in, nbchans, dst, width, mins, maxs);
+        } else deinterleave_row((const uint8_t *)in, nbchans, dst, width, mins, maxs);
+        for (unsigned int c=0; c<nbchans; c++) largest = std::max(largest, maxs[c]);
+      });
+      if (deep && largest > (int)maxval) {
+        fclose(fp);
+        e_printf("Invalid PNM/PAM file: value %i is larger than declared maxval %u\n", largest, maxval);
+        return Image();
       }
     }
+    if (rows_read < (int)height) e_printf("Warning: PNM/PAM file is truncated, only %i of %u rows could be read\n", rows_read, height);
     if (fp != stdin) fclose(fp);
     return image;
 }
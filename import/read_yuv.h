@@ -24,22 +24,35 @@ SOFTWARE.
 
 #pragma once
 #include "../image/image.h"
+#include "read_buffer.h"
 
 
+// reads one plane of w x h samples (little-endian if they take two bytes), in large chunks; returns false if the file is truncated
+static bool read_YUV_plane(FILE *fp, Channel &ch, int bytes_per_sample) {
+    int mins[1] = {0xffff}, maxs[1] = {0};
+    int rows = read_file_rows(fp, (size_t)ch.w*bytes_per_sample, ch.h, [&](int y, uint8_t *in) {
+        pixel_type *dst[1] = { &ch.data[(size_t)y*ch.w] };
+        if (bytes_per_sample == 2) {
+            little_endian_to_native_16((uint16_t *)in, ch.w);
+            deinterleave_row<uint16_t,1>((const uint16_t *)in, dst, ch.w, mins, maxs);
+        } else deinterleave_row<uint8_t,1>(in, dst, ch.w, mins, maxs);
+    });
+    return rows == ch.h;
+}
+
 Image read_YUV_file(const char *filename, int w, int h, int bitdepth) {
     FILE *fp = NULL;
     if (!strcmp(filename,"-")) fp = stdin;
     else fp = fopen(filename,"rb");
+    if (!fp) {
+        e_printf("Could not open file: %s\n", filename);
+        return Image();
+    }
 
     v_printf(7,"Loading %s as a %ix%i %i-bit YUV file\n",filename,w,h,bitdepth);
     Image image(w, h, (1<<bitdepth) -1, 3);
-    int shift = bitdepth-8;
-    for (int y=0; y<h; y++) {
-        for (int x=0; x<w; x++) {
-            image.channel[0].value(y,x) = fgetc(fp);
-            if (bitdepth > 8) { image.channel[0].value(y,x) += (fgetc(fp)<<8); }
-        }
-    }
+    int bytes_per_sample = (bitdepth > 8 ? 2 : 1);
+    bool complete = read_YUV_plane(fp, image.channel[0], bytes_per_sample);
 
     for (int c=1; c<3; c++) {
       image.channel[c].w = (w+1)/2;
@@ -47,13 +60,9 @@ Image read_YUV_file(const char *filename, int w, int h, int bitdepth) {
       image.channel[c].hshift = 1;
       image.channel[c].vshift = 1;
       image.channel[c].resize();
-      for (int y=0; y<(h+1)/2; y++) {
-        for (int x=0; x<(w+1)/2; x++) {
-            image.channel[c].value(y,x) = fgetc(fp);
-            if (bitdepth > 8) { image.channel[c].value(y,x) += (fgetc(fp)<<8); }
-        }
-      }
+      if (complete) complete = read_YUV_plane(fp, image.channel[c], bytes_per_sample);
     }
+    if (!complete) e_printf("Warning: YUV file is truncated\n");
     image.transform.push_back(Transform(TRANSFORM_YCbCr));
     Transform subsampling(TRANSFORM_ChromaSubsample);
     subsampling.parameters.push_back(0); // 4:2:0
@@ -243,7 +243,9 @@ public:
     int estimate_int(const Properties &properties, int min, int max, int val);
     void write_int(const Properties &properties, int nbits, int val);
     static void simplify(int divisor=CONTEXT_TREE_COUNT_DIV, int min_size=CONTEXT_TREE_MIN_SUBTREE_SIZE, int plane=0) {}
+    static uint64_t prune_decode_cost(double cost, bool fast_track, double property_cost=CONTEXT_TREE_PROPERTY_COST) { return 0; }
     static uint64_t compute_total_size() {return 0;}
+    static uint64_t estimate_total_size() {return 0;}
 #endif
 
 };
@@ -274,16 +276,20 @@ public:
     void write_tree(const Tree &tree);
 #endif
 
-    bool read_subtree(int pos, Ranges &subrange, Tree &tree, int &maxdepth, int depth) {
+    bool read_subtree(int pos, Ranges &subrange, Tree &tree, int &maxdepth, int depth, size_t max_nodes) {
         PropertyDecisionNode &n = tree[pos];
         int p = n.property = coder[0].read_int2(0,nb_properties)-1;
         depth++;
         if (depth>maxdepth) maxdepth=depth;
         if (p != -1) {
+            if (max_nodes && tree.size() + 2 > max_nodes) {
+              e_printf( "MANIAC tree has more than %u nodes. Aborting tree decoding.\n", (unsigned int) max_nodes);
+              return false;
+            }
             int oldmin = subrange[p].first;
             int oldmax = subrange[p].second;
             if (oldmin >= oldmax) {
-              e_printf( "Invalid tree. Aborting tree decoding.\n");
+              v_printf(3, "Invalid tree. Aborting tree decoding.\n"); // the caller reports corruption (or truncation)
               return false;
             }
 //            n.count = coder[1].read_int2(CONTEXT_TREE_MIN_COUNT, CONTEXT_TREE_MAX_COUNT);
@@ -295,23 +301,24 @@ public:
             tree.push_back(PropertyDecisionNode());
             // > splitval
             subrange[p].first = splitval+1;
-            if (!read_subtree(childID, subrange, tree, maxdepth, depth)) return false;
+            if (!read_subtree(childID, subrange, tree, maxdepth, depth, max_nodes)) return false;
 
             // <= splitval
             subrange[p].first = oldmin;
             subrange[p].second = splitval;
-            if (!read_subtree(childID+1, subrange, tree, maxdepth, depth)) return false;
+            if (!read_subtree(childID+1, subrange, tree, maxdepth, depth, max_nodes)) return false;
 
             subrange[p].second = oldmax;
         }
         return true;
     }
-    bool read_tree(Tree &tree) {
+    // max_nodes: limit on the tree size (0: no limit)
+    bool read_tree(Tree &tree, size_t max_nodes = 0) {
           Ranges rootrange(range);
           tree.clear();
           tree.push_back(PropertyDecisionNode());
           int depth=0;
-          if (read_subtree(0, rootrange, tree, depth, 0)) {
+          if (read_subtree(0, rootrange, tree, depth, 0, max_nodes)) {
             int neededdepth = maniac::util::ilog2(tree.size())+1;
             v_printf(8,"Read MANIAC tree with %u nodes and depth %i (with better balance, depth %i might have been enough).\n",(unsigned int) tree.size(),depth,neededdepth);
             return true;
@@ -252,6 +252,11 @@ private:
     Tree &inner_node;
     std::vector<bool> selection;
     int split_threshold;
+    // estimated gain (realSize units) and sample count of each inner node at the moment it was split
+    std::vector<uint64_t> split_gain;
+    std::vector<int32_t> split_count;
+    // size (realSize units) of the symbols that were coded in leafs before they got split
+    uint64_t discarded_size;
 
     inline PropertyVal div_down(int64_t sum, int32_t count) const {
         assert(count > 0);
@@ -336,12 +341,17 @@ private:
           uint32_t new_inner = inner_node.size();
           inner_node.push_back(inner_node[pos]);
           inner_node.push_back(inner_node[pos]);
+          split_gain.resize(inner_node.size(),0);
+          split_count.resize(inner_node.size(),0);
+          split_gain[pos] = result.realSize - result.virtSize[p];
+          split_count[pos] = result.count;
           inner_node[pos].splitval = splitval;
 //            fprintf(stdout,"Splitting on property %i, splitval=%i (count=%i)\n",p,inner_node[pos].splitval, (int)result.count);
           inner_node[pos].property = p;
 //          if (result.count < INT16_MAX) inner_node[pos].count = result.count;
 //          else inner_node[pos].count = INT16_MAX;
           uint32_t new_leaf = leaf_node.size();
+          discarded_size += result.realSize;
           result.resetCounters();
           leaf_node.push_back(CompoundSymbolChances<BitChance,bits>(result));
 //          uint32_t old_leaf = inner_node[pos].leafID;
@@ -393,7 +403,10 @@ public:
         leaf_node(1,CompoundSymbolChances<BitChance,bits>(nb_properties,zero_chance)),
         inner_node(treeIn),
         selection(nb_properties,false),
-        split_threshold(st) {
+        split_threshold(st),
+        split_gain(treeIn.size(),0),
+        split_count(treeIn.size(),0),
+        discarded_size(0) {
 
 /*        leaf_node[0].realChances.bitZero().set_12bit(zero_chance);
         for(unsigned int i=0; i<nb_properties; i++) {
@@ -501,6 +514,76 @@ public:
         v_printf(10,"MANIAC TREE BEFORE SIMPLIFICATION:\n");
         simplify_subtree(0, divisor, min_size, 0);
     }
+    // decode-cost-aware pruning: every symbol passing through an inner node costs the decoder a node visit,
+    // so a subtree is only kept if its estimated compression gain outweighs visit_cost per symbol per node.
+    // Pruned subtrees are merged into one of their leafs, so the tree stays valid for simplify().
+    // Returns the net benefit of keeping the subtree (0 if it was pruned).
+    int64_t prune_decode_cost_subtree(int pos, double visit_cost, int64_t &count, uint64_t &size, uint64_t &gain, uint64_t &penalty, int &removed) {
+        PropertyDecisionNode &n = inner_node[pos];
+        if (n.property == -1) {
+            count = leaf_node[n.childID].count;
+            size = leaf_node[n.childID].realSize;
+            gain = 0;
+            return 0;
+        }
+        int64_t count1, count2;
+        uint64_t size1, size2, gain1, gain2;
+        int64_t net = prune_decode_cost_subtree(n.childID, visit_cost, count1, size1, gain1, penalty, removed);
+        net += prune_decode_cost_subtree(n.childID+1, visit_cost, count2, size2, gain2, penalty, removed);
+        count = count1 + count2;
+        size = size1 + size2;
+        // the gain was measured on split_count symbols, extrapolate it to the symbols that actually went through this node
+        uint64_t own_gain = split_gain[pos];
+        if (split_count[pos] > 0 && count > split_count[pos]) own_gain = own_gain * count / split_count[pos];
+        gain = own_gain + gain1 + gain2;
+        net += (int64_t)own_gain - (int64_t)(visit_cost * count);
+        if (net > 0) return net;
+
+        int leaf = n.childID;
+        while (inner_node[leaf].property != -1) leaf = inner_node[leaf].childID;
+        leaf = inner_node[leaf].childID;
+        removed += count_inner_nodes(pos);
+        kill_children(n.childID);
+        n.property = -1;
+        n.childID = leaf;
+        leaf_node[leaf].count = count;
+        leaf_node[leaf].realSize = size + gain;
+        penalty += gain;
+        size += gain;
+        gain = 0;
+        return 0;
+    }
+    int count_inner_nodes(int pos) const {
+        const PropertyDecisionNode &n = inner_node[pos];
+        if (n.property == -1) return 0;
+        return 1 + count_inner_nodes(n.childID) + count_inner_nodes(n.childID+1);
+    }
+    // cost is expressed in bits per symbol per tree node visited;
+    // if fast_track is true, a single-leaf tree also saves the computation of all properties (roughly property_cost node visits each)
+    // returns the estimated size penalty in bits
+    uint64_t prune_decode_cost(double cost, bool fast_track, double property_cost=CONTEXT_TREE_PROPERTY_COST) {
+        if (cost <= 0) return 0;
+        int64_t count;
+        uint64_t size, gain, penalty = 0;
+        int removed = 0, total = count_inner_nodes(0);
+        double visit_cost = cost * 5461;
+        int64_t net = prune_decode_cost_subtree(0, visit_cost, count, size, gain, penalty, removed);
+        if (fast_track && net > 0 && net <= visit_cost * property_cost * nb_properties * count) {
+            // the whole tree does not pay for the property computation, collapse it
+            int leaf = 0;
+            while (inner_node[leaf].property != -1) leaf = inner_node[leaf].childID;
+            leaf = inner_node[leaf].childID;
+            removed += count_inner_nodes(0);
+            kill_children(inner_node[0].childID);
+            inner_node[0].property = -1;
+            inner_node[0].childID = leaf;
+            leaf_node[leaf].count = count;
+            leaf_node[leaf].realSize = size + gain;
+            penalty += gain;
+        }
+        v_printf(5,"Decode-cost pruning: removed %i of %i decision nodes, estimated penalty %llu bits\n", removed, total, (unsigned long long int)penalty/5461);
+        return penalty/5461;
+    }
     uint64_t compute_total_size_subtree(int pos) {
         PropertyDecisionNode &n = inner_node[pos];
         uint64_t total=0;
@@ -515,6 +598,10 @@ public:
     uint64_t compute_total_size() {
         return compute_total_size_subtree(0);
     }
+    // estimated number of bits needed for all symbols seen so far (must be called before simplify)
+    uint64_t estimate_total_size() {
+        return compute_total_size() + discarded_size/5461;
+    }
 };
 
 
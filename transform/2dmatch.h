@@ -24,9 +24,15 @@ SOFTWARE.
 
 #pragma once
 #include "../image/image.h"
+#include <string.h>
+#include <algorithm>
+#include <limits.h>
 
-// The forward step of this transformation is very slow and brute-force, which is why this transformation is
-// currently not enabled by default
+// The forward step looks for earlier occurrences of 8x8 blocks using rolling hashes of all blocks, and grows the
+// verified matches into regions (unless a sample of the hashes has too few repeats); lossless encodes of still images try it
+// by default (see fuif.cpp)
+// For animations, it does a block motion search in the previous frames (if their offset codes fit in the match channel),
+// unless an extra (encoder-only) parameter asks for the simple heuristic that only looks at corresponding positions
 
 typedef std::pair<int,int> offset;
 typedef std::vector<offset> offsets;
@@ -75,6 +81,21 @@ void compute_offset(int code, int &xoffset, int &yoffset) {
     }
 }
 
+// offset code of the position (x+dx,y+dy) in the past, i.e. the inverse of compute_offset
+int offset_code(int dx, int dy) {
+    int onion_layer = std::max(abs(dx), -dy) - 1;
+    int code = 2*onion_layer*(onion_layer+1);  // number of codes in the inner layers
+    if (onion_layer & 1) {
+        if (dy == -1-onion_layer) return code + 2 + 2*onion_layer - dx;
+        if (dx == 1+onion_layer) return code - dy;
+        return code + 4 + 4*onion_layer + dy;
+    } else {
+        if (dx == -1-onion_layer && dy > -1-onion_layer) return code + 1 - dy;
+        if (dy == -1-onion_layer) return code + 3 + 2*onion_layer + dx;
+        return code + 5 + 4*onion_layer + dy;
+    }
+}
+
 // TODO: hardcode some prefix of this table and generate the rest when needed
 void make_offsets_table(offsets &t) {
     for (int i=1; i<t.size(); i++) {
@@ -94,6 +115,36 @@ void default_match_parameters(std::vector<int> &parameters, const Image &image)
     parameters.push_back(1000000); // max distance (positive = search all, negative = look at corresponding positions in previous frames only)
 }
 
+static void add_row(pixel_type * RESTRICT p, const pixel_type * RESTRICT src, int n) {
+    for (int x=0; x<n; x++) p[x] += src[x];
+}
+
+// undoes the matches of a run of pixels x0..x1-1 in row y that all refer to the pixel at offset (dx,dy)
+// (w is the width of the match channel; the matched channels can be wider, e.g. when they are padded to whole DCT blocks)
+static void inv_match_run(Image &input, int c0, int cn, int w, int y, int x0, int x1, int dx, int dy, bool softmatch) {
+    if (dy > 0 || (dy == 0 && dx >= 0) || y+dy < 0 || x0+dx < 0 || x1+dx > w) {
+        // an offset that does not point to the past (in the same row or a row above): cannot come from the encoder
+        for (int x=x0; x<x1; x++)
+            for (int c=c0; c<=cn; c++) {
+                if (softmatch) input.channel[c].value(y,x) += input.channel[c].value(y+dy, x+dx);
+                else input.channel[c].value(y,x) = input.channel[c].value(y+dy, x+dx);
+            }
+        return;
+    }
+    // a run that overlaps its source (in the same row) is done in pieces, so every piece refers to pixels that are already done
+    int piece = (dy == 0 ? -dx : x1-x0);
+    for (int c=c0; c<=cn; c++) {
+        int stride = input.channel[c].w;
+        pixel_type *row = &input.channel[c].data[(size_t)y*stride];
+        const pixel_type *src = &input.channel[c].data[(size_t)(y+dy)*stride + dx];
+        for (int x=x0; x<x1; x+=piece) {
+            int n = std::min(piece, x1-x);
+            if (softmatch) add_row(row+x, src+x, n);
+            else memcpy(row+x, src+x, n*sizeof(pixel_type));
+        }
+    }
+}
+
 bool inv_match(Image &input, std::vector<int> parameters) {
     if (input.nb_meta_channels < 1) {
         e_printf("Error: match transform without match.\n");
@@ -112,65 +163,50 @@ bool inv_match(Image &input, std::vector<int> parameters) {
         return false;
     }
     bool softmatch = parameters[2];
-    int w = input.channel[c0].w;
-    int h = input.channel[c0].h;
-
+    // the matched channels can be larger than the match channel (after an inverse DCT, they are padded to whole blocks)
+    int w = m.w;
+    int h = m.h;
+    for (int c=c0; c<=cn; c++) {
+        if (input.channel[c].w < w || input.channel[c].h < h) {
+            e_printf("Error: match transform with incorrect match channel.\n");
+            return false;
+        }
+    }
 
+    offsets offsets_table;
+    int fh = h/input.nb_frames;
     if (m.q == 1) {
-        offsets offsets_table(m.maxval + 1);
+        offsets_table.resize(m.maxval + 1);
         make_offsets_table(offsets_table);
-        if (softmatch)
-        for (int y=0; y<h; y++) {
-          for (int x=0; x<w; x++) {
-            pixel_type z = m.value(y,x);
-            if (z) {
-                offset o = offsets_table[z];
-                for (int c=c0; c<=cn; c++)
-                    input.channel[c].value(y,x) += input.channel[c].value(y+o.second, x+o.first);
-            }
-          }
-        }
-        else
-        for (int y=0; y<h; y++) {
-          for (int x=0; x<w; x++) {
-            pixel_type z = m.value(y,x);
-            if (z) {
-                offset o = offsets_table[z];
-                for (int c=c0; c<=cn; c++)
-                    input.channel[c].value(y,x) = input.channel[c].value(y+o.second, x+o.first);
-            }
-          }
-        }
     } else {
-        int fh = h/input.nb_frames;
         int offsetcode = 2*fh*fh + (fh&1); // this simple formula corresponds to the code to go exactly one frame up
-        if (m.q == offsetcode) {
-            // this is the special case where we are matching with corresponding pixels from previous frames; optimize it a bit...
-            if (softmatch)
-            for (int y=0; y<h; y++) {
-              for (int x=0; x<w; x++) {
-                pixel_type z = m.value(y,x);
-                if (z) {
-                    for (int c=c0; c<=cn; c++)
-                        input.channel[c].value(y,x) += input.channel[c].value(y-z*fh, x);
-                }
-              }
-            }
-            else
-            for (int y=0; y<h; y++) {
-              for (int x=0; x<w; x++) {
-                pixel_type z = m.value(y,x);
-                if (z) {
-                    for (int c=c0; c<=cn; c++)
-                        input.channel[c].value(y,x) = input.channel[c].value(y-z*fh, x);
-                }
-              }
-            }
-        } else {
+        // otherwise, the only supported case is where we are matching with corresponding pixels from previous frames
+        if (m.q != offsetcode) {
             e_printf("Error: match transform with unexpected quantization factor. Not implemented.\n");
             return false;
         }
     }
+    // matches come in runs of the same code
+    for (int y=0; y<h; y++) {
+        const pixel_type *mrow = &m.data[(size_t)y*w];
+        for (int x=0; x<w; ) {
+            pixel_type z = mrow[x];
+            if (!z) { x++; continue; }
+            int x1 = x+1;
+            while (x1 < w && mrow[x1] == z) x1++;
+            int dx = 0, dy = -z*fh;
+            if (m.q == 1) {
+                if (z < 0 || z >= offsets_table.size()) {
+                    e_printf("Error: invalid match code %i.\n", z);
+                    return false;
+                }
+                dx = offsets_table[z].first;
+                dy = offsets_table[z].second;
+            }
+            inv_match_run(input, c0, cn, w, y, x, x1, dx, dy, softmatch);
+            x = x1;
+        }
+    }
     input.nb_meta_channels--;
     input.channel.erase(input.channel.begin(),input.channel.begin()+1);
     return true;
@@ -184,62 +220,265 @@ void meta_match(Image &input, std::vector<int> &parameters) {
     }
     int begin_c = input.nb_meta_channels+parameters[0];
     int end_c = input.nb_meta_channels+parameters[1];
-    if (begin_c > end_c || end_c >= input.channel.size()) {
+    if (begin_c < input.nb_meta_channels || begin_c > end_c || end_c >= input.channel.size()) {
         e_printf("Error: match transform with incorrect parameters.\n");
         input.error = true; return;
     }
     input.nb_meta_channels++;
-    Channel mch(input.channel[begin_c].w,input.channel[begin_c].h, 0, 1);
+    // no data yet: the decoder allocates it when the channel is decoded, the encoder in fwd_match
+    Channel mch(0, 0, 0, 1);
+    mch.w = input.channel[begin_c].w;
+    mch.h = input.channel[begin_c].h;
     input.channel.insert(input.channel.begin(),mch);
 }
 
-bool matches(Image &img, int c0, int cn, int x, int y, int z, offsets &ot, bool newmatch) {
-    int x2 = x+ot[z].first;
-    int y2 = y+ot[z].second;
-    if (y2<0 || x2<0) return false;
-    if (x2 >= img.channel[c0].w) return false;
-    if (newmatch && img.channel[0].value(y,x)) return false;
-    for (int c=c0; c<=cn; c++)
-        if (img.channel[c].value(y,x) != img.channel[c].value(y2,x2)) return false;
-    return true;
-}
 void do_match(Image &img, int c0, int cn, int x, int y, int z, offsets &ot) {
     for (int c=c0; c<=cn; c++)
         img.channel[c].value(y,x) -= img.channel[c].value(y+ot[z].second, x+ot[z].first);
 }
 
-// very rudimentary heuristic to find 'good' matches (in the sense that the entropy of the match channel is worth the entropy reduction from eliminating the duplication)
-pixel_type find_good_match(Image &img, int c0, int cn, int x, int y, offsets &ot) {
-    int max_count=100;   // this is the minimal match size (number of nontrivial matching pixels) to consider
-    int best_z=0;
+// size of the blocks that are hashed to find candidate matches
+#define MATCH_BLOCK 8
+// number of earlier positions with the same block hash that are tried
+#define MATCH_CANDIDATES 4
+// minimal match size (number of nontrivial pixels, i.e. not equal to their left neighbor) to consider, so the entropy
+// of the match channel (and of the edges of the matched regions) is worth the entropy reduction from eliminating the duplication
+#define MATCH_MIN_COUNT 1600
+// one in this many block hashes is looked at by the pre-check of find_matches
+#define MATCH_SAMPLE 16
+
+static inline bool same_pixel(const Image &img, int c0, int cn, size_t i, size_t j) {
+    for (int c=c0; c<=cn; c++) if (img.channel[c].data[i] != img.channel[c].data[j]) return false;
+    return true;
+}
+
+// hashes of the k x k blocks at positions y0 <= y < y1 (and 0 <= x <= w-k), 0 for blocks that are too flat to be worth matching
+static void block_hashes(const Image &img, int c0, int cn, int y0, int y1, uint32_t *out) {
+    const int k = MATCH_BLOCK;
+    const uint64_t B = 0x100000001B3ULL, C = 0x9E3779B97F4A7C15ULL;  // bases of the horizontal and vertical polynomial hashes
+    uint64_t Bk = 1, Ck = 1;
+    for (int i=1; i<k; i++) { Bk *= B; Ck *= C; }
+    int w = img.channel[c0].w;
+    int bw = w - k + 1;
+    std::vector<uint64_t> pixel(w), rowhash(k*bw), colhash(bw, 0);
+    std::vector<int> nontrivial(w), rowcount(k*bw), colcount(bw, 0);
+    for (int y=y0; y<y1+k-1; y++) {
+        for (int x=0; x<w; x++) {
+            uint64_t v = 0;
+            for (int c=c0; c<=cn; c++) v = ((v << 16) | (v >> 48)) ^ (uint16_t)img.channel[c].data[(size_t)y*w+x];
+            pixel[x] = v;
+            nontrivial[x] = (x == 0 || v != pixel[x-1]);
+        }
+        // the oldest row in the ring buffer is replaced by this one
+        uint64_t *rh = &rowhash[(y % k)*bw];
+        int *rc = &rowcount[(y % k)*bw];
+        bool full = (y - y0 >= k);
+        uint64_t hash = 0;
+        int count = 0;
+        for (int x=0; x<k; x++) { hash = hash*B + pixel[x]; count += nontrivial[x]; }
+        for (int x=0; x<bw; x++) {
+            if (x) {
+                hash = (hash - pixel[x-1]*Bk)*B + pixel[x+k-1];
+                count += nontrivial[x+k-1] - nontrivial[x-1];
+            }
+            if (full) { colhash[x] -= rh[x]*Ck; colcount[x] -= rc[x]; }
+            colhash[x] = colhash[x]*C + hash;
+            colcount[x] += count;
+            rh[x] = hash;
+            rc[x] = count;
+        }
+        if (y - y0 < k-1) continue;
+        uint32_t *o = &out[(size_t)(y-k+1-y0)*bw];
+        for (int x=0; x<bw; x++) {
+            uint32_t h32 = (colhash[x] >> 32) ^ colhash[x];
+            o[x] = (colcount[x] < k ? 0 : (h32 ? h32 : 1));
+        }
+    }
+}
+
+// number of pixels of the region at seed position (x,y) that can be matched with offset (dx,dy) and are nontrivial and not matched yet;
+// if mark is true, the region gets match code z (unless it has a better match already), otherwise it gets code z in 'tried'
+// and the counting stops at MATCH_MIN_COUNT (or when the region is large but mostly trivial)
+static int match_region(Image &img, int c0, int cn, int x, int y, int dx, int dy, int z, bool mark, std::vector<pixel_type> &tried) {
+    Channel &m = img.channel[0];
     int w = img.channel[c0].w;
     int h = img.channel[c0].h;
-    for (int z=1; z<ot.size(); z++) {
-            if (!matches(img,c0,cn,x,y,z,ot,true)) continue;
-            int count=0;
-            int yy=0;
-            for (; y+yy<h; yy++) {
-                int xl=0;
-                for (; x+xl>=0; xl--) {
-                    // if it matches                              // and if it's a nontrivial pixel (not equal to its left neighbor)
-                    if (matches(img,c0,cn,x+xl,y+yy,z,ot,true)) { if (!matches(img,c0,cn,x+xl,y+yy,1,ot,true)) count++; }       // then count it
-                    else break;
-                }
-                xl++;
-                int xr=1;
-                for (; x+xr<w; xr++) {
-                    if (matches(img,c0,cn,x+xr,y+yy,z,ot,true)) { if (!matches(img,c0,cn,x+xl,y+yy,1,ot,true)) count++; }
-                    else break;
-                }
-                xr--;
-                if (!xl && !xr) break;
-                if (xr-xl < 8) break; // minimum 8 pixels wide
+    int count = 0;
+    size_t area = 0;
+    for (int yy=y; yy<h; yy++) {
+        if (!mark && (count >= MATCH_MIN_COUNT || area > 32*MATCH_MIN_COUNT)) break;
+        size_t row = (size_t)yy*w, src = (size_t)(yy+dy)*w + dx;
+        if (!same_pixel(img, c0, cn, row+x, src+x)) break;
+        int xl = x, xr = x;
+        while (xl > 0 && xl+dx > 0 && same_pixel(img, c0, cn, row+xl-1, src+xl-1)) xl--;
+        while (xr+1 < w && xr+1+dx < w && same_pixel(img, c0, cn, row+xr+1, src+xr+1)) xr++;
+        area += xr-xl+1;
+        for (int xx=xl; xx<=xr; xx++) {
+            pixel_type &mv = m.data[row+xx];
+            if (mark) {
+                if (mv == 0 || mv > z) mv = z;
+            } else {
+                tried[row+xx] = z;
+                if (mv == 0 && (xx == 0 || !same_pixel(img, c0, cn, row+xx, row+xx-1))) count++;
             }
-            if (yy < 7) break; //minimum 8 pixels high
-            if (count>max_count) { max_count=count; best_z=z; }
+        }
+    }
+    return count;
+}
+
+// finds matches of at least MATCH_BLOCK x MATCH_BLOCK pixels and marks them in the match channel
+// returns the number of matched regions
+static int find_matches(Image &input, int c0, int cn, int maxdist) {
+    const int k = MATCH_BLOCK;
+    int w = input.channel[c0].w;
+    int h = input.channel[c0].h;
+    if (w < k || h < k) return 0;
+    int bw = w - k + 1, bh = h - k + 1;
+    std::vector<uint32_t> hashes((size_t)bw*bh);
+    // the hashes are computed in parallel bands of rows
+    parallel_for(0, bh, std::max(64, band_rows(bw*k)), [&](int y0, int y1) { block_hashes(input, c0, cn, y0, y1, &hashes[(size_t)y0*bw]); });
+
+    // cheap pre-check: the blocks whose hash is a multiple of MATCH_SAMPLE (so a block and its copies are sampled together)
+    // need enough repeats between them to make up a match; photos hardly have any, so they skip the search below
+    std::vector<uint32_t> sample;
+    for (uint32_t hash : hashes) if (hash && hash % MATCH_SAMPLE == 0) sample.push_back(hash);
+    std::sort(sample.begin(), sample.end());
+    size_t repeats = 0;
+    for (size_t i=1; i<sample.size(); i++) repeats += (sample[i] == sample[i-1]);
+    v_printf(5,"Pre-check: %lu repeated blocks among %lu sampled blocks\n",(unsigned long) repeats,(unsigned long) sample.size());
+    if (repeats * MATCH_SAMPLE < MATCH_MIN_COUNT / 2) return 0;
+
+    // the most recent positions with each hash (position+1, 0 if none), newest first
+    int bits = 10;
+    while (bits < 20 && ((size_t)1 << bits) < hashes.size()) bits++;
+    std::vector<uint32_t> table(MATCH_CANDIDATES << bits, 0);
+    Channel &m = input.channel[0];
+    // seeds in a region that was rejected already are skipped (they would mostly give a part of that region again)
+    std::vector<pixel_type> tried((size_t)w*h, 0);
+    int regions = 0;
+    for (int y=0; y<bh; y++) {
+        for (int x=0; x<bw; x++) {
+            uint32_t hash = hashes[(size_t)y*bw+x];
+            if (!hash) continue;
+            uint32_t *bucket = &table[MATCH_CANDIDATES * ((hash * 2654435761U) >> (32 - bits))];
+            uint32_t candidates[MATCH_CANDIDATES];
+            std::copy(bucket, bucket+MATCH_CANDIDATES, candidates);
+            std::copy(candidates, candidates+MATCH_CANDIDATES-1, bucket+1);
+            bucket[0] = y*bw+x + 1;
+            if (m.data[(size_t)y*w+x] || tried[(size_t)y*w+x]) continue;
+            for (uint32_t candidate : candidates) {
+                if (!candidate) break;
+                int dx = (int)((candidate-1) % bw) - x, dy = (int)((candidate-1) / bw) - y;
+                int z = offset_code(dx,dy);
+                if (z > maxdist) continue;
+                // verify the block (the hashes can collide)
+                bool same = true;
+                for (int yy=0; yy<k && same; yy++)
+                    for (int xx=0; xx<k && same; xx++)
+                        same = same_pixel(input, c0, cn, (size_t)(y+yy)*w+x+xx, (size_t)(y+yy+dy)*w+x+xx+dx);
+                if (!same) continue;
+                int count = match_region(input, c0, cn, x, y, dx, dy, z, false, tried);
+                if (count < MATCH_MIN_COUNT) continue;
+                v_printf(6,"Found good match at %i,%i with offset %i (x+=%i,y+=%i) and count %i\n",x,y,z,dx,dy,count);
+                match_region(input, c0, cn, x, y, dx, dy, z, true, tried);
+                regions++;
+                break;
+            }
+        }
+    }
+    return regions;
+}
+
+// size of the blocks of the motion search in animations, and the largest motion (in pixels) that is searched
+#define MOTION_BLOCK 8
+#define MOTION_RADIUS 16
+
+static int sad_row(const pixel_type * RESTRICT a, const pixel_type * RESTRICT b, int n) {
+    int sad = 0;
+    for (int x=0; x<n; x++) sad += abs(a[x] - b[x]);
+    return sad;
+}
+
+// sum of absolute differences between the cw x ch block at (x,y) and the one at (x+dx,y+dy), stops early once it exceeds 'limit'
+static int block_sad(const Image &img, int c0, int cn, int x, int y, int cw, int ch, int dx, int dy, int limit) {
+    int w = img.channel[c0].w;
+    int sad = 0;
+    for (int yy=y; yy<y+ch && sad <= limit; yy++)
+        for (int c=c0; c<=cn; c++) {
+            const pixel_type *row = &img.channel[c].data[(size_t)yy*w + x];
+            sad += sad_row(row, row + (ptrdiff_t)dy*w + dx, cw);
+        }
+    return sad;
+}
+
+// the largest offset code needed by the motion search
+static int64_t motion_max_code(int fh, int frames_back, int radius) {
+    int64_t layers = (int64_t)frames_back*fh + radius;
+    return 2*layers*(layers+1);
+}
+
+// gives every block of every frame (except the first) the offset to the block with the smallest SAD in one of the previous
+// frames_back frames, within 'radius' pixels of its position; the search in the previous frame goes coarse-to-fine around the best
+// of a few predicted motions (no motion, the motion of the left and top blocks and of the same block in the previous frame)
+// the pixels that are identical to their counterpart at that offset get its offset code, if at least half of the block does
+// returns the number of matched pixels
+static size_t find_motion_matches(Image &input, int c0, int cn, int frames_back, int radius) {
+    const int k = MOTION_BLOCK;
+    Channel &m = input.channel[0];
+    int w = input.channel[c0].w;
+    int h = input.channel[c0].h;
+    int fh = h / input.nb_frames;
+    int bw = (w+k-1)/k, bh = (fh+k-1)/k;
+    // motion of the blocks of the current and the previous frame (the offset is relative to the same position one frame up)
+    std::vector<offset> motion((size_t)bw*bh, offset(0,0)), prev_motion = motion;
+    size_t matched = 0;
+    for (int f=1; f<input.nb_frames; f++) {
+      for (int by=0; by<bh; by++)
+      for (int bx=0; bx<bw; bx++) {
+        int x = bx*k, y = f*fh + by*k;
+        int cw = std::min(k, w-x), ch = std::min(k, (f+1)*fh-y);
+        int best = INT_MAX, best_n = 1;
+        offset best_v(0,0);
+        auto try_motion = [&](int n, int dx, int dy) {
+            if (n > f || abs(dx) > radius || abs(dy) > radius) return;
+            int sy = y + dy - n*fh;
+            if (x+dx < 0 || x+dx+cw > w || sy < (f-n)*fh || sy+ch > (f-n+1)*fh) return;
+            int sad = block_sad(input, c0, cn, x, y, cw, ch, dx, dy - n*fh, best);
+            if (sad >= best) return;
+            best = sad; best_n = n; best_v = offset(dx,dy);
+        };
+        try_motion(1, 0, 0);
+        if (bx) try_motion(1, motion[by*bw+bx-1].first, motion[by*bw+bx-1].second);
+        if (by) try_motion(1, motion[(by-1)*bw+bx].first, motion[(by-1)*bw+bx].second);
+        try_motion(1, prev_motion[by*bw+bx].first, prev_motion[by*bw+bx].second);
+        for (int step = std::max(1, radius/2); step && best; step /= 2) {
+            offset center = best_v;
+            for (int sy=-1; sy<=1; sy++)
+                for (int sx=-1; sx<=1; sx++)
+                    if (sx || sy) try_motion(1, center.first + sx*step, center.second + sy*step);
+        }
+        offset v1 = best_v;
+        for (int n=2; n <= frames_back && best; n++) {
+            try_motion(n, 0, 0);
+            try_motion(n, v1.first, v1.second);
+        }
+        motion[by*bw+bx] = (best_n == 1 ? best_v : offset(0,0));
+
+        int dx = best_v.first, dy = best_v.second - best_n*fh;
+        int count = 0;
+        for (int yy=y; yy<y+ch; yy++)
+            for (int xx=x; xx<x+cw; xx++)
+                count += same_pixel(input, c0, cn, (size_t)yy*w+xx, (size_t)(yy+dy)*w+xx+dx);
+        if (count*2 < cw*ch) continue;
+        int z = offset_code(dx, dy);
+        for (int yy=y; yy<y+ch; yy++)
+            for (int xx=x; xx<x+cw; xx++)
+                if (same_pixel(input, c0, cn, (size_t)yy*w+xx, (size_t)(yy+dy)*w+xx+dx)) m.data[(size_t)yy*w+xx] = z;
+        matched += count;
+      }
+      prev_motion = motion;
     }
-    if (best_z) v_printf(6,"Found good match at %i,%i with offset %i (x+=%i,y+=%i) and count %i\n",x,y,best_z,ot[best_z].first,ot[best_z].second,max_count);
-    return best_z;
+    return matched;
 }
 
 bool fwd_match(Image &input, std::vector<int> &parameters) {
@@ -253,48 +492,29 @@ bool fwd_match(Image &input, std::vector<int> &parameters) {
     }
     int maxdist = 10000, erodes = 1;
     if (adj_params.size() > 3) maxdist = adj_params[3];
+    bool motion_search = (adj_params.size() > 4 ? adj_params[4] : true); // encoder-only, like the max distance
     if (adj_params[0] == 0 && adj_params[1] == input.nb_channels-1 && adj_params[2] == 0) parameters.clear(); // we can use default parameters
-    if (parameters.size() > 3) parameters.pop_back();
+    if (parameters.size() > 3) parameters.resize(3);
     bool softmatch = adj_params[2];
     Channel &m = input.channel[0];
+    m.allocate();
     int w = input.channel[c0].w;
     int h = input.channel[c0].h;
 
     if (maxdist > 0) {
-      v_printf(5,"Running heuristic to find matches (channels %i-%i)\n",c0,cn);
+      v_printf(5,"Looking for matches (channels %i-%i)\n",c0,cn);
+      maxdist = std::min(maxdist, (int)LARGEST_VAL); // the match channel holds the offset codes
+      for (int c=c0; c<=cn; c++) input.channel[c].allocate();
+      int regions = find_matches(input, c0, cn, maxdist);
+      v_printf(5,"Found %i matching regions\n",regions);
+      if (!regions) {
+        // not worth it
+        input.channel.erase(input.channel.begin());
+        input.nb_meta_channels--;
+        return false;
+      }
       offsets ot(maxdist + 1);
       make_offsets_table(ot);
-      for (int y=0; y<h; y++) {
-        if (y%10 == 0) v_printf(7,"Finding matches at row %i\n",y);
-        for (int x=0; x<w; x++) {
-            if (m.value(y,x)) continue;
-            pixel_type z = find_good_match(input,c0,cn,x,y,ot);
-            if (!z) continue;
-            int count=0;
-            for (int yy=0; y+yy<h; yy++) {
-                int xl=0;
-                for (; x+xl>=0; xl--) {
-                    if (matches(input,c0,cn,x+xl,y+yy,z,ot,false)) {
-                        if (m.value(y+yy,x+xl) == 0 || m.value(y+yy,x+xl) > z)
-                        { m.value(y+yy,x+xl) = z; count++; }
-                    }
-                    else break;
-                }
-                xl++;
-                int xr=1;
-                for (; x+xr<w; xr++) {
-                    if (matches(input,c0,cn,x+xr,y+yy,z,ot,false)) {
-                        if (m.value(y+yy,x+xr) == 0 || m.value(y+yy,x+xr) > z)
-                        { m.value(y+yy,x+xr) = z; count++; }
-                    }
-                    else break;
-                }
-                xr--;
-                if (!xl && !xr) break;
-            }
-            v_printf(8,"Matched %i pixels from seed position (%i,%i)\n",count,x,y);
-        }
-      }
       for (int y=h-1; y>=0; y--) {
         for (int x=w-1; x>=0; x--) {
             if (m.value(y,x)) do_match(input,c0,cn,x,y,m.value(y,x),ot);
@@ -305,8 +525,18 @@ bool fwd_match(Image &input, std::vector<int> &parameters) {
         e_printf("This transform is meant for animations only.\n");
         return false;
       }
-      v_printf(5,"Running simple heuristic to find matches from previous frames (channels %i-%i)\n",c0,cn);
       int fh = h / input.nb_frames;
+      // the offset codes of a motion search only fit in the match channel if the frames are not too tall
+      int radius = MOTION_RADIUS;
+      while (radius && motion_max_code(fh, -maxdist, radius) > LARGEST_VAL) radius /= 2;
+      if (!motion_search) radius = 0;
+      if (radius) {
+        v_printf(5,"Searching for block motion from previous frames (channels %i-%i, radius %i)\n",c0,cn,radius);
+        for (int c=c0; c<=cn; c++) input.channel[c].allocate();
+        size_t matched = find_motion_matches(input, c0, cn, -maxdist, radius);
+        v_printf(5,"Matched %lu pixels\n",(unsigned long) matched);
+      } else {
+      v_printf(5,"Running simple heuristic to find matches from previous frames (channels %i-%i)\n",c0,cn);
       int offsetcode = 2*fh*fh + (fh&1); // this simple formula corresponds to the code to go exactly one frame up
       m.q = offsetcode;
       int minmatchcount = CLAMP(w/50,5,40); // arbitrary threshold
@@ -333,6 +563,7 @@ bool fwd_match(Image &input, std::vector<int> &parameters) {
             }
         }
       }
+      }
 
       // vertical-only erode
 /*
@@ -48,11 +48,13 @@ SOFTWARE.
 #pragma once
 
 #include "../image/image.h"
+#include "../config.h"
 
 
 
 #include <algorithm>
 #include <cmath>
+#include <memory>
 
 
 // kDCTMatrix[8*u+x] = 0.5*alpha(u)*cos((2*x+1)*u*M_PI/16),
@@ -76,43 +78,75 @@ static const double kDCTMatrix[64] = {
   0.4903926402, -0.4157348062,  0.2777851165, -0.0975451610,
 };
 
-void DCT1d(const double* in, int stride, double* out) {
-  for (int x = 0; x < 8; ++x) {
-    out[x * stride] = 0.0;
-    for (int u = 0; u < 8; ++u) {
-      out[x * stride] += kDCTMatrix[8 * x + u] * in[u * stride];
-    }
-  }
-}
+// The 2D transforms below do exactly the same double-precision multiplications and additions, in the same order,
+// as applying guetzli's DCT1d/IDCT1d (out[x] = sum over u of kDCTMatrix * in[u]) to the columns and then to the rows,
+// so the results are identical. But they work on whole rows, so the loops can be vectorized,
+// and terms with a zero coefficient are skipped (adding 0.0 does not change a sum), which makes sparse blocks cheap.
 
-void IDCT1d(const double* in, int stride, double* out) {
-  for (int x = 0; x < 8; ++x) {
-    out[x * stride] = 0.0;
-    for (int u = 0; u < 8; ++u) {
-      out[x * stride] += kDCTMatrix[8 * u + x] * in[u * stride];
-    }
-  }
+// inverse: kDCTMatrix[8*u + x], forward: kDCTMatrix[8*x + u]
+template <bool inverse>
+inline double dct_factor(int u, int x) {
+  return (inverse ? kDCTMatrix[8 * u + x] : kDCTMatrix[8 * x + u]);
 }
 
-typedef void (*Transform1d)(const double* in, int stride, double* out);
-
-void TransformBlock(double block[64], Transform1d f) {
-  double tmp[64];
-  for (int x = 0; x < 8; ++x) {
-    f(&block[x], 8, &tmp[x]);
+template <bool inverse>
+static void TransformBlock(double block[64]) {
+  double tmp[64] = {};
+  // columns: tmp[8*x + c] = sum_u factor(u,x) * block[8*u + c]
+  for (int u = 0; u < 8; ++u) {
+    const double *in = &block[8 * u];
+    bool zero = true;
+    for (int c = 0; c < 8; ++c) zero &= (in[c] == 0.0);
+    if (zero) continue;
+    for (int x = 0; x < 8; ++x) {
+      const double f = dct_factor<inverse>(u, x);
+      for (int c = 0; c < 8; ++c) tmp[8 * x + c] += f * in[c];
+    }
   }
+  // rows: block[8*y + x] = sum_u factor(u,x) * tmp[8*y + u]
   for (int y = 0; y < 8; ++y) {
-    f(&tmp[8 * y], 1, &block[8 * y]);
+    double out[8] = {};
+    for (int u = 0; u < 8; ++u) {
+      const double t = tmp[8 * y + u];
+      if (t == 0.0) continue;
+      for (int x = 0; x < 8; ++x) out[x] += dct_factor<inverse>(u, x) * t;
+    }
+    for (int x = 0; x < 8; ++x) block[8 * y + x] = out[x];
   }
 }
 
 
 void ComputeBlockDCTDouble(double block[64]) {
-  TransformBlock(block, DCT1d);
+  TransformBlock<false>(block);
 }
 
 void ComputeBlockIDCTDouble(double block[64]) {
-  TransformBlock(block, IDCT1d);
+  TransformBlock<true>(block);
+}
+
+// reduced-size inverse DCT, for previews: the top-left NxN coefficients of an 8x8 block (N = 1, 2 or 4) give an NxN image block,
+// i.e. the 8x8 block at scale 1:8, 1:4 or 1:2. The factors are those of an N-point inverse DCT, scaled so the DC gives the same average.
+void ComputeBlockIDCTScaled(const double block[64], int N, double *out) {
+  static double factors[5][16];   // factors[N][N*u + x] = 0.5*alpha(u)*cos((2*x+1)*u*M_PI/(2*N))
+  static bool init = [](){
+    for (int n = 1; n <= 4; n *= 2)
+      for (int u = 0; u < n; ++u)
+        for (int x = 0; x < n; ++x)
+          factors[n][n * u + x] = 0.5 * (u ? 1.0 : M_SQRT1_2) * cos((2 * x + 1) * u * M_PI / (2 * n));
+    return true;
+  }();
+  (void)init;
+  const double *f = factors[N];
+  double tmp[16] = {};
+  for (int v = 0; v < N; ++v)
+    for (int x = 0; x < N; ++x)
+      for (int u = 0; u < N; ++u) tmp[N * v + x] += f[N * u + x] * block[8 * v + u];
+  for (int y = 0; y < N; ++y)
+    for (int x = 0; x < N; ++x) {
+      double sum = 0;
+      for (int v = 0; v < N; ++v) sum += f[N * v + y] * tmp[N * v + x];
+      out[N * y + x] = sum;
+    }
 }
 
 
@@ -214,8 +248,16 @@ void default_DCT_parameters(std::vector<int> &parameters, const Image &image) {
 
 void meta_DCT(Image &image, std::vector<int> &parameters) {
     if (!parameters.size()) default_DCT_parameters(parameters,image);
+    if (parameters.size() < 2) {
+        e_printf("Error: DCT transform with incorrect parameters.\n");
+        image.error = true; return;
+    }
     int beginc = image.nb_meta_channels + parameters[0];
     int endc = image.nb_meta_channels + parameters[1];
+    if (beginc < image.nb_meta_channels || beginc > endc || endc >= image.channel.size()) {
+        e_printf("Error: DCT transform with incorrect parameters.\n");
+        image.error = true; return;
+    }
     int nb_channels = endc-beginc+1;
     std::vector<std::vector<int>> ordering;
     std::vector<int> comp;
@@ -245,8 +287,47 @@ void meta_DCT(Image &image, std::vector<int> &parameters) {
     }
 }
 
-// TODO: deal with partial inverse DCT for a 1:2 and 1:4 scale decode (it currently produces a 1:1 image)
-bool inv_DCT(Image &input, std::vector<int> &parameters) {
+// The inverse DCT of a channel, one row of blocks at a time (all at once in inv_DCT, on demand in begin_inv_DCT_rows)
+struct idct_channel {
+    const Channel *coefficient[64];     // the channel with each coefficient (NULL if it was not decoded, so it is all zeroes)
+    int bw, bh;                         // number of blocks
+    int size;                           // output samples per block in each direction (8, or less for a preview, see below)
+    float DCoffset;
+};
+
+struct idct_rows {
+    std::vector<Channel> dc, ac;        // the coefficients, moved out of the image
+    std::vector<idct_channel> channel;
+    int beginc;
+};
+
+// row 'by' of blocks of a channel
+static void inv_DCT_block_row(const idct_channel &ch, int by, Channel &out) {
+    const int size = ch.size;
+    for (int bx=0; bx<ch.bw; bx++) {
+        if (size < 8) {
+            double block[64] = {}, small[16];
+            for (int v=0; v<size; v++)
+            for (int u=0; u<size; u++) block[v*8+u] = (ch.coefficient[v*8+u] ? ch.coefficient[v*8+u]->value_nocheck(by,bx) : 0);
+            block[0] += ch.DCoffset;
+            ComputeBlockIDCTScaled(block, size, small);
+            for (int y=0; y<size && by*size+y<out.h; y++)
+            for (int x=0; x<size && bx*size+x<out.w; x++) out.data[(size_t)(by*size+y)*out.w + bx*size+x] = round(small[y*size+x]);
+        } else {
+            double block[64];
+            for (int i=0; i<64; i++) block[i] = (ch.coefficient[i] ? ch.coefficient[i]->value_nocheck(by,bx) : 0);
+            block[0] += ch.DCoffset;
+            ComputeBlockIDCTDouble(block);
+            pixel_type *p = out.data.data() + (size_t)by*8*out.w + bx*8;
+            for (int y=0; y<8; y++, p += out.w)
+            for (int x=0; x<8; x++) p[x] = round(block[y*8+x]);
+        }
+    }
+}
+
+// moves the coefficients to 'idct' and gives the channels their output size (without data)
+// for a preview, the image is produced at a smaller scale if possible (see below)
+static bool begin_inv_DCT(Image &input, std::vector<int> &parameters, idct_rows &idct) {
     if (!parameters.size()) default_DCT_parameters(parameters,input);
     int beginc = input.nb_meta_channels + parameters[0];
     int endc = input.nb_meta_channels + parameters[1];
@@ -265,44 +346,119 @@ bool inv_DCT(Image &input, std::vector<int> &parameters) {
     std::vector<int> coeff;
     default_DCT_scanscript(nb_channels,ordering,comp,coeff);
 
+    // Previews: coefficient channels that were not decoded have no data. If all the decoded coefficients are in the
+    // top-left 1x1, 2x2 or 4x4 of each block, a reduced-size inverse DCT produces the channels at scale 1:8, 1:4 or 1:2,
+    // which is cheaper than (and as good as) a full-size inverse DCT. The scan order does not fill those squares one
+    // after the other (it starts with (0,0),(0,1),(1,0),(2,0)), so it is the positions of the coefficients that count.
+    // This is only done if a preview was asked for; a truncated file still decodes at full size, like with any other transform.
+    int extent = (input.reduced_scale ? 1 : 8); // the smallest N such that the top-left NxN of a block contains all the decoded coefficients
+    if (extent < 8) for (int c=beginc; c<=endc; c++)
+      for (int i=1; i<64; i++)
+        if (input.channel[offset-nb_channels+ ordering[c-beginc][jpeg_zigzag[i]]].data.size()) extent = std::max(extent, std::max(i/8, i%8) + 1);
+    int scale = (extent > 4 ? 0 : (extent > 2 ? 1 : (extent > 1 ? 2 : 3)));
+    int size = 8 >> scale;
+    if (scale) v_printf(3,"Decoded DCT coefficients fit in the top-left %ix%i, doing an inverse DCT at scale 1:%i\n",extent,extent,8/size);
+
+    idct.beginc = beginc;
+    idct.channel.resize(nb_channels);
     for (int c=beginc; c<=endc; c++) {
+        idct_channel &ch = idct.channel[c-beginc];
+        input.channel[c].allocate();
         int bw = input.channel[c-beginc+offset].w; // consider first AC, in case we did repeated DCT (TODO: try repeated DCT to see if it even makes sense)
         int bh = input.channel[c-beginc+offset].h;
         if (input.channel[c].w < bw) bw = input.channel[c].w;
         if (input.channel[c].h < bh) bh = input.channel[c].h;
 
-        v_printf(3,"  Channel %i : %ix%i image from %ix%i blocks\n",c,bw*8,bh*8,bw,bh);
-        Channel outch(bw*8,bh*8,0,0);
+        int ow = bw*8, oh = bh*8;
+        if (scale) {
+            // the blocks at the right and bottom edge only partially cover the (downscaled) channel
+            int hshift = std::max(input.channel[c].hshift - 3, 0), vshift = std::max(input.channel[c].vshift - 3, 0);
+            ow = std::min(bw*size, (((input.w + (1<<hshift) - 1) >> hshift) + (1<<scale) - 1) >> scale);
+            oh = std::min(bh*size, (((input.h + (1<<vshift) - 1) >> vshift) + (1<<scale) - 1) >> scale);
+        }
+        v_printf(3,"  Channel %i : %ix%i image from %ix%i blocks\n",c,ow,oh,bw,bh);
+        Channel outch(0,0,0,0);
+        outch.w = ow;
+        outch.h = oh;
         outch.component = input.channel[c].component;
-        outch.hshift = input.channel[c].hshift - 3;
-        outch.vshift = input.channel[c].vshift - 3;
+        outch.hshift = input.channel[c].hshift - 3 + scale;
+        outch.vshift = input.channel[c].vshift - 3 + scale;
         outch.hcshift = input.channel[c].hcshift - 3;
         outch.vcshift = input.channel[c].hcshift - 3;
-        float DCoffset = (input.maxval + 1.0) * 4.0;
-        for (int by=0; by<bh; by++) {
-          for (int bx=0; bx<bw; bx++) {
-            double block[64];
-            block[0] = input.channel[c].value(by,bx) + DCoffset;
-            for (int i=1; i<64; i++) block[i] = input.channel[offset-nb_channels+ ordering[c-beginc][jpeg_zigzag[i]]].value(by,bx);
-            ComputeBlockIDCTDouble(block);
-            for (int y=0; y<8; y++)
-            for (int x=0; x<8; x++) outch.value(by*8+y, bx*8+x) = round(block[y*8+x]);
-          }
+        ch.DCoffset = (input.maxval + 1.0) * 4.0;
+        ch.bw = bw;
+        ch.bh = bh;
+        ch.size = size;
+        idct.dc.push_back(std::move(input.channel[c]));
+        input.channel[c] = std::move(outch);
+    }
+    idct.ac.assign(std::make_move_iterator(input.channel.begin()+offset), std::make_move_iterator(input.channel.end()));
+    input.channel.erase(input.channel.begin()+offset,input.channel.end());
+    for (int c=0; c<nb_channels; c++) {
+        idct_channel &ch = idct.channel[c];
+        for (int i=0; i<64; i++) {
+            const Channel &coef = (i ? idct.ac[ordering[c][jpeg_zigzag[i]] - nb_channels] : idct.dc[c]);
+            ch.coefficient[i] = (coef.data.size() >= (size_t)coef.w*coef.h && coef.w >= ch.bw && coef.h >= ch.bh ? &coef : NULL);
         }
-        input.channel[c] = outch;
     }
-    input.channel.erase(input.channel.begin()+offset,input.channel.begin()+offset+nb_channels*63);
+    return true;
+}
+
+bool inv_DCT(Image &input, std::vector<int> &parameters) {
+    idct_rows idct;
+    if (!begin_inv_DCT(input, parameters, idct)) return false;
+    for (int c=0; c<idct.channel.size(); c++) {
+        const idct_channel &ch = idct.channel[c];
+        Channel &out = input.channel[idct.beginc+c];
+        out.allocate();
+        // block rows are independent, so they are done in parallel bands
+        parallel_for(0, ch.bh, band_rows(ch.bw*64), [&](int by0, int by1) {
+            for (int by=by0; by<by1; by++) inv_DCT_block_row(ch, by, out);
+        });
+    }
+    return true;
+}
+
+// sets up the inverse DCT to be done on demand, one row of blocks at a time (so it can be fused with the final color transform,
+// see Image::prepare_rows): the channels get their output size (without data) and input.row_sources produces their rows
+bool begin_inv_DCT_rows(Image &input, std::vector<int> parameters) {
+    std::shared_ptr<idct_rows> idct = std::make_shared<idct_rows>();
+    if (!begin_inv_DCT(input, parameters, *idct)) return false;
+    input.row_sources.resize(input.channel.size());
+    for (int c=0; c<idct->channel.size(); c++) {
+        int done = 0;
+        input.row_sources[idct->beginc+c] = [idct, c, done](Channel &out, int n) mutable {
+            const idct_channel &ch = idct->channel[c];
+            out.allocate();
+            for (; done < ch.bh && done*ch.size < n; done++) inv_DCT_block_row(ch, done, out);
+        };
+    }
     return true;
 }
 
 bool fwd_DCT(Image &input, std::vector<int> &parameters) {
-    Image tmp=input; // TODO: implement without copy
     std::vector<int> adj_params = parameters; // use a copy so empty (default) parameters remain empty
+    if (!adj_params.size()) default_DCT_parameters(adj_params,input);
+    if (adj_params.size() < 2) {
+        e_printf("Error: DCT transform with incorrect parameters.\n");
+        return false;
+    }
 
     int beginc = input.nb_meta_channels + adj_params[0];
     int endc = input.nb_meta_channels + adj_params[1];
     int nb_channels = endc-beginc+1;
     int offset = input.channel.size();
+    if (beginc < input.nb_meta_channels || beginc > endc || endc >= offset) {
+        e_printf("Error: DCT transform with incorrect parameters.\n");
+        return false;
+    }
+    // only the channels that get transformed are moved out of the way (their dimensions stay, so meta_DCT works as usual)
+    std::vector<Channel> pixels(nb_channels);
+    for (int c=beginc; c<=endc; c++) {
+        pixels[c-beginc] = std::move(input.channel[c]);
+        input.channel[c].w = pixels[c-beginc].w;
+        input.channel[c].h = pixels[c-beginc].h;
+    }
     meta_DCT(input, adj_params);
 
     v_printf(3,"Doing DCT on channels %i..%i with AC coefficients in channels %i..%i\n",beginc,endc,offset,offset+63*nb_channels-1);
@@ -318,16 +474,27 @@ bool fwd_DCT(Image &input, std::vector<int> &parameters) {
             input.channel[c].resize();
     }
     for (int c=beginc; c<=endc; c++) {
+        const Channel &chin = pixels[c-beginc];
         int bw=input.channel[c].w;
         int bh=input.channel[c].h;
-        v_printf(3,"  Channel %i : %ix%i image to %ix%i blocks\n",c,tmp.channel[c].w,tmp.channel[c].h,bw,bh);
+        v_printf(3,"  Channel %i : %ix%i image to %ix%i blocks\n",c,chin.w,chin.h,bw,bh);
+        // the coefficient channels all have the dimensions of the DC channel
+        pixel_type *coefficient[64];
+        for (int i=0; i<64; i++) coefficient[i] = input.channel[i ? offset-nb_channels+ ordering[c-beginc][jpeg_zigzag[i]] : c].data.data();
         for (int by=0; by<bh; by++) {
           for (int bx=0; bx<bw; bx++) {
             double block[64];
-            for (int i=0; i<64; i++) block[i] = tmp.channel[c].repeating_edge_value(by*8+(i>>3),bx*8+(i&7));
+            if (by*8+8 <= chin.h && bx*8+8 <= chin.w) {
+              const pixel_type *in = chin.data.data() + (size_t)by*8*chin.w + bx*8;
+              for (int y=0; y<8; y++, in += chin.w)
+              for (int x=0; x<8; x++) block[y*8+x] = in[x];
+            } else {
+              for (int i=0; i<64; i++) block[i] = chin.repeating_edge_value(by*8+(i>>3),bx*8+(i&7));
+            }
             ComputeBlockDCTDouble(block);
-            input.channel[c].value(by,bx) = round(block[0]) - DCoffset;
-            for (int i=1; i<64; i++) input.channel[offset-nb_channels+ ordering[c-beginc][jpeg_zigzag[i]]].value(by,bx) = round(block[i]);
+            size_t pos = (size_t)by*bw+bx;
+            coefficient[0][pos] = round(block[0]) - DCoffset;
+            for (int i=1; i<64; i++) coefficient[i][pos] = round(block[i]);
           }
         }
     }
@@ -27,7 +27,8 @@ SOFTWARE.
 #pragma once
 
 #include "../image/image.h"
-#include <set>
+#include <map>
+#include <algorithm>
 
 bool inv_palette(Image &input, std::vector<int> parameters) {
     if (input.nb_meta_channels < 1) {
@@ -54,13 +55,15 @@ bool inv_palette(Image &input, std::vector<int> parameters) {
         input.channel[c0+i].component = parameters[0]+i;
     }
     const Channel &palette = input.channel[0];
-    for (int y=0; y<h; y++) {
+    parallel_for(0, h, band_rows(w), [&](int y0, int y1) {
+      for (int y=y0; y<y1; y++) {
         for (int x=0; x<w; x++) {
             int index = CLAMP(input.channel[c0].value(y,x),0,palette.w-1);
             for (int c=0; c<nb; c++)
                 input.channel[c0+c].value(y,x) = palette.value(c,index);
         }
-    }
+      }
+    });
     input.nb_channels += nb-1;
     input.nb_meta_channels--;
     input.channel.erase(input.channel.begin(),input.channel.begin()+1);
@@ -74,21 +77,73 @@ void meta_palette(Image &input, std::vector<int> parameters) {
     }
     int begin_c = input.nb_meta_channels+parameters[0];
     int end_c = input.nb_meta_channels+parameters[1];
-    if (begin_c > end_c || end_c >= input.channel.size()) {
+    if (begin_c < input.nb_meta_channels || begin_c > end_c || end_c >= input.channel.size()) {
         e_printf("Error: Palette transform with incorrect parameters.\n");
         input.error = true; return;
     }
     int nb = end_c - begin_c + 1;
     int &nb_colors = parameters[2];
+    if (nb_colors < 0) {
+        e_printf("Error: Palette transform with incorrect parameters.\n");
+        input.error = true; return;
+    }
     input.nb_meta_channels++;
     input.nb_channels -= nb-1;
     input.channel.erase(input.channel.begin()+begin_c+1,input.channel.begin()+end_c+1);
-    Channel pch(nb_colors,nb, 0, 1);
+    // the palette is decoded like any other channel, so its data is allocated then
+    Channel pch(0, 0, 0, 1);
+    pch.w = nb_colors;
+    pch.h = nb;
     pch.hshift = -1;
     input.channel.insert(input.channel.begin(),pch);
 }
 
 
+// Colors of up to 4 channels are packed in 64-bit keys, with the first channel in the most significant bits
+// and the sign bits flipped, so sorting the keys gives the same order as sorting the colors (as in a std::set)
+#define PALETTE_MAX_PACKED 4
+static_assert(sizeof(pixel_type) == 2, "palette keys assume 16-bit pixel values");
+
+static inline uint64_t pack_color(const pixel_type * const *row, int nb, int x) {
+    uint64_t key = 0;
+    for (int c=0; c<nb; c++) key = (key << 16) | ((uint16_t)row[c][x] ^ 0x8000);
+    return key;
+}
+
+static inline pixel_type unpack_color(uint64_t key, int nb, int c) {
+    return (pixel_type)(((key >> (16*(nb-1-c))) & 0xFFFF) ^ 0x8000);
+}
+
+// open addressing hash table from packed colors to their number (in order of first occurrence)
+class color_hash {
+    std::vector<uint64_t> keys;
+    std::vector<int> ids;
+    int bits;
+    size_t slot(uint64_t key) const { return (key * 0x9E3779B97F4A7C15ULL) >> (64 - bits); }
+public:
+    std::vector<uint64_t> colors;
+    // max_colors: the most colors that will be inserted
+    color_hash(size_t max_colors) : bits(4) {
+        while (((size_t)1 << bits) < 2*max_colors) bits++;
+        keys.resize((size_t)1 << bits);
+        ids.resize((size_t)1 << bits, -1);
+    }
+    int insert(uint64_t key) {
+        size_t mask = keys.size() - 1;
+        for (size_t i = slot(key); ; i = (i + 1) & mask) {
+            if (ids[i] < 0) { keys[i] = key; ids[i] = colors.size(); colors.push_back(key); return ids[i]; }
+            if (keys[i] == key) return ids[i];
+        }
+    }
+    int find(uint64_t key) const {
+        size_t mask = keys.size() - 1;
+        for (size_t i = slot(key); ; i = (i + 1) & mask) {
+            if (ids[i] < 0) return -1;
+            if (keys[i] == key) return ids[i];
+        }
+    }
+};
+
 bool fwd_palette(Image &input, std::vector<int> &parameters) {
     assert(parameters.size() == 3);
     int begin_c = input.nb_meta_channels+parameters[0];
@@ -100,39 +155,83 @@ bool fwd_palette(Image &input, std::vector<int> &parameters) {
     int h = input.channel[begin_c].h;
 
     v_printf(8,"Trying to represent channels %i-%i using at most a %i-color palette.\n",begin_c,end_c,nb_colors);
-    std::set< std::vector<pixel_type> > candidate_palette;
-    std::vector<pixel_type> color(nb);
-    for (int y=0; y<h; y++) {
-        for (int x=0; x<w; x++) {
-            for (int c=0; c<nb; c++) color[c] = input.channel[begin_c+c].value(y,x);
-            candidate_palette.insert(color);
-            if (candidate_palette.size() > nb_colors) return false; // too many colors
+    std::vector<const pixel_type *> row(nb);
+    auto get_rows = [&](int y) { for (int c=0; c<nb; c++) row[c] = &input.channel[begin_c+c].data[(size_t)y*input.channel[begin_c+c].w]; };
+    for (int c=0; c<nb; c++) input.channel[begin_c+c].allocate();
+
+    Channel pch;
+    std::vector<int> index;  // palette index for every color number (in the order of the hash table or the set)
+    if (nb <= PALETTE_MAX_PACKED) {
+        color_hash candidate_palette(std::min((size_t)nb_colors, (size_t)w*h) + 1);
+        // every packed key is a possible color, so the first pixel of a row is the 'previous' color of the second one
+        for (int y=0; y<h && w>0; y++) {
+            get_rows(y);
+            uint64_t previous = pack_color(row.data(), nb, 0);
+            candidate_palette.insert(previous);
+            for (int x=1; x<w; x++) {
+                uint64_t key = pack_color(row.data(), nb, x);
+                if (key == previous) continue;
+                previous = key;
+                candidate_palette.insert(key);
+                if (candidate_palette.colors.size() > nb_colors) return false; // too many colors
+            }
+            if (candidate_palette.colors.size() > nb_colors) return false;
+        }
+        nb_colors = candidate_palette.colors.size();
+        std::vector<int> order(nb_colors);
+        for (int i=0; i<nb_colors; i++) order[i] = i;
+        std::sort(order.begin(), order.end(), [&](int a, int b){ return candidate_palette.colors[a] < candidate_palette.colors[b]; });
+        pch = Channel(nb_colors,nb, 0, 1);
+        index.resize(nb_colors);
+        for (int i=0; i<nb_colors; i++) {
+            index[order[i]] = i;
+            for (int c=0; c<nb; c++) pch.value(c,i) = unpack_color(candidate_palette.colors[order[i]], nb, c);
+        }
+        for (int y=0; y<h; y++) {
+            get_rows(y);
+            pixel_type *out = &input.channel[begin_c].data[(size_t)y*w];
+            if (w < 1) break;
+            uint64_t previous = pack_color(row.data(), nb, 0);
+            int previous_index = index[candidate_palette.find(previous)];
+            for (int x=0; x<w; x++) {
+                uint64_t key = pack_color(row.data(), nb, x);
+                if (key != previous) { previous = key; previous_index = index[candidate_palette.find(key)]; }
+                out[x] = previous_index;
+            }
+        }
+    } else {
+        std::map< std::vector<pixel_type>, int > candidate_palette;
+        std::vector<pixel_type> color(nb);
+        for (int y=0; y<h; y++) {
+            get_rows(y);
+            for (int x=0; x<w; x++) {
+                for (int c=0; c<nb; c++) color[c] = row[c][x];
+                candidate_palette.emplace(color, 0);
+                if (candidate_palette.size() > nb_colors) return false; // too many colors
+            }
+        }
+        nb_colors = candidate_palette.size();
+        pch = Channel(nb_colors,nb, 0, 1);
+        int i=0;
+        for (auto &pcol : candidate_palette) {
+            for (int c=0; c<nb; c++) pch.value(c,i) = pcol.first[c];
+            pcol.second = i++;
+        }
+        for (int y=0; y<h; y++) {
+            get_rows(y);
+            pixel_type *out = &input.channel[begin_c].data[(size_t)y*w];
+            for (int x=0; x<w; x++) {
+                for (int c=0; c<nb; c++) color[c] = row[c][x];
+                out[x] = candidate_palette[color];
+            }
         }
     }
-    nb_colors = candidate_palette.size();
     v_printf(6,"Channels %i-%i can be represented using a %i-color palette.\n",begin_c,end_c,nb_colors);
-
-    Channel pch(nb_colors,nb, 0, 1);
     pch.hshift = -1;
-    int x=0;
-    for (auto pcol : candidate_palette) {
+    for (int x=0; x<nb_colors; x++) {
         v_printf(9,"Color %i :  ",x);
-        for (int i=0; i<nb; i++) pch.value(i,x) = pcol[i];
-        for (int i=0; i<nb; i++) v_printf(9,"%i ", pcol[i]);
+        for (int i=0; i<nb; i++) v_printf(9,"%i ", pch.value(i,x));
         v_printf(9,"\n");
-        x++;
-    }
-    for (int y=0; y<h; y++) {
-        for (int x=0; x<w; x++) {
-            for (int c=0; c<nb; c++) color[c] = input.channel[begin_c+c].value(y,x);
-            int index=0;
-            for ( ; index<nb_colors ; index++ ) {
-                bool found=true;
-                for (int c=0; c<nb; c++) if (color[c] != pch.value(c,index)) {found = false; break;}
-                if (found) break;
-            }
-            input.channel[begin_c].value(y,x) = index;
-        }
     }
     input.nb_meta_channels++;
     input.nb_channels -= nb-1;
@@ -36,11 +36,13 @@ bool inv_quantize(Image &input, const std::vector<int> &parameters) {
         int q = ch.q;
         if (q == 1) continue;
         v_printf(3,"De-quantizing channel %i with quantization constant %i\n",c,q);
-        for (int y=0; y<ch.h; y++) {
-          for (int x=0; x<ch.w; x++) {
-            ch.value(y,x) *= q;
+        parallel_for(0, ch.h, band_rows(ch.w), [&](int y0, int y1) {
+          for (int y=y0; y<y1; y++) {
+            for (int x=0; x<ch.w; x++) {
+              ch.value(y,x) *= q;
+            }
           }
-        }
+        });
         ch.minval *= q;
         ch.maxval *= q;
         ch.q = 1;
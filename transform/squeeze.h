@@ -36,6 +36,7 @@ SOFTWARE.
 #include "../image/image.h"
 #include "stdlib.h"
 #include "../config.h"
+#include <memory>
 
 /*
         int avg=(A+B)>>1;
@@ -76,6 +77,94 @@ inline pixel_type smooth_tendency(pixel_type B, pixel_type a, pixel_type n) {
     return diff;
 }
 
+// the same as smooth_tendency, but with selects instead of branches, so loops that use it can be vectorized
+// (the casts to pixel_type are where smooth_tendency stores into a pixel_type; the results are identical)
+inline pixel_type smooth_tendency_select(int B, int a, int n) {
+    int up = (pixel_type)((4*B - 3*n - a + 6)/12);
+    up = (up-(up&1) > 2*(B-a) ? (pixel_type)(2*(B-a)+1) : up);
+    up = (up+(up&1) > 2*(a-n) ? (pixel_type)(2*(a-n)) : up);
+    int down = (pixel_type)((4*B - 3*n - a - 6)/12);
+    down = (down+(down&1) < 2*(B-a) ? (pixel_type)(2*(B-a)-1) : down);
+    down = (down-(down&1) < 2*(a-n) ? (pixel_type)(2*(a-n)) : down);
+    bool decreasing = (B >= a) & (a >= n);
+    bool increasing = (B <= a) & (a <= n);
+    return (decreasing ? up : (increasing ? down : 0));
+}
+
+// reconstructs the first of the two values from the average and the difference (the second one is A - diff)
+inline pixel_type unsqueeze_first(int avg, pixel_type diff) {
+    return ((avg<<1)+diff+(diff>0?-(diff&1):(diff&1)))>>1;
+}
+
+inline pixel_type squeeze_average(int A, int B) {
+    return (A+B+(A>B))>>1;
+}
+
+// residuals that were not decoded are zero: then this returns NULL, and a row of zeroes
+static const pixel_type * residual_rows(const Channel &residual, int w, int h, std::vector<pixel_type> &zeroes) {
+    if (residual.w == w && residual.h >= h && residual.data.size() >= (size_t)w*h) return residual.data.data();
+    zeroes.assign(w, 0);
+    return NULL;
+}
+
+// the squeeze loops below work on rows of raw channel data (the channels are allocated), instead of calling Channel::value for every pixel;
+// the row kernels have no dependencies between neighbouring pixels and no conditional loads, so the compiler can vectorize them
+
+// one row of the inverse vertical squeeze (for the first row, p_top is p_avg)
+static void inv_vsqueeze_row(const pixel_type * RESTRICT p_avg, const pixel_type * RESTRICT p_next, const pixel_type * RESTRICT p_top,
+                             const pixel_type * RESTRICT p_residual, pixel_type * RESTRICT p_A, pixel_type * RESTRICT p_B, int w) {
+    for (int x=0; x<w; x++) {
+        pixel_type avg = p_avg[x];
+        pixel_type diff = p_residual[x] + smooth_tendency_select(p_top[x],avg,p_next[x]);
+        pixel_type A = unsqueeze_first(avg,diff);
+        p_A[x] = A;
+        p_B[x] = A-diff;
+    }
+}
+
+// one row of the forward vertical squeeze; p_nextA and p_nextB are the two rows that make up the next average
+// (for the last row they are the same row, or rows A and B again)
+template <bool first_row>
+static void fwd_vsqueeze_row(const pixel_type * RESTRICT p_A, const pixel_type * RESTRICT p_B, const pixel_type * RESTRICT p_top,
+                             const pixel_type * RESTRICT p_nextA, const pixel_type * RESTRICT p_nextB,
+                             pixel_type * RESTRICT p_avg, pixel_type * RESTRICT p_residual, int w) {
+    for (int x=0; x<w; x++) {
+        pixel_type A = p_A[x];
+        pixel_type B = p_B[x];
+        pixel_type avg = squeeze_average(A,B);
+        pixel_type next_avg = squeeze_average(p_nextA[x],p_nextB[x]);
+        pixel_type top = (first_row ? avg : p_top[x]);
+        p_residual[x] = (pixel_type)(A-B) - smooth_tendency_select(top,avg,next_avg);
+        p_avg[x] = avg;
+    }
+}
+
+// residuals x = 1 .. n-1 of one row of the forward horizontal squeeze (given the averages)
+static void fwd_hsqueeze_row(const pixel_type * RESTRICT p_in, const pixel_type * RESTRICT p_avg, pixel_type * RESTRICT p_residual, int n) {
+    for (int x=1; x<n; x++) {
+        p_residual[x] = (pixel_type)(p_in[x*2] - p_in[x*2+1]) - smooth_tendency_select(p_in[x*2-1],p_avg[x],p_avg[x+1]);
+    }
+}
+
+static void squeeze_average_row(const pixel_type * RESTRICT p_in, pixel_type * RESTRICT p_avg, int n) {
+    for (int x=0; x<n; x++) p_avg[x] = squeeze_average(p_in[x*2], p_in[x*2+1]);
+}
+
+// one row of the inverse horizontal squeeze
+// (every pair depends on the previous one through 'left', so this loop stays serial, and branches are cheaper than selects)
+static void inv_hsqueeze_row(const pixel_type * RESTRICT p_avg, const pixel_type * RESTRICT p_residual, pixel_type * RESTRICT p_out, int avg_w, int residual_w) {
+    for (int x=0; x<residual_w; x++) {
+        pixel_type avg = p_avg[x];
+        pixel_type next_avg = (x+1<avg_w ? p_avg[x+1] : avg);
+        pixel_type left = (x ? p_out[(x<<1)-1] : avg);
+        pixel_type diff = p_residual[x] + smooth_tendency(left,avg,next_avg);
+        pixel_type A = unsqueeze_first(avg,diff);
+        p_out[x<<1] = A;
+        p_out[(x<<1)+1] = A-diff;
+    }
+    if ((avg_w + residual_w) & 1) p_out[avg_w+residual_w-1] = p_avg[avg_w-1];
+}
+
 void inv_hsqueeze(Image &input, int c, int rc) ATTRIBUTE_HOT;
 
 void inv_hsqueeze(Image &input, int c, int rc) {
@@ -85,50 +174,18 @@ void inv_hsqueeze(Image &input, int c, int rc) {
     chout.component = chin.component;
     v_printf(4,"Undoing horizontal squeeze of channel %i using residuals in channel %i (going from width %i to %i)\n",c,rc,chin.w,chout.w);
 
-    for (int y=0; y<chin.h; y++) {
-      pixel_type avg = chin.value_nocheck(y,0);
-      pixel_type next_avg = (1<chin.w ? next_avg = chin.value_nocheck(y,1) : avg);
-      pixel_type tendency=smooth_tendency(avg,avg,next_avg);
-      pixel_type diff = chin_residual.value(y,0) + tendency;
-      pixel_type A = ((avg<<1)+diff+(diff>0?-(diff&1):(diff&1)))>>1;
-      pixel_type B = A-diff;
-      chout.value(y,0) = A;
-      chout.value(y,1) = B;
-      for (int x=1; x<chin_residual.w; x++) {
-        pixel_type diff_minus_tendency = chin_residual.value(y,x);
-        pixel_type avg = chin.value_nocheck(y,x);
-        pixel_type next_avg = (x+1<chin.w ? next_avg = chin.value_nocheck(y,x+1) : avg);
-        pixel_type left = chout.value_nocheck(y,(x<<1)-1);
-        pixel_type tendency=smooth_tendency(left,avg,next_avg);
-        pixel_type diff = diff_minus_tendency + tendency;
-//        pixel_type A = ((avg<<1)+diff+(diff&1))>>1;
-        pixel_type A = ((avg<<1)+diff+(diff>0?-(diff&1):(diff&1)))>>1;
-        chout.value(y,x<<1) = A;
-        pixel_type B = A-diff;
-        chout.value(y,(x<<1)+1) = B;
-//        if (c==2 && chin.w == 1352 && x > 180 && x < 185 && y > 118 && y < 121) printf("Cg = avg=%i, diff=%i=%i+%i, A=%i,B=%i\n",avg,diff,diff_minus_tendency,tendency,A,B);
-      }
-/*
-      for (int x=1; x<chin_residual.w; x++) {
-        pixel_type diff_minus_tendency = chin_residual.value(y,x);
-        pixel_type avg = chin.value(y,x);
-
-        pixel_type next_avg = (x+1<chin.w ? chin.value(y,x+1) : avg);
-        pixel_type leftleft = (x>0 ? chout.value(y,x*2-2) : avg);
-        pixel_type left = (x>0 ? chout.value(y,x*2-1) : avg);
-        pixel_type tendency=smooth_tendency(leftleft,left,avg,next_avg);
-
-        pixel_type diff = diff_minus_tendency + tendency;
-
-        pixel_type A = ((avg<<1)+diff+(diff&1))>>1;
-        pixel_type B = A-diff;
-        chout.value(y,x*2) = A;
-        chout.value(y,x*2+1) = B;
-      }
-*/
-      if (chout.w & 1) chout.value(y,chout.w-1) = chin.value(y,chin.w-1);
+    std::vector<pixel_type> zeroes;
+    const pixel_type *residuals = residual_rows(chin_residual, chin_residual.w, chin.h, zeroes);
+    // rows are independent, so they are done in parallel bands
+    parallel_for(0, chin.h, band_rows(chout.w), [&](int y0, int y1) {
+    for (int y=y0; y<y1; y++) {
+      const pixel_type *p_avg = chin.data.data() + (size_t)y*chin.w;
+      const pixel_type *p_residual = (residuals ? residuals + (size_t)y*chin_residual.w : zeroes.data());
+      pixel_type *p_out = chout.data.data() + (size_t)y*chout.w;
+      inv_hsqueeze_row(p_avg, p_residual, p_out, chin.w, chin_residual.w);
     }
-    input.channel[c] = chout;
+    });
+    input.channel[c] = std::move(chout);
 }
 
 
@@ -142,31 +199,26 @@ void fwd_hsqueeze(Image &input, int c, int rc) {
     chout.component = chin.component;
     chout_residual.component = chin.component;
 
+    const int n = chout_residual.w;
+    if (n > 0)
     for (int y=0; y<chout.h; y++) {
-      for (int x=0; x<chout_residual.w; x++) {
-        pixel_type A = chin.value(y,x*2);
-        pixel_type B = chin.value(y,x*2+1);
-        pixel_type avg = (A+B+(A>B))>>1;
-        chout.value(y,x) = avg;
-        pixel_type diff = A-B;
-        pixel_type next_avg = avg;
-        if (x+1<chout_residual.w) next_avg = (chin.value(y,x*2+2) + chin.value(y,x*2+3) + (chin.value(y,x*2+2) > chin.value(y,x*2+3))) >> 1;  // which will be chout.value(y,x+1)
-        else if (chin.w & 1) next_avg = (chin.value(y,x*2+2));
-
-        pixel_type left = (x>0 ? chin.value(y,x*2-1) : avg);
-        pixel_type tendency=smooth_tendency(left,avg,next_avg);
-
-        chout_residual.value(y,x) = diff-tendency;
-
-      }
-      if (chin.w & 1) {
-        int x = chout.w-1;
-        chout.value(y,x) = chin.value(y,x*2);
+      const pixel_type *p_in = chin.data.data() + (size_t)y*chin.w;
+      pixel_type *p_avg = chout.data.data() + (size_t)y*chout.w;
+      pixel_type *p_residual = chout_residual.data.data() + (size_t)y*n;
+      squeeze_average_row(p_in, p_avg, n);
+      if (chin.w & 1) p_avg[chout.w-1] = p_in[chin.w-1];
+      // the first and the last residual have no left neighbour or no next average
+      pixel_type last_next = (n<chout.w ? p_avg[n] : p_avg[n-1]);
+      p_residual[0] = (pixel_type)(p_in[0] - p_in[1]) - smooth_tendency(p_avg[0],p_avg[0],(n>1 ? p_avg[1] : last_next));
+      if (n > 1) {
+        fwd_hsqueeze_row(p_in, p_avg, p_residual, n-1);
+        p_residual[n-1] = (pixel_type)(p_in[n*2-2] - p_in[n*2-1]) - smooth_tendency(p_in[n*2-3],p_avg[n-1],last_next);
       }
     }
-    input.channel[c] = chout;
+    else if (chin.w & 1) for (int y=0; y<chout.h; y++) chout.data[y] = chin.data[y];
+    input.channel[c] = std::move(chout);
 //    chout_residual.actual_minmax(&chout_residual.minval, &chout_residual.maxval);
-    input.channel.insert(input.channel.begin()+rc, chout_residual);
+    input.channel.insert(input.channel.begin()+rc, std::move(chout_residual));
 }
 
 void inv_vsqueeze(Image &input, int c, int rc) ATTRIBUTE_HOT;
@@ -177,89 +229,164 @@ void inv_vsqueeze(Image &input, int c, int rc) {
     chout.component = chin.component;
     v_printf(4,"Undoing vertical squeeze of channel %i using residuals in channel %i (going from height %i to %i)\n",c,rc,chin.h,chout.h);
 
-      for (int x=0; x<chin.w; x++) {
-        pixel_type diff_minus_tendency = chin_residual.value(0,x);
-        pixel_type avg = chin.value_nocheck(0,x);
-
-        pixel_type next_avg = avg;
-        if (1<chin.h) next_avg = chin.value_nocheck(1,x);
-
-        pixel_type tendency=smooth_tendency(avg,avg,next_avg);
-
-        pixel_type diff = diff_minus_tendency + tendency;
-
-        pixel_type A = ((avg<<1)+diff+(diff>0?-(diff&1):(diff&1)))>>1;
-        chout.value(0,x) = A;
-        pixel_type B = A-diff;
-        chout.value(1,x) = B;
-      }
-
-    for (int y=1; y<chin_residual.h; y++) {
-      for (int x=0; x<chin.w; x++) {
-        pixel_type diff_minus_tendency = chin_residual.value(y,x);
-        pixel_type avg = chin.value_nocheck(y,x);
+    const int w = chin.w;
+    std::vector<pixel_type> zeroes;
+    const pixel_type *residuals = residual_rows(chin_residual, w, chin_residual.h, zeroes);
+    for (int y=0; y<chin_residual.h; y++) {
+      const pixel_type *p_avg = chin.data.data() + (size_t)y*w;
+      pixel_type *p_A = chout.data.data() + (size_t)(y<<1)*w;
+      inv_vsqueeze_row(p_avg, (y+1<chin.h ? p_avg + w : p_avg), (y ? p_A - w : p_avg),
+                       (residuals ? residuals + (size_t)y*w : zeroes.data()), p_A, p_A + w, w);
+    }
+    if (chout.h & 1) std::copy_n(chin.data.data() + (size_t)(chin.h-1)*w, w, chout.data.data() + (size_t)(chout.h-1)*w);
+    input.channel[c] = std::move(chout);
+}
 
-        pixel_type next_avg = avg;
-        if (y+1<chin.h) next_avg = chin.value_nocheck(y+1,x);
 
-//        pixel_type top = (y>0 ? chout.value_nocheck((y<<1)-1,x) : avg);
-        pixel_type top = chout.value_nocheck((y<<1)-1,x);
-        pixel_type tendency=smooth_tendency(top,avg,next_avg);
+// Row by row unsqueezing (so it can be fused with the final color transform, see Image::prepare_rows): the last two steps of
+// every channel, which produce the largest channels, are not done in advance but produce their rows when they are needed.
+// Every step keeps the last few rows it produced for the next step; the last step writes them in the output channel.
+struct unsqueeze_rows {
+    bool horizontal;
+    Channel avg;                            // the input of the step, unless it is produced by a previous step
+    std::shared_ptr<unsqueeze_rows> prev;
+    Channel residual;
+    const pixel_type *residuals;            // NULL if the residuals were not decoded (then they are zero)
+    int in_w, in_h, w, h;                   // size of the input and of the output
+    int done;                               // number of rows produced so far
+    std::vector<pixel_type> ring, zeroes;   // the last 4 rows that were produced (if they do not go to the output channel)
+
+    void start() {
+        residuals = (horizontal ? residual_rows(residual, residual.w, in_h, zeroes) : residual_rows(residual, in_w, residual.h, zeroes));
+        ring.resize((size_t)4*w);
+        done = 0;
+    }
+    const pixel_type *input_row(int y) { return (prev ? prev->row(y, NULL) : avg.data.data() + (size_t)y*in_w); }
+    const pixel_type *residual_row(int y) const { return (residuals ? residuals + (size_t)y*residual.w : zeroes.data()); }
+    pixel_type *output_row(pixel_type *out, int y) { return (out ? out + (size_t)y*w : ring.data() + (size_t)(y&3)*w); }
 
-        pixel_type diff = diff_minus_tendency + tendency;
+    // produces the rows up to row y (in 'out' if it is set, otherwise in the ring) and returns row y
+    const pixel_type *row(int y, pixel_type *out) {
+        while (done <= y) {
+            if (horizontal) {
+                inv_hsqueeze_row(input_row(done), residual_row(done), output_row(out, done), in_w, residual.w);
+                done++;
+            } else if (done < 2*residual.h) {
+                int k = done >> 1;
+                const pixel_type *p_avg = input_row(k);
+                const pixel_type *p_next = (k+1 < in_h ? input_row(k+1) : p_avg);
+                // the previous row comes from the ring, since the rows in the output channel can be changed in the meantime (see Image::undo_rows)
+                const pixel_type *p_top = (k ? ring.data() + (size_t)((done-1)&3)*w : p_avg);
+                pixel_type *p_B = output_row(out, done+1);
+                inv_vsqueeze_row(p_avg, p_next, p_top, residual_row(k), output_row(out, done), p_B, w);
+                if (out) std::copy_n(p_B, w, ring.data() + (size_t)((done+1)&3)*w);
+                done += 2;
+            } else {
+                // odd height: the last row is the last row of averages
+                std::copy_n(input_row(in_h-1), w, output_row(out, done));
+                done++;
+            }
+        }
+        return output_row(out, y);
+    }
+};
+
+// sets up row by row unsqueezing: the other steps are done as usual, the channels get their final size (without data)
+// and input.row_sources produces their rows; returns false (without changing anything) if the usual inverse has to be used
+bool begin_inv_squeeze_rows(Image &input, const std::vector<int> &parameters) {
+    if (!parameters.size() || parameters.size() % 3) return false;
+    // the number of steps of every channel (and a check of the channel numbers)
+    std::vector<int> steps(input.channel.size(), 0);
+    int nb = input.channel.size();
+    for (int i=parameters.size()-3; i>=0; i-=3) {
+        int beginc = parameters[i+1];
+        int endc = parameters[i+2];
+        int offset = (parameters[i] & 2 ? input.nb_meta_channels + input.nb_channels : endc+1);
+        if (beginc < 0 || beginc > endc || endc >= offset || offset+endc-beginc >= nb) return false;
+        for (int c=beginc; c<=endc; c++) steps[c]++;
+        nb -= endc-beginc+1;
+    }
 
-        pixel_type A = ((avg<<1)+diff+(diff>0?-(diff&1):(diff&1)))>>1;
-        chout.value(y<<1,x) = A;
-        pixel_type B = A-diff;
-        chout.value((y<<1)+1,x) = B;
-      }
+    std::vector<std::shared_ptr<unsqueeze_rows>> stage(input.channel.size());
+    for (int i=parameters.size()-3; i>=0; i-=3) {
+        bool horizontal = parameters[i]&1; // 0=vertical, 1=horizontal
+        int beginc = parameters[i+1];
+        int endc = parameters[i+2];
+        int offset = (parameters[i] & 2 ? input.nb_meta_channels + input.nb_channels : endc+1);
+        for (int c=beginc; c<=endc; c++) {
+            int rc = offset+c-beginc;
+            if (--steps[c] >= 2) {
+                input.channel[c].allocate();
+                if (horizontal) inv_hsqueeze(input, c, rc);
+                else inv_vsqueeze(input, c, rc);
+                continue;
+            }
+            v_printf(4,"Undoing %s squeeze of channel %i using residuals in channel %i (row by row)\n",horizontal ? "horizontal" : "vertical",c,rc);
+            Channel &ch = input.channel[c];
+            std::shared_ptr<unsqueeze_rows> s = std::make_shared<unsqueeze_rows>();
+            s->horizontal = horizontal;
+            s->residual = std::move(input.channel[rc]);
+            s->in_w = ch.w;
+            s->in_h = ch.h;
+            s->w = (horizontal ? ch.w + s->residual.w : ch.w);
+            s->h = (horizontal ? ch.h : ch.h + s->residual.h);
+            Channel out(0,0,ch.minval,ch.maxval,ch.q,ch.hshift-horizontal,ch.vshift-!horizontal,ch.hcshift-horizontal,ch.vcshift-!horizontal);
+            out.w = s->w;
+            out.h = s->h;
+            out.component = ch.component;
+            if (stage[c]) s->prev = stage[c];
+            else {
+                // residuals that were not decoded are zero, but the averages are needed
+                ch.allocate();
+                s->avg = std::move(ch);
+            }
+            s->start();
+            input.channel[c] = std::move(out);
+            stage[c] = s;
+        }
+        input.channel.erase(input.channel.begin()+offset,input.channel.begin()+offset+(endc-beginc+1));
     }
-    if (chout.h & 1) { int y = chin.h-1;
-      for (int x=0; x<chin.w; x++) {
-        pixel_type avg = chin.value(y,x);
-        chout.value(y<<1,x) = avg;
-      }
+    input.row_sources.resize(input.channel.size());
+    for (int c=0; c<input.channel.size(); c++) {
+        if (!stage[c]) continue;
+        std::shared_ptr<unsqueeze_rows> s = stage[c];
+        input.row_sources[c] = [s](Channel &out, int n) {
+            out.allocate();
+            if (std::min(n, s->h) > 0) s->row(std::min(n, s->h) - 1, out.data.data());
+        };
     }
-    input.channel[c] = chout;
+    return true;
 }
 
-
+// done in place: row y of the averages only needs rows 2y-1 .. 2y+3 of the input, which are not overwritten yet
 void fwd_vsqueeze(Image &input, int c, int rc) {
-    const Channel &chin = input.channel[c];
+    Channel &ch = input.channel[c];
 
     v_printf(4,"Doing vertical squeeze of channel %i to new channel %i\n",c,rc);
 
-    Channel chout(chin.w,(chin.h+1)/2, chin.minval, chin.maxval, chin.q, chin.hshift,chin.vshift+1,chin.hcshift,chin.vcshift+1);
-    Channel chout_residual(chin.w,chin.h-chout.h,chout.minval-chout.maxval,chout.maxval-chout.minval,1, chin.hshift,chin.vshift+1,chin.hcshift,chin.vcshift);
-    chout.component = chin.component;
-    chout_residual.component = chin.component;
+    const int w = ch.w, h = ch.h, outh = (h+1)/2;
+    Channel chout_residual(w,h-outh,ch.minval-ch.maxval,ch.maxval-ch.minval,1, ch.hshift,ch.vshift+1,ch.hcshift,ch.vcshift);
+    chout_residual.component = ch.component;
+    pixel_type *data = ch.data.data();
+    std::vector<pixel_type> avg(w);     // the rows of averages overlap the input rows, so they are written after each row
     for (int y=0; y<chout_residual.h; y++) {
-      for (int x=0; x<chout.w; x++) {
-        pixel_type A = chin.value(y*2,x);
-        pixel_type B = chin.value(y*2+1,x);
-        pixel_type avg = (A+B+(A>B))>>1;
-        chout.value(y,x) = avg;
-        pixel_type diff = A-B;
-
-        pixel_type next_avg = avg;
-        if (y+1<chout_residual.h) next_avg = (chin.value(y*2+2,x) + chin.value(y*2+3,x) + (chin.value(y*2+2,x) > chin.value(y*2+3,x))) >> 1; // which will be chout.value(y+1,x)
-        else if (chin.h & 1) next_avg = (chin.value(y*2+2,x));
-
-        pixel_type top = (y>0 ? chin.value(y*2-1,x) : avg);
-        pixel_type tendency=smooth_tendency(top,avg,next_avg);
-
-        chout_residual.value(y,x) = diff - tendency;
-      }
+      const pixel_type *p_A = data + (size_t)(y*2)*w;
+      const pixel_type *p_B = p_A + w;
+      const pixel_type *p_nextA = p_A, *p_nextB = p_B;
+      if (y+1<chout_residual.h) { p_nextA = p_B + w; p_nextB = p_B + 2*w; }
+      else if (h & 1) { p_nextA = p_nextB = p_B + w; }
+      pixel_type *p_residual = chout_residual.data.data() + (size_t)y*w;
+      if (y) fwd_vsqueeze_row<false>(p_A, p_B, p_A - w, p_nextA, p_nextB, avg.data(), p_residual, w);
+      else fwd_vsqueeze_row<true>(p_A, p_B, p_A, p_nextA, p_nextB, avg.data(), p_residual, w);
+      std::copy_n(avg.data(), w, data + (size_t)y*w);
     }
-    if (chin.h & 1) { int y = chout.h-1;
-      for (int x=0; x<chout.w; x++) {
-        pixel_type avg = chin.value(y*2,x);
-        chout.value(y,x) = avg;
-      }
-    }
-    input.channel[c] = chout;
+    if ((h & 1) && h > 1) std::copy_n(data + (size_t)(h-1)*w, w, data + (size_t)(outh-1)*w);
+    ch.h = outh;
+    ch.vshift++;
+    ch.vcshift++;
+    ch.data.resize((size_t)w*outh);
 //    chout_residual.actual_minmax(&chout_residual.minval, &chout_residual.maxval);
-    input.channel.insert(input.channel.begin()+rc, chout_residual);
+    input.channel.insert(input.channel.begin()+rc, std::move(chout_residual));
 }
 
 
@@ -328,8 +455,16 @@ void meta_squeeze(Image &image, std::vector<int> &parameters) {
         bool in_place = !(parameters[i] & 2);
         int beginc = parameters[i+1];
         int endc = parameters[i+2];
+        if (beginc < 0 || beginc > endc || endc >= image.channel.size()) {
+            e_printf("Error: squeeze transform with incorrect parameters.\n");
+            image.error = true; return;
+        }
         int offset;
         if (in_place) offset = endc+1; else offset = image.nb_meta_channels + image.nb_channels;
+        if (offset > image.channel.size()) {
+            e_printf("Error: squeeze transform with incorrect parameters.\n");
+            image.error = true; return;
+        }
         int nb_chans = endc-beginc+1;
         for (int c=beginc; c<=endc; c++) {
             Channel dummy;
@@ -376,11 +511,8 @@ bool squeeze(Image &input, bool inverse, std::vector<int> &parameters) {
         int offset;
         if (in_place) offset = endc+1; else offset = input.nb_meta_channels + input.nb_channels;
         for (int c=beginc; c<=endc; c++) {
-            if (input.channel[offset+c-beginc].data.size() == 0) {
-                // stop unsqueezing luma; keep unsqueezing chroma channels
-//                if (input.channel[beginc].w == input.channel[c].w && input.channel[beginc].h == input.channel[c].h) continue;
-                input.channel[offset+c-beginc].resize();
-            }
+            // residuals that were not decoded are zero (Channel::value takes care of that), but the averages are needed
+            input.channel[c].allocate();
             if (horizontal) inv_hsqueeze(input, c, offset+c-beginc);
             else inv_vsqueeze(input, c, offset+c-beginc);
         }
@@ -399,6 +531,7 @@ bool squeeze(Image &input, bool inverse, std::vector<int> &parameters) {
         if (in_place) offset = endc+1; else offset = input.nb_meta_channels + input.nb_channels;
         int nb_chans = endc-beginc+1;
         for (int c=beginc; c<=endc; c++) {
+            input.channel[c].allocate();
             if (horizontal) fwd_hsqueeze(input, c, offset+c-beginc);
             else fwd_vsqueeze(input, c, offset+c-beginc);
         }
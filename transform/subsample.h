@@ -26,6 +26,7 @@ SOFTWARE.
 
 #include "../image/image.h"
 #include "../io.h"
+#include "../config.h"
 
 // JPEG-style (chroma) subsampling. Parameters are: [begin_channel], [end_channel], [sample_ratio_h], [sample_ratio_v], ...
 // e.g. 1, 2, 2 corresponds to 4:2:0
@@ -69,8 +70,56 @@ void check_subsample_parameters(std::vector<int> &parameters) {
 }
 
 
-// simple upscaling; TODO: fancy upscaling
+// 'fancy' (triangle filter) 2x upscaling, one row at a time: every input sample gives two output samples,
+// each 3/4 of the input sample and 1/4 of its neighbor on that side (the edge is repeated)
+static void upsample_h2_row(const pixel_type * RESTRICT in, pixel_type * RESTRICT out, int ow) {
+    out[0] = (3*in[0] + in[0] + 1)>>2;
+    out[2*ow-1] = (3*in[ow-1] + in[ow-1] + 2)>>2;
+    if (ow == 1) return;
+    out[1] = (3*in[0] + in[1] + 2)>>2;
+    out[2*ow-2] = (3*in[ow-1] + in[ow-2] + 1)>>2;
+    for (int x=1; x<ow-1; x++) {
+        out[2*x] =   (3*in[x] + in[x-1] + 1)>>2;
+        out[2*x+1] = (3*in[x] + in[x+1] + 2)>>2;
+    }
+}
+
+static void upsample_v2_row(const pixel_type * RESTRICT near, const pixel_type * RESTRICT far, pixel_type * RESTRICT out, int w, int round) {
+    for (int x=0; x<w; x++) out[x] = (3*near[x] + far[x] + round)>>2;
+}
+
+// row y of the channel upscaled by srh x srv (1 or 2); tmp needs room for two rows of the upscaled width
+static void upsample_row(const Channel &in, int srh, int srv, int y, pixel_type *out, pixel_type *tmp) {
+    int ow = in.w;
+    int oh = in.h;
+    int w = ow*srh;
+    auto hrow = [&](int sy, pixel_type *buf) -> const pixel_type * {
+        const pixel_type *p = &in.data[(size_t)sy*ow];
+        if (srh == 1) return p;
+        upsample_h2_row(p, buf, ow);
+        return buf;
+    };
+    if (srv == 1) {
+        const pixel_type *p = hrow(y, out);
+        if (p != out) std::copy(p, p+w, out);
+        return;
+    }
+    // the horizontal upscaling is done first, so the result is the same as when upscaling a whole channel at once
+    int sy = y>>1;
+    if (y & 1) upsample_v2_row(hrow(sy, tmp), hrow(sy+1<oh ? sy+1 : sy, tmp+w), out, w, 2);
+    else       upsample_v2_row(hrow(sy, tmp), hrow(sy ? sy-1 : 0, tmp+w), out, w, 1);
+}
+
+// upscaling that was set up by begin_inv_subsample_rows() gets undone when the whole transform is undone
+static void end_inv_subsample_rows(Image &input) {
+    for (int c=0; c<input.subsampled.size(); c++) {
+        if (input.subsampled[c].w) input.channel[c] = std::move(input.subsampled[c]);
+    }
+    input.subsampled.clear();
+}
+
 bool inv_subsample(Image &input, std::vector<int> parameters) {
+    end_inv_subsample_rows(input);
     check_subsample_parameters(parameters);
 
     for (int i=0; i<parameters.size(); i+=4) {
@@ -88,30 +137,8 @@ bool inv_subsample(Image &input, std::vector<int> parameters) {
          }
          Channel channel(ow*srh,oh*srv,input.channel[c].minval,input.channel[c].maxval);
          if (srv <= 2 && srh <= 2) {
-          // 'fancy' horizontal upscale
-          if (srh == 2) {
-           for (int y=0; y<oh; y++) {
-            for (int x=0; x<ow; x++) {
-             channel.value(y*srv,x*srh) =   (3*input.channel[c].value(y,x) + input.channel[c].value(y,(x?x-1:0)) + 1)>>2;
-             channel.value(y*srv,x*srh+1) = (3*input.channel[c].value(y,x) + input.channel[c].value(y,(x+1<ow?x+1:x)) + 2)>>2;
-            }
-           }
-          } else {
-           for (int y=0; y<oh; y++) {
-            for (int x=0; x<ow; x++) {
-             channel.value(y*srv,x) = input.channel[c].value(y,x);
-            }
-           }
-          }
-          if (srv == 2) {
-           Channel orig = channel;
-           for (int y=0; y<oh; y++) {
-            for (int x=0; x<ow*srh; x++) {
-             channel.value(y*srv,x) =   (3*orig.value(y*srv,x) + orig.value((y?(y-1)*srv:0),x) + 1)>>2;
-             channel.value(y*srv+1,x) = (3*orig.value(y*srv,x) + orig.value((y+1<oh?(y+1)*srv:y*srv),x) + 2)>>2;
-            }
-           }
-          }
+          std::vector<pixel_type> tmp(2*channel.w);
+          for (int y=0; y<channel.h; y++) upsample_row(input.channel[c], srh, srv, y, &channel.data[(size_t)y*channel.w], tmp.data());
          } else {
          // simple box filter upscaling. fancier upscaling could be done too...
           for (int y=0; y<oh*srv; y++) {
@@ -121,12 +148,48 @@ bool inv_subsample(Image &input, std::vector<int> parameters) {
           }
          }
          v_printf(5,"Upscaled channel %i from %ix%i to %ix%i\n",c,input.channel[c].w,input.channel[c].h,channel.w,channel.h);
-         input.channel[c] = channel;
+         input.channel[c] = std::move(channel);
         }
     }
     return true;
 }
 
+// Row by row upscaling (so it can be fused with the final color transform, see Image::undo_rows):
+// the channels get their upscaled size (as output buffers), while the original ones are kept in input.subsampled
+bool begin_inv_subsample_rows(Image &input, std::vector<int> parameters) {
+    check_subsample_parameters(parameters);
+    for (int i=0; i<parameters.size(); i+=4) {
+        if (parameters[i+2] > 2 || parameters[i+3] > 2) return false;
+    }
+    end_inv_subsample_rows(input);
+    input.subsampled.resize(input.channel.size());
+    for (int i=0; i<parameters.size(); i+=4) {
+        int srh = parameters[i+2];
+        int srv = parameters[i+3];
+        for (int c=parameters[i+0]; c<=parameters[i+1]; c++) {
+            int ow = input.channel[c].w;
+            int oh = input.channel[c].h;
+            if (ow >= input.channel[input.nb_meta_channels].w && oh >= input.channel[input.nb_meta_channels].h) continue;
+            Channel channel(ow*srh,oh*srv,input.channel[c].minval,input.channel[c].maxval);
+            v_printf(5,"Upscaling channel %i from %ix%i to %ix%i (row by row)\n",c,ow,oh,channel.w,channel.h);
+            input.subsampled[c] = std::move(input.channel[c]);
+            input.channel[c] = std::move(channel);
+        }
+    }
+    return true;
+}
+
+void inv_subsample_row(Image &input, int y) {
+    static thread_local std::vector<pixel_type> tmp;
+    for (int c=0; c<input.subsampled.size(); c++) {
+        const Channel &in = input.subsampled[c];
+        Channel &out = input.channel[c];
+        if (!in.w || y >= out.h) continue;
+        if (tmp.size() < 2*out.w) tmp.resize(2*out.w);
+        upsample_row(in, out.w / in.w, out.h / in.h, y, &out.data[(size_t)y*out.w], tmp.data());
+    }
+}
+
 bool fwd_subsample(Image &input, const std::vector<int> &parameters) {
     return false; // TODO (not really needed though; subsampling is useful if the input data is a JPEG or YUV, but then the transform is already done)
                     // for non-subsampled input it's probably better to just stick to 4:4:4 (and quantize most of the chroma details away)
@@ -140,8 +203,10 @@ void meta_subsample(Image &input, std::vector<int> parameters) {
         int c2 = parameters[i+1];
         int srh = parameters[i+2];
         int srv = parameters[i+3];
-        assert (srh == 1 || srh == 2);
-        assert (srv == 1 || srv == 2);
+        if (c1 < 0 || c1 > c2 || c2 >= input.channel.size() || (srh != 1 && srh != 2) || (srv != 1 && srv != 2)) {
+            e_printf("Error: invalid parameters for subsampling.\n");
+            input.error = true; return;
+        }
         int srhshift = (srh==1?0:1);
         int srvshift = (srv==1?0:1);
         for (int c=c1; c<=c2; c++) {
@@ -39,20 +39,24 @@ SOFTWARE.
 #include "permute.h"
 #include "approximate.h"
 
-//#include "xyb.h"
+#include "xyb.h"
 
 
 const std::vector<std::string> transform_name = {"YCbCr", "YCoCg", "ICtCp [TODO]", "ChromaSubsampling", "DCT", "Quantization", "Palette", "Squeeze", "Matching", "Permutation", "Approximation", "XYB"};
 
 
 bool Transform::apply(Image &input, bool inverse) {
+    if (inverse && ID != TRANSFORM_SQUEEZE && ID != TRANSFORM_QUANTIZE && ID != TRANSFORM_DCT) {
+        // squeeze, quantization and DCT deal with missing channel data themselves, other transforms need all of it
+        for (int i=0; i<input.channel.size(); i++) input.channel[i].allocate();
+    }
     switch(ID) {
         case TRANSFORM_YCbCr: return YCbCr(input, inverse);
         case TRANSFORM_ChromaSubsample: return subsample(input, inverse, parameters);
         case TRANSFORM_DCT: return DCT(input, inverse, parameters);
         case TRANSFORM_QUANTIZE: return quantize(input, inverse, parameters);
         case TRANSFORM_YCoCg: return YCoCg(input, inverse);
-//        case TRANSFORM_XYB: return XYB(input, inverse);
+        case TRANSFORM_XYB: return XYB(input, inverse);
         case TRANSFORM_SQUEEZE: return squeeze(input, inverse, parameters);
         case TRANSFORM_PALETTE: return palette(input, inverse, parameters);
         case TRANSFORM_2DMATCH: return match(input, inverse, parameters);
@@ -62,12 +66,38 @@ bool Transform::apply(Image &input, bool inverse) {
     }
 }
 
+bool Transform::begin_row_inverse(Image &input) const {
+    switch(ID) {
+        case TRANSFORM_SQUEEZE: return begin_inv_squeeze_rows(input, parameters);
+        case TRANSFORM_DCT: return begin_inv_DCT_rows(input, parameters);
+        default: break;
+    }
+    for (int i=0; i<input.channel.size(); i++) input.channel[i].allocate();
+    switch(ID) {
+        case TRANSFORM_YCbCr: return check_inv_YCbCr(input);
+        case TRANSFORM_YCoCg: return check_inv_YCoCg(input);
+        case TRANSFORM_XYB: return check_inv_XYB(input);
+        case TRANSFORM_ChromaSubsample: return begin_inv_subsample_rows(input, parameters);
+        default: e_printf("Transformation %s cannot be undone row by row\n",name()); return false;
+    }
+}
+
+void Transform::inverse_row(Image &input, int y) const {
+    switch(ID) {
+        case TRANSFORM_YCbCr: inv_YCbCr_row(input, y); return;
+        case TRANSFORM_YCoCg: inv_YCoCg_row(input, y); return;
+        case TRANSFORM_XYB: inv_XYB_row(input, y); return;
+        case TRANSFORM_ChromaSubsample: inv_subsample_row(input, y); return;
+        default: return;
+    }
+}
+
 
 void Transform::meta_apply(Image &input) {
     switch(ID) {
         case TRANSFORM_YCbCr: return;
         case TRANSFORM_YCoCg: return;
-//        case TRANSFORM_XYB: return;
+        case TRANSFORM_XYB: return;
         case TRANSFORM_ChromaSubsample: meta_subsample(input, parameters); return;
         case TRANSFORM_DCT: meta_DCT(input, parameters); return;
         case TRANSFORM_QUANTIZE: return;
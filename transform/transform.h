@@ -82,6 +82,12 @@ public:
     Transform(int id) : ID(id) {}
     bool apply(Image &input, bool inverse);
     void meta_apply(Image &input);
+    // color transforms and chroma upsampling can also be undone one row at a time (see Image::undo_rows)
+    bool has_row_inverse() const { return ID == TRANSFORM_YCoCg || ID == TRANSFORM_YCbCr || ID == TRANSFORM_XYB || ID == TRANSFORM_ChromaSubsample; }
+    // the inverse DCT and the last steps of a squeeze can produce their rows on demand (see Image::prepare_rows)
+    bool has_row_source_inverse() const { return ID == TRANSFORM_SQUEEZE || ID == TRANSFORM_DCT; }
+    bool begin_row_inverse(Image &input) const;
+    void inverse_row(Image &input, int y) const;
     bool has_parameters() const {
         switch(ID) {
             case TRANSFORM_ChromaSubsample:
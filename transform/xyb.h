@@ -4,6 +4,8 @@
 #include "../image/image.h"
 #include "../io.h"
 #include "../config.h"
+#include <cmath>
+#include <vector>
 
 #define SRGB_TO_LINEAR(c)  ((c <= 0.04045 ? c / 12.92 : pow((c + 0.055) / 1.055, 2.4)))
 #define LINEAR_TO_SRGB(c)  ((c < 0.0031308 ? 12.92 * c : 1.055 * pow(c,1.0/2.4) - 0.055))
@@ -26,123 +28,171 @@ static const float kOpsinAbsorbanceInvMatrix[9] = {
 };
 
 
-bool inv_XYB(Image &input) ATTRIBUTE_HOT;
-bool inv_XYB(Image &input) {
-    int nb_channels = input.channel.size();
+// sRGB transfer function (scaled to 0..maxval) as a table of n+1 samples of the linear range 0..1, to be interpolated linearly;
+// the sRGB curve has a linear toe so its slope is bounded, and the interpolation error is well below one output step
+struct linear_to_srgb_table {
+    int maxval = -1;
+    int n;
+    std::vector<float> value;
+    void init(int mv) {
+        if (mv == maxval) return;
+        maxval = mv;
+        n = 4096;
+        while (n < 65536 && n < 16*(maxval+1)) n *= 2;
+        value.resize(n+2);
+        for (int i=0; i<=n; i++) { double c = (double)i/n; value[i] = LINEAR_TO_SRGB(c) * maxval; }
+        value[n+1] = value[n];
+    }
+};
+
+// number of pixels done at a time by the row functions (intermediate values are kept on the stack)
+#define XYB_CHUNK 256
+
+bool check_inv_XYB(const Image &input) {
+    int m = input.nb_meta_channels;
+    int nb_channels = input.nb_channels;
     if (nb_channels < 3) {
         e_printf("Invalid number of channels to apply inverse XYB.\n");
         return false;
     }
-    int w = input.channel[0].w;
-    int h = input.channel[0].h;
-    if (input.channel[1].w < w
-     || input.channel[1].h < h
-     || input.channel[2].w < w
-     || input.channel[2].h < h) {
+    int w = input.channel[m+0].w;
+    int h = input.channel[m+0].h;
+    if (input.channel[m+1].w < w
+     || input.channel[m+1].h < h
+     || input.channel[m+2].w < w
+     || input.channel[m+2].h < h) {
         e_printf("Invalid channel dimensions to apply inverse XYB (maybe chroma is subsampled?).\n");
         return false;
     }
+    return true;
+}
 
-    for (int y=0; y<h; y++) {
-      for (int x=0; x<w; x++) {
-        float X = input.channel[1].value(y,x);
-        float Y = input.channel[0].value(y,x);
-        float B = input.channel[2].value(y,x);
-
-
-        X /= input.maxval * X_PRECISION;
-        Y /= input.maxval * Y_PRECISION;
-        B /= input.maxval * B_PRECISION;
+// XYB to linear RGB, scaled to positions in the transfer function table (not clamped yet)
+static void inv_XYB_linear(const pixel_type * RESTRICT p0, const pixel_type * RESTRICT p1, const pixel_type * RESTRICT p2,
+                           float * RESTRICT r, float * RESTRICT g, float * RESTRICT b, int w, float maxval, float n) {
+    const float xmul = 1.0f / (maxval * X_PRECISION), ymul = 1.0f / (maxval * Y_PRECISION), bmul = 1.0f / (maxval * B_PRECISION);
+    const float* bias = &kOpsinAbsorbanceBias[0];
+    const float* mix = &kOpsinAbsorbanceInvMatrix[0];
+    for (int x=0; x<w; x++) {
+        float X = p1[x] * xmul;
+        float Y = p0[x] * ymul;
+        float B = p2[x] * bmul;
 
         float L = Y+X;
         float M = Y-X;
         float S = B;
 
-        L = L*L*L;
-        M = M*M*M;
-        S = S*S*S;
-
-        const float* bias = &kOpsinAbsorbanceBias[0];
-        L -= bias[0];
-        M -= bias[1];
-        S -= bias[2];
+        L = L*L*L - bias[0];
+        M = M*M*M - bias[1];
+        S = S*S*S - bias[2];
 
-        const float* mix = &kOpsinAbsorbanceInvMatrix[0];
-        float r = mix[0] * L + mix[1] * M + mix[2] * S;
-        float g = mix[3] * L + mix[4] * M + mix[5] * S;
-        float b = mix[6] * L + mix[7] * M + mix[8] * S;
+        float rl = mix[0] * L + mix[1] * M + mix[2] * S;
+        float gl = mix[3] * L + mix[4] * M + mix[5] * S;
+        float bl = mix[6] * L + mix[7] * M + mix[8] * S;
 
-        r = LINEAR_TO_SRGB(r);
-        g = LINEAR_TO_SRGB(g);
-        b = LINEAR_TO_SRGB(b);
+        r[x] = rl * n;
+        g[x] = gl * n;
+        b[x] = bl * n;
+    }
+}
 
-        r *= input.maxval;
-        g *= input.maxval;
-        b *= input.maxval;
+static inline pixel_type linear_to_srgb(const linear_to_srgb_table &t, float pos, int minval) {
+    pos = CLAMP(pos, 0.f, (float)t.n);
+    int i = pos;
+    float v = t.value[i] + (t.value[i+1] - t.value[i]) * (pos - i);
+    return CLAMP(v + 0.5f, minval, t.maxval);
+}
 
-        input.channel[0].value(y,x) = CLAMP(r + 0.5, input.minval, input.maxval);
-        input.channel[1].value(y,x) = CLAMP(g + 0.5, input.minval, input.maxval);
-        input.channel[2].value(y,x) = CLAMP(b + 0.5, input.minval, input.maxval);
-      }
+// one row of the inverse (the channels need to be checked and allocated)
+void inv_XYB_row(Image &input, int y) ATTRIBUTE_HOT;
+void inv_XYB_row(Image &input, int y) {
+    static thread_local linear_to_srgb_table table;
+    int m = input.nb_meta_channels;
+    int w = input.channel[m+0].w;
+    if (y >= input.channel[m+0].h) return;
+    table.init(input.maxval);
+    pixel_type *p0 = &input.channel[m+0].data[(size_t)y*w];
+    pixel_type *p1 = &input.channel[m+1].data[(size_t)y*input.channel[m+1].w];
+    pixel_type *p2 = &input.channel[m+2].data[(size_t)y*input.channel[m+2].w];
+    float r[XYB_CHUNK], g[XYB_CHUNK], b[XYB_CHUNK];
+    for (int x0=0; x0<w; x0+=XYB_CHUNK) {
+        int n = std::min(w-x0, XYB_CHUNK);
+        inv_XYB_linear(p0+x0, p1+x0, p2+x0, r, g, b, n, input.maxval, table.n);
+        for (int x=0; x<n; x++) {
+            p0[x0+x] = linear_to_srgb(table, r[x], input.minval);
+            p1[x0+x] = linear_to_srgb(table, g[x], input.minval);
+            p2[x0+x] = linear_to_srgb(table, b[x], input.minval);
+        }
     }
+}
 
+bool inv_XYB(Image &input) {
+    if (!check_inv_XYB(input)) return false;
+    const Channel &ch = input.channel[input.nb_meta_channels];
+    parallel_for(0, ch.h, band_rows(ch.w), [&](int y0, int y1) { for (int y=y0; y<y1; y++) inv_XYB_row(input, y); });
     return true;
 }
 
+// linear RGB to XYB
+static void fwd_XYB_row(pixel_type * RESTRICT p0, pixel_type * RESTRICT p1, pixel_type * RESTRICT p2, int w,
+                        const float *srgb_to_linear, int maxval) {
+    const float* mix = &kOpsinAbsorbanceMatrix[0];
+    const float* bias = &kOpsinAbsorbanceBias[0];
+    const float xmul = maxval * X_PRECISION, ymul = maxval * Y_PRECISION, bmul = maxval * B_PRECISION;
+    for (int x=0; x<w; x++) {
+        float r = srgb_to_linear[CLAMP(p0[x], 0, maxval)];
+        float g = srgb_to_linear[CLAMP(p1[x], 0, maxval)];
+        float b = srgb_to_linear[CLAMP(p2[x], 0, maxval)];
+
+        float L = mix[0] * r + mix[1] * g + mix[2] * b + bias[0];
+        float M = mix[3] * r + mix[4] * g + mix[5] * b + bias[1];
+        float S = mix[6] * r + mix[7] * g + mix[8] * b + bias[2];
+
+        L = cbrtf(L);
+        M = cbrtf(M);
+        S = cbrtf(S);
+
+        float X = (L - M) * 0.5f;
+        float Y = (L + M) * 0.5f;
+        float B = S;
 
+        p0[x] = Y * ymul + 0.5f;
+        p1[x] = X * xmul;
+        p2[x] = B * bmul + 0.5f;
+    }
+}
 
 bool fwd_XYB(Image &input) {
-    int nb_channels = input.channel.size();
+    int nb_channels = input.nb_channels;
     if (nb_channels < 3) {
         e_printf("Invalid number of channels to apply XYB.\n");
         return false;
     }
-    int w = input.channel[0].w;
-    int h = input.channel[0].h;
-    if (input.channel[1].w < w
-     || input.channel[1].h < h
-     || input.channel[2].w < w
-     || input.channel[2].h < h) {
+    int m = input.nb_meta_channels;
+    int w = input.channel[m+0].w;
+    int h = input.channel[m+0].h;
+    if (input.channel[m+1].w < w
+     || input.channel[m+1].h < h
+     || input.channel[m+2].w < w
+     || input.channel[m+2].h < h) {
         e_printf("Invalid channel dimensions to apply XYB.\n");
         return false;
     }
+    if (input.maxval > 4095) {
+        // X is scaled by maxval*X_PRECISION, which would not fit in the channel range for deeper images
+        e_printf("XYB is only supported up to 12 bits per sample.\n");
+        return false;
+    }
 
-    for (int y=0; y<h; y++) {
-      for (int x=0; x<w; x++) {
-        float r = input.channel[0].value(y,x);
-        float g = input.channel[1].value(y,x);
-        float b = input.channel[2].value(y,x);
-
-        r /= input.maxval;
-        g /= input.maxval;
-        b /= input.maxval;
-
-        r = SRGB_TO_LINEAR(r);
-        g = SRGB_TO_LINEAR(g);
-        b = SRGB_TO_LINEAR(b);
-
-        const float* mix = &kOpsinAbsorbanceMatrix[0];
-        const float* bias = &kOpsinAbsorbanceBias[0];
-        float L = mix[0] * r + mix[1] * g + mix[2] * b + bias[0];
-        float M = mix[3] * r + mix[4] * g + mix[5] * b + bias[1];
-        float S = mix[6] * r + mix[7] * g + mix[8] * b + bias[2];
-
-        L = pow(L, 0.333333333333333f);
-        M = pow(M, 0.333333333333333f);
-        S = pow(S, 0.333333333333333f);
-
-        float X = (L - M) * 0.5f;
-        float Y = (L + M) * 0.5f;
-        float B = S;
-
-        X *= input.maxval * X_PRECISION;
-        Y *= input.maxval * Y_PRECISION;
-        B *= input.maxval * B_PRECISION;
+    // the input has at most maxval+1 different values, so the transfer function is just a table lookup
+    std::vector<float> srgb_to_linear(input.maxval+1);
+    for (int i=0; i<=input.maxval; i++) { double c = (double)i/input.maxval; srgb_to_linear[i] = SRGB_TO_LINEAR(c); }
 
-        input.channel[0].value(y,x) = Y + 0.5;
-        input.channel[1].value(y,x) = X;
-        input.channel[2].value(y,x) = B + 0.5;
-      }
+    for (int c=0; c<3; c++) input.channel[m+c].allocate();
+    for (int y=0; y<h; y++) {
+        fwd_XYB_row(&input.channel[m+0].data[(size_t)y*w],
+                    &input.channel[m+1].data[(size_t)y*input.channel[m+1].w],
+                    &input.channel[m+2].data[(size_t)y*input.channel[m+2].w], w, srgb_to_linear.data(), input.maxval);
     }
 
     return true;
@@ -153,4 +203,3 @@ bool XYB(Image &input, bool inverse) {
     if (inverse) return inv_XYB(input);
     else return fwd_XYB(input);
 }
-
@@ -28,9 +28,13 @@ SOFTWARE.
 #include "../io.h"
 #include "../config.h"
 
+// like CLAMP, but written so the compiler can turn it into (vector) min/max instructions
+static inline double clamp_double(double x, double lo, double hi) {
+    x = (x < lo ? lo : x);
+    return (x > hi ? hi : x);
+}
 
-bool inv_YCbCr(Image &input) ATTRIBUTE_HOT;
-bool inv_YCbCr(Image &input) {
+bool check_inv_YCbCr(const Image &input) {
     int nb_channels = input.channel.size();
     if (nb_channels < 3) {
         e_printf("Invalid number of channels to apply inverse YCbCr.\n");
@@ -45,20 +49,46 @@ bool inv_YCbCr(Image &input) {
         e_printf("Invalid channel dimensions to apply inverse YCbCr (maybe chroma is subsampled?).\n");
         return false;
     }
+    return true;
+}
 
-    float half = (input.maxval+1)/2;
-    for (int y=0; y<h; y++) {
-      for (int x=0; x<w; x++) {
-        float yy = input.channel[0].value(y,x);
-        float cb = input.channel[1].value(y,x) - half;
-        float cr = input.channel[2].value(y,x) - half;
-
-        input.channel[0].value(y,x) = CLAMP(yy + 1.402*cr + 0.5, input.minval, input.maxval);
-        input.channel[1].value(y,x) = CLAMP(yy - 0.344136*cb - 0.714136*cr  + 0.5, input.minval, input.maxval);
-        input.channel[2].value(y,x) = CLAMP(yy + 1.772*cb  + 0.5, input.minval, input.maxval);
-      }
+static void inv_YCbCr_row(pixel_type * RESTRICT p0, pixel_type * RESTRICT p1, pixel_type * RESTRICT p2, int w, float half, double minval, double maxval) {
+    for (int x=0; x<w; x++) {
+        float yy = p0[x];
+        float cb = p1[x] - half;
+        float cr = p2[x] - half;
+
+        p0[x] = clamp_double(yy + 1.402*cr + 0.5, minval, maxval);
+        p1[x] = clamp_double(yy - 0.344136*cb - 0.714136*cr  + 0.5, minval, maxval);
+        p2[x] = clamp_double(yy + 1.772*cb  + 0.5, minval, maxval);
     }
+}
+
+static void fwd_YCbCr_row(pixel_type * RESTRICT p0, pixel_type * RESTRICT p1, pixel_type * RESTRICT p2, int w, float half, double minval, double maxval) {
+    for (int x=0; x<w; x++) {
+        float r = p0[x];
+        float g = p1[x];
+        float b = p2[x];
 
+        p0[x] = clamp_double(0.299*r + 0.587*g + 0.114*b, minval, maxval);
+        p1[x] = clamp_double(half - 0.168736*r - 0.331264*g + 0.5*b, minval, maxval);
+        p2[x] = clamp_double(half + 0.5*r - 0.418688*g - 0.081312*b, minval, maxval);
+    }
+}
+
+// one row of the inverse (the channels need to be checked and allocated)
+void inv_YCbCr_row(Image &input, int y) ATTRIBUTE_HOT;
+void inv_YCbCr_row(Image &input, int y) {
+    int w = input.channel[0].w;
+    if (y >= input.channel[0].h) return;
+    inv_YCbCr_row(&input.channel[0].data[(size_t)y*w],
+                  &input.channel[1].data[(size_t)y*input.channel[1].w],
+                  &input.channel[2].data[(size_t)y*input.channel[2].w], w, (input.maxval+1)/2, input.minval, input.maxval);
+}
+
+bool inv_YCbCr(Image &input) {
+    if (!check_inv_YCbCr(input)) return false;
+    parallel_for(0, input.channel[0].h, band_rows(input.channel[0].w), [&](int y0, int y1) { for (int y=y0; y<y1; y++) inv_YCbCr_row(input, y); });
     return true;
 }
 
@@ -78,17 +108,11 @@ bool fwd_YCbCr(Image &input) {
         return false;
     }
 
-    float half = (input.maxval+1)/2;
+    for (int c=0; c<3; c++) input.channel[c].allocate();
     for (int y=0; y<h; y++) {
-      for (int x=0; x<w; x++) {
-        float r = input.channel[0].value(y,x);
-        float g = input.channel[1].value(y,x);
-        float b = input.channel[2].value(y,x);
-
-        input.channel[0].value(y,x) = CLAMP(0.299*r + 0.587*g + 0.114*b, input.minval, input.maxval);
-        input.channel[1].value(y,x) = CLAMP(half - 0.168736*r - 0.331264*g + 0.5*b, input.minval, input.maxval);
-        input.channel[2].value(y,x) = CLAMP(half + 0.5*r - 0.418688*g - 0.081312*b, input.minval, input.maxval);
-      }
+        fwd_YCbCr_row(&input.channel[0].data[(size_t)y*w],
+                      &input.channel[1].data[(size_t)y*input.channel[1].w],
+                      &input.channel[2].data[(size_t)y*input.channel[2].w], w, (input.maxval+1)/2, input.minval, input.maxval);
     }
 
     return true;
@@ -29,8 +29,7 @@ SOFTWARE.
 #include "../config.h"
 
 
-bool inv_YCoCg(Image &input) ATTRIBUTE_HOT;
-bool inv_YCoCg(Image &input) {
+bool check_inv_YCoCg(const Image &input) {
     int m = input.nb_meta_channels;
     int nb_channels = input.nb_channels;
     if (nb_channels < 3) {
@@ -46,19 +45,52 @@ bool inv_YCoCg(Image &input) {
         e_printf("Invalid channel dimensions to apply inverse YCoCg (maybe chroma is subsampled?).\n");
         return false;
     }
-    for (int y=0; y<h; y++) {
-      for (int x=0; x<w; x++) {
-        int Y = CLAMP(input.channel[m+0].value(y,x), 0, input.maxval);
-        int Co = input.channel[m+1].value(y,x);
-        int Cg = input.channel[m+2].value(y,x);
-        int G = CLAMP(Y - ((-Cg)>>1), 0, input.maxval);
-        int B = CLAMP(Y + ((1-Cg)>>1) - (Co>>1), 0, input.maxval);
-        int R = CLAMP(Co + B, 0, input.maxval);
-        input.channel[m+0].value(y,x) = R;
-        input.channel[m+1].value(y,x) = G;
-        input.channel[m+2].value(y,x) = B;
-      }
+    return true;
+}
+
+static void inv_YCoCg_row(pixel_type * RESTRICT p0, pixel_type * RESTRICT p1, pixel_type * RESTRICT p2, int w, int maxval) {
+    for (int x=0; x<w; x++) {
+        int Y = CLAMP(p0[x], 0, maxval);
+        int Co = p1[x];
+        int Cg = p2[x];
+        int G = CLAMP(Y - ((-Cg)>>1), 0, maxval);
+        int B = CLAMP(Y + ((1-Cg)>>1) - (Co>>1), 0, maxval);
+        int R = CLAMP(Co + B, 0, maxval);
+        p0[x] = R;
+        p1[x] = G;
+        p2[x] = B;
+    }
+}
+
+static void fwd_YCoCg_row(pixel_type * RESTRICT p0, pixel_type * RESTRICT p1, pixel_type * RESTRICT p2, int w) {
+    for (int x=0; x<w; x++) {
+        int R = p0[x];
+        int G = p1[x];
+        int B = p2[x];
+        int Y = (((R + B)>>1) + G)>>1;
+        int Co = R - B;
+        int Cg = G - ((R + B)>>1);
+        p0[x] = Y;
+        p1[x] = Co;
+        p2[x] = Cg;
     }
+}
+
+// one row of the inverse (the channels need to be checked and allocated)
+void inv_YCoCg_row(Image &input, int y) ATTRIBUTE_HOT;
+void inv_YCoCg_row(Image &input, int y) {
+    int m = input.nb_meta_channels;
+    int w = input.channel[m+0].w;
+    if (y >= input.channel[m+0].h) return;
+    inv_YCoCg_row(&input.channel[m+0].data[(size_t)y*w],
+                  &input.channel[m+1].data[(size_t)y*input.channel[m+1].w],
+                  &input.channel[m+2].data[(size_t)y*input.channel[m+2].w], w, input.maxval);
+}
+
+bool inv_YCoCg(Image &input) {
+    if (!check_inv_YCoCg(input)) return false;
+    const Channel &ch = input.channel[input.nb_meta_channels];
+    parallel_for(0, ch.h, band_rows(ch.w), [&](int y0, int y1) { for (int y=y0; y<y1; y++) inv_YCoCg_row(input, y); });
     return true;
 }
 
@@ -78,18 +110,11 @@ bool fwd_YCoCg(Image &input) {
         e_printf("Invalid channel dimensions to apply YCoCg.\n");
         return false;
     }
+    for (int c=0; c<3; c++) input.channel[m+c].allocate();
     for (int y=0; y<h; y++) {
-      for (int x=0; x<w; x++) {
-        int R = input.channel[m+0].value(y,x);
-        int G = input.channel[m+1].value(y,x);
-        int B = input.channel[m+2].value(y,x);
-        int Y = (((R + B)>>1) + G)>>1;
-        int Co = R - B;
-        int Cg = G - ((R + B)>>1);
-        input.channel[m+0].value(y,x) = Y;
-        input.channel[m+1].value(y,x) = Co;
-        input.channel[m+2].value(y,x) = Cg;
-      }
+        fwd_YCoCg_row(&input.channel[m+0].data[(size_t)y*w],
+                      &input.channel[m+1].data[(size_t)y*input.channel[m+1].w],
+                      &input.channel[m+2].data[(size_t)y*input.channel[m+2].w], w);
     }
     return true;
 }